@@ -0,0 +1,348 @@
+/* dbx-bench.c : throughput and latency benchmark of dbx module
+ *
+ * Keeps fixed count of queries in flight through dbx_query_format_ex() and
+ * dbx_touch() for given time, then reports QPS, latency percentiles of
+ * queries measured by caller and dbx metrics. By default queries go to
+ * in-process fake server (pg-stub.c) with configured reply latency, so pool
+ * and queue changes could be evaluated without database. Use -h to run
+ * against real server.
+ *
+ * Build from repository root:
+ *   cc -O2 -I/usr/include/postgresql -DCSTUFF_STR_UTILS_WITH_COPY \
+ *      -DCSTUFF_STR_UTILS_WITH_PRINTF -DCSTUFF_STR_UTILS_WITH_TO_TIMESTAMP \
+ *      bench/dbx-bench.c bench/pg-stub.c dbx.c bitset.c str-utils.c \
+ *      -lpq -lpthread -o dbx-bench
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../dbx.h"
+#include "pg-stub.h"
+
+/* -------------------------------------------------------------------------- */
+
+struct bench
+{
+  uint64_t   started;      /* usec of current query submission */
+  int        key;
+};
+
+struct bench_stats
+{
+  uint64_t   queries;
+  uint64_t   errors;
+  uint32_t * latencies;    /* usec */
+  size_t     size;
+  int        in_flight;
+  int        free_count;
+  struct bench ** free_slots;
+};
+
+/* -------------------------------------------------------------------------- */
+
+static struct bench_stats stats;
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t
+bench_time_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+bench_complete( struct bench * slot )
+{
+  uint32_t * latencies;
+  size_t     size;
+
+  if (stats.queries == stats.size)
+  {
+    size = (stats.size) ? stats.size * 2 : 65536;
+
+    if ( (latencies = realloc(stats.latencies, size * sizeof(uint32_t))) )
+    {
+      stats.latencies = latencies;
+      stats.size      = size;
+    }
+  }
+
+  if (stats.queries < stats.size)
+    stats.latencies[ stats.queries++ ] = bench_time_now() - slot->started;
+
+  stats.in_flight--;
+  stats.free_slots[ stats.free_count++ ] = slot;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static bool
+bench_on_result( PGresult * result, int res_i, void * u_data )
+{
+  struct bench * slot = u_data;
+
+  /* single statement query has single result */
+  (void) result;
+  (void) res_i;
+
+  bench_complete( slot );
+
+  return true;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+bench_on_error( const char * e_message, int res_i, void * u_data,
+                                                   const char * e_sql )
+{
+  (void) res_i;
+  (void) e_sql;
+
+  if (!stats.errors++)
+    fprintf(stderr, "dbx-bench: query failed: %s\n", e_message);
+
+  bench_complete( (struct bench *) u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+bench_compare( const void * a, const void * b )
+{
+  uint32_t x = *(const uint32_t *) a,
+           y = *(const uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t
+bench_percentile( double percent )
+{
+  size_t i;
+
+  if (!stats.queries)
+    return 0;
+
+  i = (size_t) (percent * stats.queries / 100);
+
+  return stats.latencies[ (i < stats.queries) ? i : stats.queries - 1 ];
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+bench_usage( const char * name )
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -c N    connections (8)\n"
+    "  -n N    queries in flight (64)\n"
+    "  -t N    seconds to run (5)\n"
+    "  -l N    fake server reply latency in usec (200)\n"
+    "  -P N    pipeline depth per connection (1)\n"
+    "  -S N    prepared statements per connection (0)\n"
+    "  -C N    cache results for N msec (0)\n"
+    "  -k N    count of distinct query parameters (1000)\n"
+    "  -h host real server instead of fake one\n"
+    "  -p port real server port (5432)\n"
+    "  -U user -W password -d database of real server\n",
+    name);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+main( int argc, char ** argv )
+{
+  pg_stub_t            stub = NULL;
+  struct bench       * slots;
+  struct bench       * slot;
+  struct dbx_metrics * metrics;
+  struct dbx_options   options = {0};
+  const char         * host = NULL,
+                     * user = "bench",
+                     * password = "bench",
+                     * database = "bench";
+  int                  connections = 8,
+                       concurrency = 64,
+                       seconds = 5,
+                       latency = 200,
+                       pipeline = 1,
+                       prepared = 0,
+                       keys = 1000,
+                       port = 5432,
+                       key = 0,
+                       i, c;
+  uint64_t             now, start, end;
+  double               elapsed;
+
+  while ( (c = getopt(argc, argv, "c:n:t:l:P:S:C:k:h:p:U:W:d:")) != -1 )
+  {
+    switch (c)
+    {
+      case 'c': connections       = atoi(optarg); break;
+      case 'n': concurrency       = atoi(optarg); break;
+      case 't': seconds           = atoi(optarg); break;
+      case 'l': latency           = atoi(optarg); break;
+      case 'P': pipeline          = atoi(optarg); break;
+      case 'S': prepared          = atoi(optarg); break;
+      case 'C': options.cache_ttl = atoi(optarg); break;
+      case 'k': keys              = atoi(optarg); break;
+      case 'h': host              = optarg;       break;
+      case 'p': port              = atoi(optarg); break;
+      case 'U': user              = optarg;       break;
+      case 'W': password          = optarg;       break;
+      case 'd': database          = optarg;       break;
+      default:
+        bench_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (connections < 1 || concurrency < 1 || seconds < 1 || keys < 1)
+  {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  if (!host)
+  {
+    if (pg_stub_new(&stub, latency) != CSTUFF_SUCCESS)
+    {
+      fprintf(stderr, "dbx-bench: could not start fake server\n");
+      return 1;
+    }
+
+    host = "127.0.0.1";
+    port = pg_stub_get_port(stub);
+  }
+
+  slots            = calloc(concurrency, sizeof(struct bench));
+  stats.free_slots = calloc(concurrency, sizeof(struct bench *));
+  metrics          = calloc(1, sizeof(struct dbx_metrics));
+
+  if (!slots || !stats.free_slots || !metrics)
+  {
+    fprintf(stderr, "dbx-bench: out of memory\n");
+    return 1;
+  }
+
+  for (i = 0; i < concurrency; i++)
+    stats.free_slots[ stats.free_count++ ] = &slots[i];
+
+  if (dbx_init(user, password, database, host, port, connections)
+                                                            != CSTUFF_SUCCESS)
+  {
+    fprintf(stderr, "dbx-bench: could not init dbx\n");
+    return 1;
+  }
+
+  dbx_set_pipeline(pipeline);
+  dbx_set_prepared(prepared);
+
+  if (options.cache_ttl)
+    dbx_set_cache(64 * 1024 * 1024);
+
+  /* wait for pool to connect */
+  end = bench_time_now() + 5000000;
+
+  while (dbx_ready_connections_count() < connections)
+  {
+    if (bench_time_now() > end)
+    {
+      fprintf(stderr, "dbx-bench: could not connect: %s\n", dbx_get_error());
+      return 1;
+    }
+
+    dbx_touch();
+    dbx_sleep(10000);
+  }
+
+  start = now = bench_time_now();
+  end   = start + (uint64_t) seconds * 1000000;
+
+  while (now < end || stats.in_flight)
+  {
+    while (now < end && stats.free_count)
+    {
+      slot          = stats.free_slots[ --stats.free_count ];
+      slot->started = now;
+      slot->key     = key++ % keys;
+
+      if ( !dbx_query_format_ex(&options, "SELECT $1", bench_on_result,
+                                bench_on_error, slot, 1, DBX_INT32, slot->key) )
+      {
+        fprintf(stderr, "dbx-bench: could not add query\n");
+        return 1;
+      }
+
+      stats.in_flight++;
+    }
+
+    dbx_touch();
+    dbx_sleep(1000);
+    now = bench_time_now();
+  }
+
+  elapsed = (now - start) / 1e6;
+
+  dbx_get_metrics(metrics);
+  qsort(stats.latencies, stats.queries, sizeof(uint32_t), bench_compare);
+
+  printf("connections %d, in flight %d, pipeline %d, prepared %d, "
+         "cache %d ms, server %s:%d\n",
+         connections, concurrency, pipeline, prepared, options.cache_ttl,
+         host, port);
+
+  printf("queries %lu, errors %lu, %.3f s, %.0f qps\n",
+         (unsigned long) stats.queries, (unsigned long) stats.errors,
+         elapsed, stats.queries / elapsed);
+
+  printf("latency usec: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+         bench_percentile(50), bench_percentile(90), bench_percentile(99),
+         bench_percentile(99.9), bench_percentile(100));
+
+  printf("dbx p99 usec: wait %lu, first %lu, exec %lu\n",
+         (unsigned long) dbx_histogram_percentile(&metrics->wait, 99),
+         (unsigned long) dbx_histogram_percentile(&metrics->first, 99),
+         (unsigned long) dbx_histogram_percentile(&metrics->exec, 99));
+
+  printf("dbx: saturations %lu, reconnects %lu, cache hits %lu, "
+         "coalesced %lu\n",
+         (unsigned long) metrics->saturations,
+         (unsigned long) metrics->reconnects,
+         (unsigned long) metrics->cache_hits,
+         (unsigned long) metrics->coalesced);
+
+  if (stub)
+    printf("server statements %lu\n",
+           (unsigned long) pg_stub_get_statements(stub));
+
+  dbx_release();
+
+  if (stub)
+    pg_stub_free(stub);
+
+  free(stats.latencies);
+  free(stats.free_slots);
+  free(slots);
+  free(metrics);
+
+  return (stats.errors) ? 2 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,1015 @@
+/* pg-stub.c : source file of fake PostgreSQL server for benchmarks
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "pg-stub.h"
+
+/* -------------------------------------------------------------------------- */
+
+#define PG_STUB_PROTOCOL     196608
+#define PG_STUB_CANCEL       80877102
+#define PG_STUB_SSL          80877103
+#define PG_STUB_GSS          80877104
+
+#define PG_STUB_INT4_OID     23
+#define PG_STUB_TAG_SIZE     32
+#define PG_STUB_NAME_SIZE    64
+#define PG_STUB_EVENTS       64
+#define PG_STUB_READ_SIZE    16384
+
+/* -------------------------------------------------------------------------- */
+
+/* statement or portal */
+struct pg_stub_stmt
+{
+  char name[ PG_STUB_NAME_SIZE ];
+  char tag[ PG_STUB_TAG_SIZE ];
+  bool rows;
+  bool binary;
+};
+
+/* end of output to be sent not before due time */
+struct pg_stub_mark
+{
+  uint64_t due;
+  size_t   end;
+};
+
+struct pg_stub_conn
+{
+  int                   sd;
+  uint32_t              events;
+  bool                  started;
+  bool                  closing;   /* close when output is sent */
+  char                  status;    /* transaction status */
+
+  char                * in;
+  size_t                in_length;
+  size_t                in_size;
+
+  char                * out;
+  size_t                out_length;
+  size_t                out_size;
+  size_t                out_sent;
+
+  struct pg_stub_mark * marks;
+  int                   n_marks;
+  int                   marks_size;
+
+  struct pg_stub_stmt * stmts;     /* stmts[0] is unnamed statement */
+  int                   n_stmts;
+  struct pg_stub_stmt   portal;    /* unnamed portal */
+
+  struct pg_stub_conn * next;
+};
+
+struct pg_stub
+{
+  int                   sd;
+  int                   epoll;
+  int                   timer;
+  int                   wake;
+  int                   port;
+  uint64_t              latency;   /* usec */
+  uint32_t              pid;
+  pthread_t             thread;
+  _Atomic uint64_t      statements;
+  struct pg_stub_conn * conns;
+};
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t
+pg_stub_time_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t
+pg_stub_get_int32( const char * data )
+{
+  uint32_t value;
+
+  memcpy(&value, data, sizeof(value));
+
+  return ntohl(value);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint16_t
+pg_stub_get_int16( const char * data )
+{
+  uint16_t value;
+
+  memcpy(&value, data, sizeof(value));
+
+  return ntohs(value);
+}
+
+/* output ------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+pg_stub_reserve( struct pg_stub_conn * conn, size_t length )
+{
+  char   * data;
+  size_t   size = (conn->out_size) ? conn->out_size : 1024;
+
+  length += conn->out_length;
+
+  if (length <= conn->out_size)
+    return CSTUFF_SUCCESS;
+
+  while (size < length)
+    size *= 2;
+
+  if ( !(data = realloc(conn->out, size)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  conn->out      = data;
+  conn->out_size = size;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+pg_stub_put( struct pg_stub_conn * conn, const void * data, size_t length )
+{
+  memcpy(&conn->out[conn->out_length], data, length);
+  conn->out_length += length;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+pg_stub_put_int32( struct pg_stub_conn * conn, uint32_t value )
+{
+  value = htonl(value);
+  pg_stub_put(conn, &value, sizeof(value));
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+pg_stub_put_int16( struct pg_stub_conn * conn, uint16_t value )
+{
+  value = htons(value);
+  pg_stub_put(conn, &value, sizeof(value));
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* append message with body of given size, returns CSTUFF_MALLOC_ERROR if
+ * there is no memory for it */
+static cstuff_retcode_t
+pg_stub_message( struct pg_stub_conn * conn, char type, size_t length )
+{
+  if (pg_stub_reserve(conn, length + 5) != CSTUFF_SUCCESS)
+    return CSTUFF_MALLOC_ERROR;
+
+  pg_stub_put(conn, &type, 1);
+  pg_stub_put_int32(conn, length + 4);
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+pg_stub_parameter( struct pg_stub_conn * conn, const char * name,
+                                               const char * value )
+{
+  size_t n = strlen(name) + 1,
+         v = strlen(value) + 1;
+
+  if (pg_stub_message(conn, 'S', n + v) != CSTUFF_SUCCESS)
+    return CSTUFF_MALLOC_ERROR;
+
+  pg_stub_put(conn, name, n);
+  pg_stub_put(conn, value, v);
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+pg_stub_ready( struct pg_stub_conn * conn )
+{
+  if (pg_stub_message(conn, 'Z', 1) != CSTUFF_SUCCESS)
+    return CSTUFF_MALLOC_ERROR;
+
+  pg_stub_put(conn, &conn->status, 1);
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+pg_stub_row_description( struct pg_stub_conn * conn, bool binary )
+{
+  static const char name[] = "?column?";
+
+  if (pg_stub_message(conn, 'T', 2 + sizeof(name) + 18) != CSTUFF_SUCCESS)
+    return CSTUFF_MALLOC_ERROR;
+
+  pg_stub_put_int16(conn, 1);
+  pg_stub_put(conn, name, sizeof(name));
+  pg_stub_put_int32(conn, 0);                    /* table */
+  pg_stub_put_int16(conn, 0);                    /* column */
+  pg_stub_put_int32(conn, PG_STUB_INT4_OID);
+  pg_stub_put_int16(conn, 4);                    /* type size */
+  pg_stub_put_int32(conn, (uint32_t) -1);        /* type modifier */
+  pg_stub_put_int16(conn, binary ? 1 : 0);
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* data row and command completion of executed statement */
+static cstuff_retcode_t
+pg_stub_execute( struct pg_stub      * stub,
+                 struct pg_stub_conn * conn,
+                 struct pg_stub_stmt * stmt )
+{
+  size_t length = strlen(stmt->tag) + 1,
+         value  = (stmt->binary) ? 4 : 1;
+
+  if (stmt->rows)
+  {
+    if (pg_stub_message(conn, 'D', 2 + 4 + value) != CSTUFF_SUCCESS)
+      return CSTUFF_MALLOC_ERROR;
+
+    pg_stub_put_int16(conn, 1);
+    pg_stub_put_int32(conn, value);
+
+    if (stmt->binary)
+      pg_stub_put_int32(conn, 1);
+    else
+      pg_stub_put(conn, "1", 1);
+  }
+
+  if (pg_stub_message(conn, 'C', length) != CSTUFF_SUCCESS)
+    return CSTUFF_MALLOC_ERROR;
+
+  pg_stub_put(conn, stmt->tag, length);
+
+  atomic_fetch_add_explicit(&stub->statements, 1, memory_order_relaxed);
+
+  return CSTUFF_SUCCESS;
+}
+
+/* statements --------------------------------------------------------------- */
+
+/* classify SQL statement by its first keyword */
+static void
+pg_stub_stmt_init( struct pg_stub_conn * conn,
+                   struct pg_stub_stmt * stmt,
+                   const char          * sql,
+                   size_t                length )
+{
+  static const char * const rows[] = {"SELECT", "VALUES", "WITH", "SHOW",
+                                      "TABLE"};
+  char   word[ PG_STUB_TAG_SIZE - 8 ];
+  size_t i = 0, j;
+
+  while (length && (isspace((unsigned char) *sql) || *sql == '('))
+  {
+    sql++;
+    length--;
+  }
+
+  while (i < length && i < sizeof(word) - 1 && isalpha((unsigned char) sql[i]))
+  {
+    word[i] = toupper((unsigned char) sql[i]);
+    i++;
+  }
+  word[i] = 0;
+
+  stmt->rows   = false;
+  stmt->binary = false;
+
+  for (j = 0; j < sizeof(rows) / sizeof(rows[0]); j++)
+  {
+    if ( !strcmp(word, rows[j]) )
+    {
+      stmt->rows = true;
+      strcpy(stmt->tag, "SELECT 1");
+      return;
+    }
+  }
+
+  if ( !strcmp(word, "INSERT") )
+    strcpy(stmt->tag, "INSERT 0 1");
+  else if ( !strcmp(word, "UPDATE") || !strcmp(word, "DELETE") )
+    sprintf(stmt->tag, "%s 1", word);
+  else
+    strcpy(stmt->tag, word);
+
+  /* transaction status is reported by ReadyForQuery */
+  if ( !strcmp(word, "BEGIN") || !strcmp(word, "START") )
+    conn->status = 'T';
+  else if ( !strcmp(word, "COMMIT") || !strcmp(word, "ROLLBACK") ||
+            !strcmp(word, "END") || !strcmp(word, "ABORT") )
+    conn->status = 'I';
+}
+
+/* -------------------------------------------------------------------------- */
+
+static struct pg_stub_stmt *
+pg_stub_stmt_find( struct pg_stub_conn * conn, const char * name, bool add )
+{
+  struct pg_stub_stmt * stmts;
+  int                   i;
+
+  for (i = 0; i < conn->n_stmts; i++)
+  {
+    if ( !strcmp(conn->stmts[i].name, name) )
+      return &conn->stmts[i];
+  }
+
+  if (!add)
+    return NULL;
+
+  if ( !(stmts = realloc(conn->stmts, (i + 1) * sizeof(*stmts))) )
+    return NULL;
+
+  conn->stmts = stmts;
+  conn->n_stmts++;
+
+  memset(&stmts[i], 0, sizeof(*stmts));
+  strncpy(stmts[i].name, name, sizeof(stmts[i].name) - 1);
+
+  return &stmts[i];
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* simple query protocol: statements are separated by semicolons outside of
+ * quotes, each one gets its own result */
+static cstuff_retcode_t
+pg_stub_query( struct pg_stub      * stub,
+               struct pg_stub_conn * conn,
+               const char          * sql )
+{
+  struct pg_stub_stmt   stmt;
+  const char          * end;
+  char                  quote = 0;
+  bool                  empty = true;
+
+  for (end = sql; ; end++)
+  {
+    if (quote)
+    {
+      if (*end == quote)
+        quote = 0;
+
+      if (*end)
+        continue;
+    }
+
+    if (*end == '\'' || *end == '"')
+    {
+      quote = *end;
+      continue;
+    }
+
+    if (*end && *end != ';')
+      continue;
+
+    while (sql < end && isspace((unsigned char) *sql))
+      sql++;
+
+    if (sql < end)
+    {
+      empty = false;
+      pg_stub_stmt_init(conn, &stmt, sql, end - sql);
+
+      if ( stmt.rows &&
+           pg_stub_row_description(conn, false) != CSTUFF_SUCCESS )
+      {
+        return CSTUFF_MALLOC_ERROR;
+      }
+
+      if ( pg_stub_execute(stub, conn, &stmt) != CSTUFF_SUCCESS )
+        return CSTUFF_MALLOC_ERROR;
+    }
+
+    if (!*end)
+      break;
+
+    sql = end + 1;
+  }
+
+  if (empty && pg_stub_message(conn, 'I', 0) != CSTUFF_SUCCESS)
+    return CSTUFF_MALLOC_ERROR;
+
+  return pg_stub_ready(conn);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Bind: portal, statement, parameter formats, parameters, result formats */
+static cstuff_retcode_t
+pg_stub_bind( struct pg_stub_conn * conn, const char * data, size_t length )
+{
+  struct pg_stub_stmt * stmt;
+  const char          * end = data + length;
+  int                   i, n;
+  int32_t               size;
+
+  data += strlen(data) + 1;
+
+  if ( !(stmt = pg_stub_stmt_find(conn, data, false)) )
+    return CSTUFF_NOT_FOUND;
+
+  conn->portal = *stmt;
+
+  data += strlen(data) + 1;
+  data += 2 + 2 * pg_stub_get_int16(data);
+
+  for (i = 0, n = pg_stub_get_int16(data), data += 2; i < n; i++)
+  {
+    size = (int32_t) pg_stub_get_int32(data);
+    data += 4 + ((size > 0) ? size : 0);
+  }
+
+  if (data + 4 <= end && pg_stub_get_int16(data) > 0)
+    conn->portal.binary = (pg_stub_get_int16(data + 2) == 1);
+
+  return (pg_stub_message(conn, '2', 0) == CSTUFF_SUCCESS)
+         ? CSTUFF_SUCCESS
+         : CSTUFF_MALLOC_ERROR;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* handle complete message, type is 0 for startup packet */
+static cstuff_retcode_t
+pg_stub_handle( struct pg_stub      * stub,
+                struct pg_stub_conn * conn,
+                char                  type,
+                const char          * data,
+                size_t                length )
+{
+  struct pg_stub_stmt * stmt;
+  cstuff_retcode_t      result = CSTUFF_SUCCESS;
+
+  switch (type)
+  {
+    case 0:
+      if (length < 4)
+        return CSTUFF_PARSE_ERROR;
+
+      switch (pg_stub_get_int32(data))
+      {
+        case PG_STUB_SSL:
+        case PG_STUB_GSS:
+          if (pg_stub_reserve(conn, 1) != CSTUFF_SUCCESS)
+            return CSTUFF_MALLOC_ERROR;
+          pg_stub_put(conn, "N", 1);
+          return CSTUFF_SUCCESS;
+
+        case PG_STUB_PROTOCOL:
+          conn->started = true;
+          conn->status  = 'I';
+
+          if ( pg_stub_message(conn, 'R', 4) != CSTUFF_SUCCESS )
+            return CSTUFF_MALLOC_ERROR;
+          pg_stub_put_int32(conn, 0);
+
+          if ( pg_stub_parameter(conn, "server_version", "16.0")
+                                                          != CSTUFF_SUCCESS ||
+               pg_stub_parameter(conn, "server_encoding", "UTF8")
+                                                          != CSTUFF_SUCCESS ||
+               pg_stub_parameter(conn, "client_encoding", "UTF8")
+                                                          != CSTUFF_SUCCESS ||
+               pg_stub_parameter(conn, "DateStyle", "ISO, MDY")
+                                                          != CSTUFF_SUCCESS ||
+               pg_stub_parameter(conn, "integer_datetimes", "on")
+                                                          != CSTUFF_SUCCESS ||
+               pg_stub_parameter(conn, "standard_conforming_strings", "on")
+                                                          != CSTUFF_SUCCESS ||
+               pg_stub_message(conn, 'K', 8) != CSTUFF_SUCCESS )
+          {
+            return CSTUFF_MALLOC_ERROR;
+          }
+
+          pg_stub_put_int32(conn, ++stub->pid);
+          pg_stub_put_int32(conn, stub->pid);
+
+          return pg_stub_ready(conn);
+
+        default:
+          /* cancel requests are ignored, query is complete anyway */
+          conn->closing = true;
+          return CSTUFF_SUCCESS;
+      }
+
+    case 'Q':
+      return pg_stub_query(stub, conn, data);
+
+    case 'P':
+      if ( !(stmt = pg_stub_stmt_find(conn, data, true)) )
+        return CSTUFF_MALLOC_ERROR;
+
+      data += strlen(data) + 1;
+      pg_stub_stmt_init(conn, stmt, data, strlen(data));
+      result = pg_stub_message(conn, '1', 0);
+      break;
+
+    case 'B':
+      return pg_stub_bind(conn, data, length);
+
+    case 'D':
+      stmt = (data[0] == 'S') ? pg_stub_stmt_find(conn, data + 1, false)
+                              : &conn->portal;
+      if (!stmt)
+        return CSTUFF_NOT_FOUND;
+
+      if (data[0] == 'S')
+      {
+        if ( pg_stub_message(conn, 't', 2) != CSTUFF_SUCCESS )
+          return CSTUFF_MALLOC_ERROR;
+        pg_stub_put_int16(conn, 0);
+      }
+
+      result = (stmt->rows) ? pg_stub_row_description(conn, stmt->binary)
+                            : pg_stub_message(conn, 'n', 0);
+      break;
+
+    case 'E':
+      result = pg_stub_execute(stub, conn, &conn->portal);
+      break;
+
+    case 'C':
+      result = pg_stub_message(conn, '3', 0);
+      break;
+
+    case 'S':
+      result = pg_stub_ready(conn);
+      break;
+
+    case 'X':
+      conn->closing = true;
+      break;
+
+    default:
+      /* Flush and unsupported messages */
+      break;
+  }
+
+  return result;
+}
+
+/* connections -------------------------------------------------------------- */
+
+static void
+pg_stub_conn_free( struct pg_stub * stub, struct pg_stub_conn * conn )
+{
+  struct pg_stub_conn ** p_conn;
+
+  for (p_conn = &stub->conns; *p_conn != conn; p_conn = &(*p_conn)->next);
+  *p_conn = conn->next;
+
+  epoll_ctl(stub->epoll, EPOLL_CTL_DEL, conn->sd, NULL);
+  close(conn->sd);
+
+  free(conn->in);
+  free(conn->out);
+  free(conn->marks);
+  free(conn->stmts);
+  free(conn);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+pg_stub_accept( struct pg_stub * stub )
+{
+  struct pg_stub_conn * conn;
+  struct epoll_event    ev;
+  int                   sd, on = 1;
+
+  while ( (sd = accept(stub->sd, NULL, NULL)) != -1 )
+  {
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if ( !(conn = calloc(1, sizeof(struct pg_stub_conn))) )
+    {
+      close(sd);
+      continue;
+    }
+
+    /* unnamed statement always exists */
+    if ( !pg_stub_stmt_find(conn, "", true) )
+    {
+      free(conn);
+      close(sd);
+      continue;
+    }
+
+    conn->sd     = sd;
+    conn->events = EPOLLIN;
+    conn->next   = stub->conns;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(stub->epoll, EPOLL_CTL_ADD, sd, &ev) == -1)
+    {
+      free(conn->stmts);
+      free(conn);
+      close(sd);
+      continue;
+    }
+
+    stub->conns = conn;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* read available data and handle complete messages */
+static cstuff_retcode_t
+pg_stub_conn_read( struct pg_stub * stub, struct pg_stub_conn * conn )
+{
+  struct pg_stub_mark * marks;
+  char                * data;
+  size_t                offset = 0, length;
+  ssize_t               rc;
+  char                  type;
+
+  for (;;)
+  {
+    if (conn->in_size - conn->in_length < PG_STUB_READ_SIZE)
+    {
+      length = conn->in_size + PG_STUB_READ_SIZE;
+
+      if ( !(data = realloc(conn->in, length)) )
+        return CSTUFF_MALLOC_ERROR;
+
+      conn->in      = data;
+      conn->in_size = length;
+    }
+
+    rc = recv(conn->sd, &conn->in[conn->in_length],
+                        conn->in_size - conn->in_length, 0);
+
+    if (rc > 0)
+    {
+      conn->in_length += rc;
+      continue;
+    }
+
+    if (rc == 0)
+      return CSTUFF_NOT_FOUND;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      break;
+
+    if (errno != EINTR)
+      return CSTUFF_SYSCALL_ERROR;
+  }
+
+  length = conn->out_length;
+
+  while (!conn->closing)
+  {
+    data = &conn->in[offset];
+    rc   = conn->in_length - offset;
+
+    if (conn->started)
+    {
+      if (rc < 5 || rc < 1 + (ssize_t) pg_stub_get_int32(data + 1))
+        break;
+
+      type    = data[0];
+      rc      = 1 + pg_stub_get_int32(data + 1);
+      data   += 5;
+    }
+    else
+    {
+      if (rc < 4 || rc < (ssize_t) pg_stub_get_int32(data))
+        break;
+
+      type    = 0;
+      rc      = pg_stub_get_int32(data);
+      data   += 4;
+    }
+
+    if (rc < 4)
+      return CSTUFF_PARSE_ERROR;
+
+    if ( pg_stub_handle(stub, conn, type, data,
+                  rc - (data - &conn->in[offset])) == CSTUFF_MALLOC_ERROR )
+    {
+      return CSTUFF_MALLOC_ERROR;
+    }
+
+    offset += rc;
+  }
+
+  memmove(conn->in, &conn->in[offset], conn->in_length - offset);
+  conn->in_length -= offset;
+
+  if (conn->out_length == length)
+    return CSTUFF_SUCCESS;
+
+  if (conn->n_marks == conn->marks_size)
+  {
+    length = (conn->marks_size) ? conn->marks_size * 2 : 16;
+
+    if ( !(marks = realloc(conn->marks, length * sizeof(*marks))) )
+      return CSTUFF_MALLOC_ERROR;
+
+    conn->marks      = marks;
+    conn->marks_size = length;
+  }
+
+  conn->marks[conn->n_marks].due = pg_stub_time_now() + stub->latency;
+  conn->marks[conn->n_marks].end = conn->out_length;
+  conn->n_marks++;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* send output which is due, returns due time of the next output or 0 */
+static uint64_t
+pg_stub_conn_write( struct pg_stub      * stub,
+                    struct pg_stub_conn * conn,
+                    uint64_t              now )
+{
+  struct epoll_event ev;
+  size_t             end = conn->out_sent;
+  ssize_t            rc;
+  int                i;
+
+  for (i = 0; i < conn->n_marks && conn->marks[i].due <= now; i++)
+    end = conn->marks[i].end;
+
+  if (i)
+  {
+    conn->n_marks -= i;
+    memmove(conn->marks, &conn->marks[i], conn->n_marks * sizeof(*conn->marks));
+  }
+
+  while (conn->out_sent < end)
+  {
+    rc = send(conn->sd, &conn->out[conn->out_sent], end - conn->out_sent,
+                                                    MSG_NOSIGNAL);
+    if (rc > 0)
+      conn->out_sent += rc;
+    else if (rc == -1 && errno == EINTR)
+      continue;
+    else
+      break;
+  }
+
+  if (conn->out_sent == conn->out_length)
+  {
+    conn->out_sent   = 0;
+    conn->out_length = 0;
+  }
+
+  ev.events = (conn->out_sent < end) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+
+  if (ev.events != conn->events)
+  {
+    ev.data.ptr  = conn;
+    conn->events = ev.events;
+    epoll_ctl(stub->epoll, EPOLL_CTL_MOD, conn->sd, &ev);
+  }
+
+  return (conn->n_marks) ? conn->marks[0].due : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void *
+pg_stub_run( void * u_data )
+{
+  struct pg_stub      * stub = u_data;
+  struct pg_stub_conn * conn, * next;
+  struct epoll_event    events[ PG_STUB_EVENTS ];
+  struct itimerspec     timer;
+  uint64_t              now, due, next_due;
+  int                   i, n;
+
+  for (;;)
+  {
+    if ( (n = epoll_wait(stub->epoll, events, PG_STUB_EVENTS, -1)) == -1 )
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      if (events[i].data.ptr == &stub->wake)
+        return NULL;
+
+      if (events[i].data.ptr == &stub->sd)
+      {
+        pg_stub_accept(stub);
+        continue;
+      }
+
+      if (events[i].data.ptr == &stub->timer)
+      {
+        while (read(stub->timer, &now, sizeof(now)) == -1 && errno == EINTR);
+        continue;
+      }
+
+      conn = events[i].data.ptr;
+
+      if ( (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+           pg_stub_conn_read(stub, conn) != CSTUFF_SUCCESS )
+      {
+        conn->closing  = true;
+        conn->n_marks  = 0;
+        conn->out_sent = conn->out_length;
+      }
+    }
+
+    /* send replies which are due and arm timer for the next ones */
+    now      = pg_stub_time_now();
+    next_due = 0;
+
+    for (conn = stub->conns; conn; conn = next)
+    {
+      next = conn->next;
+      due  = pg_stub_conn_write(stub, conn, now);
+
+      if (conn->closing && !conn->out_length)
+      {
+        pg_stub_conn_free(stub, conn);
+        continue;
+      }
+
+      if (due && (!next_due || due < next_due))
+        next_due = due;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+
+    if (next_due)
+    {
+      timer.it_value.tv_sec  = next_due / 1000000;
+      timer.it_value.tv_nsec = (next_due % 1000000) * 1000;
+    }
+
+    timerfd_settime(stub->timer, TFD_TIMER_ABSTIME, &timer, NULL);
+  }
+
+  return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+pg_stub_watch( pg_stub_t self, int * p_sd )
+{
+  struct epoll_event ev;
+
+  ev.events   = EPOLLIN;
+  ev.data.ptr = p_sd;
+
+  return (epoll_ctl(self->epoll, EPOLL_CTL_ADD, *p_sd, &ev) == -1)
+         ? CSTUFF_SYSCALL_ERROR
+         : CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+pg_stub_new( pg_stub_t * self, int latency_usec )
+{
+  cstuff_retcode_t     result = CSTUFF_SUCCESS;
+  pg_stub_t            stub;
+  struct sockaddr_in   addr;
+  socklen_t            length = sizeof(addr);
+
+  if ( !(stub = calloc(1, sizeof(struct pg_stub))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  stub->latency = (latency_usec > 0) ? latency_usec : 0;
+  stub->sd      = -1;
+  stub->timer   = -1;
+  stub->wake    = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ( (stub->epoll = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+       (stub->timer = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC)) == -1 ||
+       (stub->wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+       (stub->sd    = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1 ||
+       bind(stub->sd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+       listen(stub->sd, SOMAXCONN) == -1 ||
+       getsockname(stub->sd, (struct sockaddr *) &addr, &length) == -1 )
+  {
+    RAISE( CSTUFF_SYSCALL_ERROR, except );
+  }
+
+  stub->port = ntohs(addr.sin_port);
+
+  if ( (result = pg_stub_watch(stub, &stub->sd))    != CSTUFF_SUCCESS ||
+       (result = pg_stub_watch(stub, &stub->timer)) != CSTUFF_SUCCESS ||
+       (result = pg_stub_watch(stub, &stub->wake))  != CSTUFF_SUCCESS )
+  {
+    goto except;
+  }
+
+  if (pthread_create(&stub->thread, NULL, pg_stub_run, stub) != 0)
+    RAISE( CSTUFF_SYSCALL_ERROR, except );
+
+  *self = stub;
+
+  return CSTUFF_SUCCESS;
+
+except:
+  if (stub->sd != -1)
+    close(stub->sd);
+  if (stub->wake != -1)
+    close(stub->wake);
+  if (stub->timer != -1)
+    close(stub->timer);
+  if (stub->epoll != -1)
+    close(stub->epoll);
+  free(stub);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+pg_stub_free( pg_stub_t self )
+{
+  uint64_t value = 1;
+
+  while (write(self->wake, &value, sizeof(value)) == -1 && errno == EINTR);
+  pthread_join(self->thread, NULL);
+
+  while (self->conns)
+    pg_stub_conn_free(self, self->conns);
+
+  close(self->sd);
+  close(self->wake);
+  close(self->timer);
+  close(self->epoll);
+  free(self);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+pg_stub_get_port( pg_stub_t self )
+{
+  return self->port;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+pg_stub_get_statements( pg_stub_t self )
+{
+  return atomic_load_explicit(&self->statements, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,52 @@
+/* pg-stub.h : header file of fake PostgreSQL server for benchmarks
+ *
+ * Server speaks enough of PostgreSQL v3 wire protocol for libpq to connect
+ * without authentication and run simple and extended protocol queries,
+ * including pipelines and prepared statements. Every statement returning
+ * rows (SELECT, VALUES, WITH, SHOW) gets one int4 row with value 1, text or
+ * binary as requested, other statements get their command tag only. COPY
+ * and authentication are not supported, SSL and GSS encryption is refused.
+ *
+ * Replies to each received packet are delayed by configured latency, so it
+ * emulates network and execution time without server load.
+ * */
+#ifndef _CSTUFF_PG_STUB_H_
+#define _CSTUFF_PG_STUB_H_
+
+#include <stdint.h>
+
+#include "../retcodes.h"
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct pg_stub * pg_stub_t;
+
+/* -------------------------------------------------------------------------- */
+
+/* start server thread listening on 127.0.0.1 on random port
+ * */
+cstuff_retcode_t
+pg_stub_new( pg_stub_t * self, int latency_usec );
+
+/* -------------------------------------------------------------------------- */
+
+/* stop server thread and close all its connections
+ * */
+void
+pg_stub_free( pg_stub_t self );
+
+/* -------------------------------------------------------------------------- */
+
+int
+pg_stub_get_port( pg_stub_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* count of executed statements, safe to be called from any thread
+ * */
+uint64_t
+pg_stub_get_statements( pg_stub_t self );
+
+/* -------------------------------------------------------------------------- */
+
+#endif
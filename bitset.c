@@ -0,0 +1,110 @@
+/* bitset.c : source file of the bitset_t module
+ * */
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitset.h"
+
+/* -------------------------------------------------------------------------- */
+
+#define BITSET_WORDS(size) (((size) + 63) >> 6)
+
+/* -------------------------------------------------------------------------- */
+
+bitset_t
+bitset_new(int size)
+{
+  bitset_t self = calloc(1, sizeof(struct bitset));
+
+  if (self)
+  {
+    if ( (self->words = calloc(BITSET_WORDS(size), sizeof(uint64_t))) != NULL )
+      self->size = size;
+    else
+    {
+      free(self);
+      self = NULL;
+    }
+  }
+
+  return self;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+bitset_free(bitset_t self)
+{
+  if (self)
+  {
+    free(self->words);
+    free(self);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+bitset_fill(bitset_t self, int value)
+{
+  int words = BITSET_WORDS(self->size);
+
+  memset(self->words, value ? 0xFF : 0, words * sizeof(uint64_t));
+
+  /* keep bits beyond size unset */
+  if (value && (self->size & 63))
+    self->words[words-1] = BITSET_MASK(self->size) - 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+bitset_find_first_set(bitset_t self)
+{
+  int i,
+      words = BITSET_WORDS(self->size);
+
+  for (i=0; i<words; i++)
+  {
+    if (self->words[i])
+      return (i << 6) + __builtin_ctzll(self->words[i]);
+  }
+
+  return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+bitset_find_first_free(bitset_t self)
+{
+  int i, result,
+      words = BITSET_WORDS(self->size);
+
+  for (i=0; i<words; i++)
+  {
+    if (~self->words[i])
+    {
+      result = (i << 6) + __builtin_ctzll(~self->words[i]);
+      return (result < self->size) ? result : -1;
+    }
+  }
+
+  return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+bitset_count(bitset_t self)
+{
+  int i, result = 0,
+      words = BITSET_WORDS(self->size);
+
+  for (i=0; i<words; i++)
+    result += __builtin_popcountll(self->words[i]);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,94 @@
+/* bitset.h : header file of the bitset_t module
+ * */
+#ifndef _CSTUFF_BITSET_H_
+#define _CSTUFF_BITSET_H_
+
+#include <stdint.h>
+
+/* MODULE: bitset_t
+ * Fixed size set of bits of any length */
+
+/* structure ---------------------------------------------------------------- */
+
+struct bitset
+{
+  uint64_t * words; /* bits storage */
+  int        size;  /* number of bits */
+};
+
+typedef struct bitset * bitset_t;
+
+/* functions ---------------------------------------------------------------- */
+
+#define BITSET_WORD(index) ((index) >> 6)
+#define BITSET_MASK(index) ((uint64_t) 1 << ((index) & 63))
+
+/* set, unset or test bit with index macros
+ * @self   : bitset_t instance
+ * @index  : bit index
+ * */
+#define bitset_set(self, index) \
+        ((self)->words[ BITSET_WORD(index) ] |= BITSET_MASK(index))
+
+#define bitset_unset(self, index) \
+        ((self)->words[ BITSET_WORD(index) ] &= ~BITSET_MASK(index))
+
+#define bitset_test(self, index) \
+        (((self)->words[ BITSET_WORD(index) ] & BITSET_MASK(index)) != 0)
+
+/* -------------------------------------------------------------------------- */
+
+/* create new bitset_t object with all bits unset
+ * @size   : number of bits
+ * @result : new bitset_t instance
+ * */
+bitset_t
+bitset_new(int size);
+
+/* -------------------------------------------------------------------------- */
+
+/* free resources allocated for bitset_t instance
+ * @self : bitset_t instance
+ * */
+void
+bitset_free(bitset_t self);
+
+/* -------------------------------------------------------------------------- */
+
+/* set or unset all bits
+ * @self  : bitset_t instance
+ * @value : 0 to unset, otherwise set
+ * */
+void
+bitset_fill(bitset_t self, int value);
+
+/* -------------------------------------------------------------------------- */
+
+/* find index of the first set bit
+ * @self   : bitset_t instance
+ * @result : bit index or -1 if no bit is set
+ * */
+int
+bitset_find_first_set(bitset_t self);
+
+/* -------------------------------------------------------------------------- */
+
+/* find index of the first unset bit
+ * @self   : bitset_t instance
+ * @result : bit index or -1 if all bits are set
+ * */
+int
+bitset_find_first_free(bitset_t self);
+
+/* -------------------------------------------------------------------------- */
+
+/* count set bits
+ * @self   : bitset_t instance
+ * @result : number of set bits
+ * */
+int
+bitset_count(bitset_t self);
+
+/* -------------------------------------------------------------------------- */
+
+#endif
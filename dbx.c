@@ -4,875 +4,5710 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdarg.h>
-#include <locale.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "retcodes.h"
-#include "list.h"
 #include "str-utils.h"
-#include "sock-utils.h"
+#include "bitset.h"
 #include "dbx.h"
 
 /* -------------------------------------------------------------------------- */
 
+#ifndef DBX_EPOLL_EVENTS
+#define DBX_EPOLL_EVENTS 64
+#endif
+
+/* commands sent for request, in order */
+#define DBX_STAGE_DEALLOCATE (1<<0)
+#define DBX_STAGE_PREPARE    (1<<1)
+#define DBX_STAGE_EXECUTE    (1<<2)
+#define DBX_STAGE_ROLLBACK   (1<<3)
+
+#define DBX_STMT_NAME_SIZE 24
+
+/* default weights of priority classes */
+#ifndef DBX_WEIGHT_HIGH
+#define DBX_WEIGHT_HIGH   8
+#endif
+
+#ifndef DBX_WEIGHT_NORMAL
+#define DBX_WEIGHT_NORMAL 4
+#endif
+
+#ifndef DBX_WEIGHT_LOW
+#define DBX_WEIGHT_LOW    1
+#endif
+
+/* COPY states of connection */
+#define DBX_COPY_IN          (1<<0) /* data is being produced */
+#define DBX_COPY_END         (1<<1) /* data is complete, end is not sent */
+#define DBX_COPY_ABORT       (1<<2) /* data was aborted, end is not sent */
+#define DBX_COPY_OUT         (1<<3) /* data is being received */
+
+#define DBX_COPY_SENDING (DBX_COPY_IN | DBX_COPY_END | DBX_COPY_ABORT)
+
+/* max calls of COPY data producer per connection event */
+#ifndef DBX_COPY_CHUNKS
+#define DBX_COPY_CHUNKS 16
+#endif
+
+/* epoll data of context inbox eventfd */
+#define DBX_INBOX_EVENT UINT32_MAX
+
+/* routes of requests: primary only or read only ones balanced on replicas */
+#define DBX_ROUTE_PRIMARY 0
+#define DBX_ROUTE_REPLICA 1
+#define DBX_ROUTES        2
+
+/* epoll event of LISTEN connection */
+#define DBX_LISTEN_EVENT (UINT32_MAX - 1)
+
+/* epoll event of cancel request connection, lower bits are connection slot */
+#define DBX_CANCEL_EVENT (1U<<31)
+
+/* reasons of request cancellation */
+#define DBX_CANCEL_USER    (1<<0) /* dbx_cancel() of request in flight */
+#define DBX_CANCEL_TIMEOUT (1<<1) /* statement timeout is over */
+#define DBX_CANCEL_SENT    (1<<2) /* server was asked to cancel query */
+
+/* reconnect delay limits in milliseconds */
+#ifndef DBX_RECONNECT_MIN
+#define DBX_RECONNECT_MIN 100
+#endif
+
+#ifndef DBX_RECONNECT_MAX
+#define DBX_RECONNECT_MAX 10000
+#endif
+
+/* milliseconds for server to stop cancelled query before connection drop */
+#ifndef DBX_CANCEL_GRACE
+#define DBX_CANCEL_GRACE 5000
+#endif
+
+/* parameters of dbx_sql_vformat_to() decoded on stack, more require malloc */
+#ifndef DBX_SQL_PARAMS_STACK
+#define DBX_SQL_PARAMS_STACK 16
+#endif
+
+/* minimal size of requests index table, power of two */
+#ifndef DBX_INDEX_SIZE
+#define DBX_INDEX_SIZE 64
+#endif
+
+/* thread local buffer of dbx_sql_vformat() is freed if grown bigger */
+#ifndef DBX_SQL_BUFFER_KEEP
+#define DBX_SQL_BUFFER_KEEP 65536
+#endif
+
+/* -------------------------------------------------------------------------- */
+
 static const char dbxUriFormat[] = "postgresql://%s:%s@%s:%d/%s",
                   dbxNullStr[]   = "NULL",
                   dbxTrueStr[]   = "TRUE",
-                  dbxFalseStr[]  = "FALSE";
+                  dbxFalseStr[]  = "FALSE",
+                  dbxAbortStr[]  = "query was aborted in pipeline",
+                  dbxCopyAbortStr[] = "COPY was aborted by client",
+                  dbxCopyLostStr[]  = "connection was lost during COPY",
+                  dbxExpiredStr[]   = "query deadline expired",
+                  dbxTimeoutStr[]   = "query timeout expired",
+                  dbxNoMemoryStr[]  = "out of memory",
+                  dbxRollbackStr[]  = "ROLLBACK",
+                  dbxBeginStr[]     = "BEGIN;\n",
+                  dbxCommitStr[]    = "COMMIT;\n";
 
 /* -------------------------------------------------------------------------- */
 
+/* parameter of dbx_sql_vformat_to(), fetched from va_list as is */
 struct dbx_param
 {
-  const char   * value;
-  int            length;
   dbx_param_t    type;
+  union
+  {
+    int64_t       i;
+    uint64_t      u;
+    long double   f;
+    time_t        ts;
+    const char  * str;
+  } value;
 };
 
 /* -------------------------------------------------------------------------- */
 
-/* connection URI */
-static char    * dbxUri;
+/* formatting buffer of dbx_sql_vformat() */
+static __thread struct dbx_sql_buffer dbxSqlBuffer;
 
 /* -------------------------------------------------------------------------- */
 
-/* connections pointers */
-PGconn        ** dbxConnPool = NULL;
-
-/* connections number */
-static int       dbxConnSize = 0;
+/* prepared statement */
+struct dbx_stmt
+{
+  char     * sql;                      /* statement key: sql format string */
+  uint32_t   hash;
+  uint64_t   used;                     /* LRU stamp, 0 if entry is free */
+  char       name[DBX_STMT_NAME_SIZE];
+};
 
-/* connections number */
-static int       dbxConnIter;
+typedef struct dbx_stmt * dbx_stmt_t;
 
-/* connection mask 1 = connected, 0 = not connected */
-static uint64_t  dbxConnMask;
+/* -------------------------------------------------------------------------- */
 
-/* business mask 1 = busy, 0 = available */
-static uint64_t  dbxConnBusy;
+/* connection slot */
+struct dbx_conn
+{
+  PGconn             * pg;      /* libpq connection, NULL if not assigned */
+  struct dbx_request * req;     /* first request in flight */
+  struct dbx_request * tail;    /* last request in flight */
+  int                  depth;   /* number of requests in flight */
+  int                  syncs;   /* number of pending pipeline syncs */
+  int                  cell;    /* pgres polling status or result counter */
+  int                  sd;      /* socket registered in epoll, -1 if none */
+  uint32_t             events;  /* epoll events socket is registered for */
+  struct dbx_stmt    * stmts;   /* prepared statements cache */
+  int                  n_stmts; /* size of prepared statements cache */
+  uint32_t             seq;     /* prepared statements name counter */
+  int                  copy;    /* DBX_COPY_* state of request in flight */
+  struct dbx_sql_buffer copy_data; /* COPY data waiting to be queued */
+  int                  endpoint; /* index of endpoint of slot */
+  int                  failures; /* connection attempts failed in a row */
+  uint64_t             retry_at; /* monotonic usec of the next attempt */
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  PGcancelConn       * cancel;    /* cancel request in progress or NULL */
+  int                  cancel_sd; /* its socket registered in epoll or -1 */
+#endif
+};
 
-/* pgres polling and result counter */
-static int     * dbxConnCell;
+typedef struct dbx_conn * dbx_conn_t;
 
 /* -------------------------------------------------------------------------- */
 
-const char     * dbxErrorMessage;
-
-/* -------------------------------------------------------------------------- */
+/* LISTEN subscription */
+struct dbx_channel
+{
+  char               * name;
+  dbx_on_notify_t      on_notify;
+  void               * u_data;
+  bool                 subscribed; /* LISTEN was sent */
+  bool                 removed;    /* UNLISTEN has to be sent */
+  struct dbx_channel * next;
+};
 
-/* requests queue */
-static list_t    dbxQueue;
+/* dedicated connection for notifications, it is not a part of pool */
+struct dbx_listener
+{
+  struct dbx_conn      conn;
+  bool                 ready;      /* connection is established */
+  bool                 dirty;      /* subscriptions have to be sent */
+  struct dbx_channel * channels;
+};
 
 /* -------------------------------------------------------------------------- */
 
-/* query identificator */
-static uint64_t dbxQueryId;
+#ifndef LIBPQ_HAS_ASYNC_CANCEL
 
-/* dbx_request_t ------------------------------------------------------------ */
+/* blocking cancel request waiting for worker */
+struct dbx_cancel_job
+{
+  PGcancel              * cancel;
+  struct dbx_cancel_job * next;
+};
 
-struct dbx_request
+/* worker thread of context sending blocking cancel requests one by one, so
+ * burst of timeouts does not start thread per query */
+struct dbx_canceller
 {
-  uint64_t           id;
-  const char       * sql;
-  char             * ptr;    /* will be free if is set */
-  void             * u_data;
-  PGconn           * conn;
-  dbx_on_result_t    on_result;
-  dbx_on_error_t     on_error;
+  pthread_t               thread;
+  pthread_mutex_t         lock;
+  pthread_cond_t          cond;
+  struct dbx_cancel_job * head;
+  struct dbx_cancel_job * tail;
+  bool                    started;
+  bool                    stop;
 };
 
-typedef struct dbx_request * dbx_request_t;
+#endif
 
-static void
-dbx_request_free(dbx_request_t req)
+/* -------------------------------------------------------------------------- */
+
+/* database server with its sub-pool of connection slots */
+struct dbx_endpoint
 {
-  if (req->ptr)
-    free( (void *) req->ptr);
-  free(req);
-}
+  char * uri;    /* connection URI */
+  int    first;  /* the first slot of sub-pool */
+  int    size;   /* number of slots */
+};
 
 /* -------------------------------------------------------------------------- */
 
-static dbx_request_t
-dbx_queue_get( PGconn * conn )
+/* requests queue: FIFO of requests waiting for a connection */
+struct dbx_queue
 {
-  int             i = 0;
-  dbx_request_t   req = NULL;
+  struct dbx_request * head;
+  struct dbx_request * tail;
+  int                  count;
+};
 
-  while (i < dbxQueue->count)
-  {
-    req = list_index(dbxQueue, i);
+/* -------------------------------------------------------------------------- */
 
-    if ( req->conn == conn ) break;
+/* latency histogram, written by owner thread only and read by any thread */
+struct dbx_hist
+{
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[DBX_HISTOGRAM_BUCKETS];
+};
 
-    req = NULL;
+/* results cache, see dbx_cache_* */
+struct dbx_cache
+{
+  struct dbx_cache_entry ** table;       /* hash table of entries */
+  uint32_t                  table_size;  /* power of two */
+  uint32_t                  count;       /* entries in table */
+  size_t                    size;        /* memory used by cached entries */
+  size_t                    limit;       /* 0 - cache is disabled */
+  struct dbx_cache_entry  * head;        /* the most recently used entry */
+  struct dbx_cache_entry  * tail;        /* the least recently used entry */
+  struct dbx_cache_entry  * flight;      /* entries of queries in flight */
+  struct dbx_request      * lookup;      /* requests waiting for lookup */
+  struct dbx_request      * lookup_tail;
+};
 
-    i++;
-  }
-  return req;
-}
+/* -------------------------------------------------------------------------- */
 
+/* metrics of context, layout follows struct dbx_metrics */
+struct dbx_stats
+{
+  _Atomic uint64_t queries;
+  _Atomic uint64_t errors;
+  _Atomic uint64_t expired;
+  _Atomic uint64_t timeouts;
+  _Atomic uint64_t reconnects;
+  _Atomic uint64_t saturations;
+  _Atomic uint64_t cache_hits;
+  _Atomic uint64_t coalesced;
+  _Atomic uint64_t cache_size;
+  _Atomic uint64_t queued;
+  _Atomic uint64_t active;
+  _Atomic uint64_t connections;
+  _Atomic uint64_t connecting;
+  _Atomic uint64_t down;
+  struct dbx_hist  wait;
+  struct dbx_hist  first;
+  struct dbx_hist  exec;
+};
 
 /* -------------------------------------------------------------------------- */
 
-static void
-dbx_queue_release( PGconn * conn )
+/* engine instance, driven by the thread that created it */
+struct dbx_context
 {
-  int             i = 0;
-  dbx_request_t   req = NULL;
+  struct dbx_endpoint * endpoints;  /* primary followed by replicas */
+  int                  n_endpoints;
+  struct dbx_conn    * conn;        /* connections slots */
+  int                  conn_size;   /* connections number */
+  int                  conn_down;   /* number of slots without connection */
+  bitset_t             conn_mask;   /* 1 = connected, 0 = not connected */
+  bitset_t             conn_busy;   /* 1 = busy or not connected, 0 = free */
+  int                  active;      /* number of requests in flight */
+  int                  epoll;       /* epoll instance watching all sockets */
+  int                  inbox_fd;    /* eventfd signaling inbox submissions */
+  int                  pipeline;    /* max requests in flight per connection */
+  int                  stmt_limit;  /* prepared statements cache size */
+  uint64_t             stmt_stamp;  /* prepared statements LRU clock */
+  const char         * error;
+  char                 error_buffer[256];
+  /* queue per route and priority class, weighted round robin credits */
+  struct dbx_queue     queue[DBX_ROUTES][DBX_PRIORITIES];
+  int                  credit[DBX_ROUTES][DBX_PRIORITIES];
+  int                  weight[DBX_PRIORITIES];
+  int                  exclusive;   /* queued requests out of pipeline */
+  int                  drain;       /* slot reserved for them or -1 */
+  uint64_t             expiry;      /* the earliest deadline of queue */
+  uint64_t             conn_expiry; /* the earliest timer of queries in
+                                       flight, 0 if cancel is requested */
+  uint64_t             retry_at;    /* the earliest reconnect of slots */
+  uint64_t             retry_min;   /* reconnect delay limits, usec */
+  uint64_t             retry_max;
+  uint32_t             seed;        /* reconnect delay jitter */
+  struct dbx_request ** index;      /* requests by id, see dbx_index_* */
+  uint32_t             index_size;  /* power of two */
+  uint32_t             index_count; /* indexed requests, upper bound */
+  pthread_t            owner;
+  struct dbx_cache     cache;
+  struct dbx_listener  listener;
+  struct dbx_stats     stats;
+#ifndef LIBPQ_HAS_ASYNC_CANCEL
+  struct dbx_canceller canceller;
+#endif
+
+  /* lock-free stack of requests submitted by other threads */
+  _Atomic(struct dbx_request *) inbox;
+};
 
-  while (i < dbxQueue->count)
-  {
-    req = list_index(dbxQueue, i);
+/* -------------------------------------------------------------------------- */
 
-    if ( req->conn == conn )
-    {
-      req->conn = NULL;
-      break;
-    }
+/* context of dbx_init() */
+static dbx_context_t dbxContext = NULL;
 
-    i++;
-  }
-}
+/* context created by current thread, its connection escapes strings */
+static __thread dbx_context_t dbxThreadContext = NULL;
+
+/* query identificator, unique across contexts */
+static _Atomic uint64_t dbxQueryId;
 
 /* -------------------------------------------------------------------------- */
 
+/* monotonic time in microseconds */
 static uint64_t
-dbx_queue_add(const char * sql, dbx_on_result_t  on_result,
-                                dbx_on_error_t   on_error,
-                                void            *u_data,
-                                int              do_free )
+dbx_time_now()
 {
-  dbx_request_t r;
+  struct timespec ts;
 
-  if ( !(r = malloc(sizeof (struct dbx_request))) )
-    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  r->id        = ++dbxQueryId ? dbxQueryId : ++dbxQueryId;
-  r->sql       = sql;
-  r->ptr       = (do_free ? (char*) sql : NULL);
-  r->u_data    = u_data;
-  r->on_result = on_result;
-  r->on_error  = on_error;
-  r->conn      = NULL;
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-  if (list_append(dbxQueue, r) == -1)
-  {
-    free(r);
-    return 0;
-  }
+/* metrics ------------------------------------------------------------------ */
 
-  return r->id;
+/* metrics have single writer, so plain relaxed store is enough */
+static inline void
+dbx_stats_add( _Atomic uint64_t * counter, uint64_t value )
+{
+  atomic_store_explicit( counter,
+                  atomic_load_explicit(counter, memory_order_relaxed) + value,
+                  memory_order_relaxed );
 }
 
 /* -------------------------------------------------------------------------- */
 
-cstuff_retcode_t
-dbx_init( const char * username,
-          const char * password,
-          const char * database,
-          const char * hostname,
-          int          port,
-          int          connections )
+/* log-linear bucket: values below 2^BITS have own buckets, each next power
+ * of two is split to 2^BITS sub-buckets */
+static int
+dbx_hist_index( uint64_t value )
 {
-  if (!port)
-    port = 5432;
-  dbxUri = str_printf( dbxUriFormat,
-                       username,
-                       password,
-                       hostname,
-                       port,
-                       database );
+  int msb, i;
 
+  if ( value < (1 << DBX_HISTOGRAM_BITS) )
+    return (int) value;
 
-  if ( !dbxUri )
-    goto e_malloc;
+  msb = 63 - __builtin_clzll(value);
+  i   = ((msb - DBX_HISTOGRAM_BITS + 1) << DBX_HISTOGRAM_BITS) +
+        (int) (value >> (msb - DBX_HISTOGRAM_BITS)) - (1 << DBX_HISTOGRAM_BITS);
 
-  if ( !(dbxQueue = list_new(4)) )
-    goto release_uri;
+  return (i < DBX_HISTOGRAM_BUCKETS) ? i : DBX_HISTOGRAM_BUCKETS - 1;
+}
 
-  if (connections > (sizeof(dbxConnBusy)*8))
-    dbxConnSize = sizeof(dbxConnBusy)*8;
-  else if (connections < 1)
-    dbxConnSize = 1;
-  else
-    dbxConnSize = connections;
+/* -------------------------------------------------------------------------- */
 
-  if ( !(dbxConnPool = calloc(dbxConnSize, sizeof(void*))) )
-    goto release_queue;
+static void
+dbx_hist_record( struct dbx_hist * hist, uint64_t value )
+{
+  dbx_stats_add( &hist->buckets[ dbx_hist_index(value) ], 1 );
+  dbx_stats_add( &hist->count, 1 );
+  dbx_stats_add( &hist->sum, value );
 
-  if ( !(dbxConnCell = malloc(dbxConnSize*sizeof(PostgresPollingStatusType))) )
-    goto release_list;
+  if (value > atomic_load_explicit(&hist->max, memory_order_relaxed))
+    atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+}
 
-  dbxConnBusy     = 0;
-  dbxConnMask     = 0;
-  dbxConnIter     = 0;
-  dbxQueryId      = 0;
-  dbxErrorMessage = NULL;
+/* -------------------------------------------------------------------------- */
 
-  return CSTUFF_SUCCESS;
+struct dbx_request
+{
+  uint64_t             id;
+  int                  flags;
+  const char         * sql;
+  char               * ptr;    /* will be free if is set */
+  void               * u_data;
+  PGconn             * conn;
+  dbx_on_result_t      on_result;
+  dbx_on_error_t       on_error;
+  dbx_on_copy_in_t     on_copy_in;
+  dbx_on_copy_out_t    on_copy_out;
+  uint32_t             hash;     /* prepared statement key hash */
+  struct dbx_stmt    * stmt;     /* prepared statement of connection */
+  char              ** values;   /* prepared statement parameters */
+  int                  n_values;
+  int                  stage;    /* DBX_STAGE_* commands to be sent */
+  int                  sent;     /* DBX_STAGE_* commands in progress */
+  int                  chunk;    /* rows per streamed result */
+  int                  priority; /* queue of request, dbx_priority_t */
+  int                  route;    /* queue of request, DBX_ROUTE_* */
+  uint64_t             deadline; /* monotonic usec to be sent before or 0 */
+  uint64_t             timeout;  /* statement timeout in usec or 0 */
+  uint64_t             expires;  /* monotonic usec to complete before or 0 */
+  uint64_t             queued_at; /* monotonic usec of query call */
+  uint64_t             sent_at;   /* monotonic usec of sending */
+  uint64_t             first_at;  /* monotonic usec of the first result */
+  uint64_t             ttl;       /* usec to keep results in cache or 0 */
+  struct dbx_cache_entry * cache; /* entry of request as cache leader */
+  int                  cancel;   /* DBX_CANCEL_* state */
+  bool                 queued;   /* linked to queue of route and priority */
+  struct dbx_request * chain;    /* next request of index bucket */
+  struct dbx_request ** p_chain; /* link to request in index or NULL */
+  struct dbx_request * prev;   /* queue links, next is also used for */
+  struct dbx_request * next;   /* connection's requests in flight */
+};
 
-release_list:
-  free(dbxConnPool);
+typedef struct dbx_request * dbx_request_t;
 
-release_queue:
-  list_free(dbxQueue, free);
+/* requests index ----------------------------------------------------------- */
 
-release_uri:
-  free(dbxUri);
-  dbxUri = NULL;
+/* accepted requests are indexed by id, so dbx_cancel() does not search for
+ * them. Request is unlinked from its bucket without context, the table is
+ * rebuilt for twice of indexed requests every time number of additions
+ * reaches its size, so it grows and shrinks with amortized O(1) cost */
 
-e_malloc:
-  return CSTUFF_MALLOC_ERROR;
-}
+static void
+dbx_index_link( dbx_request_t * table, uint32_t size, dbx_request_t req )
+{
+  dbx_request_t * bucket = &table[ (uint32_t) req->id & (size - 1) ];
 
-/* -------------------------------------------------------------------------- */
+  req->chain   = *bucket;
+  req->p_chain = bucket;
 
-void
-dbx_release()
-{
-  int i;
+  if (*bucket)
+    (*bucket)->p_chain = &req->chain;
 
-  if (dbxUri)
-  {
-    free(dbxUri);
-    dbxUri = NULL;
-  }
+  *bucket = req;
+}
 
-  if (dbxQueue)
-  {
-    list_free(dbxQueue, (list_destructor_t) dbx_request_free);
-    dbxQueue = NULL;
-  }
+/* -------------------------------------------------------------------------- */
 
-  if (dbxConnPool)
-  {
-    for (i=0; i<dbxConnSize; i++)
-    {
-      if (dbxConnPool[i])
-        PQfinish( dbxConnPool[i] );
+static void
+dbx_index_unlink( dbx_request_t req )
+{
+  if (!req->p_chain)
+    return;
 
-    }
+  *req->p_chain = req->chain;
 
-    free( dbxConnPool );
-    dbxConnPool = NULL;
-  }
+  if (req->chain)
+    req->chain->p_chain = req->p_chain;
 
-  if (dbxConnCell)
-  {
-    free( dbxConnCell );
-    dbxConnCell = NULL;
-  }
+  req->chain   = NULL;
+  req->p_chain = NULL;
 }
 
 /* -------------------------------------------------------------------------- */
 
+/* table is kept on allocation failure, its chains just get longer */
 static cstuff_retcode_t
-dbx_touch_connection( PGconn * conn )
+dbx_index_rehash( dbx_context_t ctx )
 {
-  PGresult     * res;
-  dbx_request_t  req;
+  dbx_request_t * table, req, next;
+  uint32_t        count = 0,
+                  size = DBX_INDEX_SIZE,
+                  i;
 
-  if ( !(dbxConnBusy & (1<<dbxConnIter)) )
+  for (i=0; i<ctx->index_size; i++)
   {
-    if ( dbxQueue->count )
-    {
-      if ( (req = dbx_queue_get( NULL )) != NULL )
-      {
-        if ( PQsendQuery(conn, req->sql) )
-        {
-          /* set request handling */
-          req->conn = conn;
-          /* set connection busy */
-          dbxConnBusy |= (1<<dbxConnIter);
-          /* reset result counter */
-          dbxConnCell[ dbxConnIter ] = 0;
+    for (req = ctx->index[i]; req; req = req->chain)
+      count++;
+  }
 
-        }
-        else
-          return CSTUFF_EXTCALL_ERROR;
-      }
-    }
-    else
-    {
-      if ( !dbxConnBusy )
-        return CSTUFF_PENDING;
-    }
+  while (size < 2 * count)
+    size *= 2;
 
-    return CSTUFF_SUCCESS;
-  }
+  ctx->index_count = count;
 
-  /* there is already some request handled via connection */
+  if (size == ctx->index_size)
+    return CSTUFF_SUCCESS;
 
-  req = dbx_queue_get( conn );
+  if ( !(table = calloc(size, sizeof(dbx_request_t))) )
+    return CSTUFF_MALLOC_ERROR;
 
-  if (sock_has_input( PQsocket(conn), 50))
+  for (i=0; i<ctx->index_size; i++)
   {
-    if (PQconsumeInput(conn))
+    for (req = ctx->index[i]; req; req = next)
     {
-      if (PQisBusy(conn))
-        return CSTUFF_SUCCESS;
-
-      while ((res = PQgetResult(conn)) != NULL)
-      {
-        switch (PQresultStatus(res))
-        {
-          case PGRES_COMMAND_OK:
-          case PGRES_TUPLES_OK:
-            if (req->on_result)
-            {
-              if (!(req->on_result(res, dbxConnCell[dbxConnIter], req->u_data)))
-              {
-                req->on_result = NULL;
-                req->on_error = NULL;
-              }
-            }
-            PQclear(res);
-            break;
-
-          default:
-            if (req->on_error)
-            {
-              req->on_error(
-                PQresultErrorMessage(res),
-                dbxConnCell[dbxConnIter],
-                req->u_data,
-                req->sql
-              );
-            }
-
-            PQclear(res);
-        }
-        dbxConnCell[dbxConnIter]++;
-      }
-
-      list_remove(dbxQueue, req);
-      dbx_request_free(req);
-
-      dbxConnBusy ^= (1<<dbxConnIter);
+      next = req->chain;
+      dbx_index_link(table, size, req);
     }
-    else
-      return CSTUFF_EXTCALL_ERROR;
   }
 
+  free(ctx->index);
+  ctx->index      = table;
+  ctx->index_size = size;
+
   return CSTUFF_SUCCESS;
 }
 
 /* -------------------------------------------------------------------------- */
 
-cstuff_retcode_t
-dbx_touch()
+static void
+dbx_index_add( dbx_context_t ctx, dbx_request_t req )
+{
+  if (ctx->index_count >= ctx->index_size)
+    dbx_index_rehash(ctx);
+
+  dbx_index_link(ctx->index, ctx->index_size, req);
+  ctx->index_count++;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static dbx_request_t
+dbx_index_find( dbx_context_t ctx, uint64_t id )
 {
-  cstuff_retcode_t result = CSTUFF_PENDING;
+  dbx_request_t req;
 
-  if ( ! dbxConnPool[ dbxConnIter ] ) /* not assigned yet */
+  for (req = ctx->index[ (uint32_t) id & (ctx->index_size - 1) ]; req;
+                                                            req = req->chain)
   {
-    if ( !(dbxConnPool[ dbxConnIter ] = PQconnectStart(dbxUri)) )
-    {
-      result = CSTUFF_MALLOC_ERROR;
-      goto finally;
-    }
-    dbxConnCell[ dbxConnIter ] = PGRES_POLLING_WRITING;
+    if (req->id == id)
+      return req;
   }
 
-  switch(PQstatus(dbxConnPool[dbxConnIter]))
-  {
-    case CONNECTION_OK:
-      dbxConnMask |= (1<<dbxConnIter);
-/*      printf( "(dbxConnMask |= (1<<dbxConnIter)) == %"PRIu64"\n", dbxConnMask); */
-      result = dbx_touch_connection( dbxConnPool[dbxConnIter] );
-      break;
+  return NULL;
+}
 
-    case CONNECTION_BAD:
-      if (dbxConnMask & (1<<dbxConnIter))
-        dbxConnMask ^= (1<<dbxConnIter);
+/* dbx_request_t ------------------------------------------------------------ */
 
-      if ( dbxConnBusy & (1<<dbxConnIter) ) /* release request */
-      {
-        /* make sure we've released all querries */
-        dbx_queue_release( dbxConnPool[ dbxConnIter ] );
-        /* unset busy flag to use proper poll function */
-        dbxConnBusy ^= (1<<dbxConnIter);
-      }
+static void
+dbx_request_free(dbx_request_t req)
+{
+  dbx_index_unlink(req);
 
-      PQfinish(dbxConnPool[dbxConnIter]);
-      dbxConnPool[dbxConnIter] = NULL;
+  if (req->ptr)
+    free( (void *) req->ptr);
+  free(req);
+}
 
-      dbxErrorMessage = PQerrorMessage( dbxConnPool[dbxConnIter] );
+/* -------------------------------------------------------------------------- */
 
-      result = CSTUFF_EXTCALL_ERROR;
-      break;
+/* statements of transaction are sent as one simple query, COPY is not
+ * allowed in pipeline mode, rows are streamed for the last query sent, so
+ * such requests could not be pipelined with others */
+static bool
+dbx_request_is_exclusive( dbx_request_t req )
+{
+  return (req->flags & (DBX_FLAG_TRANSACTION | DBX_FLAG_COPY |
+                                               DBX_FLAG_STREAM));
+}
 
-    default:
-      result = CSTUFF_SUCCESS;
+/* -------------------------------------------------------------------------- */
 
-      switch( dbxConnCell[ dbxConnIter ] )
-      {
-        case PGRES_POLLING_FAILED:
-          result = CSTUFF_EXTCALL_ERROR;
-          goto finally;
 
-        case PGRES_POLLING_READING:
-          if (sock_has_input( PQsocket(dbxConnPool[dbxConnIter]), 50) < 1)
-            goto finally;
-          break;
+/* remember the earliest deadline of queued requests */
+static void
+dbx_queue_expire_at( dbx_context_t ctx, dbx_request_t req )
+{
+  if (req->deadline && req->deadline < ctx->expiry)
+    ctx->expiry = req->deadline;
+}
 
-        case PGRES_POLLING_WRITING:
-          if (sock_can_write( PQsocket(dbxConnPool[dbxConnIter]), 50) < 1)
-            goto finally;
-          break;
+/* -------------------------------------------------------------------------- */
 
-        case PGRES_POLLING_OK:
-        case PGRES_POLLING_ACTIVE:
-          goto finally;
-      }
+/* remember when request at the head of connection has to be checked by
+ * dbx_conn_expire(): at its timer, or at once if it has to be cancelled */
+static void
+dbx_conn_expire_at( dbx_context_t ctx, dbx_request_t req )
+{
+  if ( req->cancel && !(req->cancel & DBX_CANCEL_SENT) )
+    ctx->conn_expiry = 0;
+  else if (req->expires && req->expires < ctx->conn_expiry)
+    ctx->conn_expiry = req->expires;
+}
 
-      dbxConnCell[ dbxConnIter ] = PQconnectPoll(dbxConnPool[dbxConnIter]);
-  }
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_queue_push( dbx_context_t ctx, dbx_request_t req )
+{
+  struct dbx_queue * queue = &ctx->queue[ req->route ][ req->priority ];
+
+  req->next = NULL;
+  req->prev = queue->tail;
 
+  if (queue->tail)
+    queue->tail->next = req;
+  else
+    queue->head = req;
 
-finally: /* always iterate connection */
-  if ( !(++dbxConnIter < dbxConnSize) )
-    dbxConnIter = 0;
+  queue->tail = req;
+  queue->count++;
+  req->queued = true;
 
-  return result;
+  if (dbx_request_is_exclusive(req))
+    ctx->exclusive++;
+
+  dbx_queue_expire_at(ctx, req);
 }
 
 /* -------------------------------------------------------------------------- */
 
+/* put request back to the head of queue, e.g. when connection was lost */
 static void
-dbx_query_int32_to_chars( int32_t            value,
-                          char            ** p_chars,
-                          const char       * format )
+dbx_queue_unshift( dbx_context_t ctx, dbx_request_t req )
 {
-  if ( (*p_chars = malloc(11)) != NULL)
-    sprintf( *p_chars, format, value);
+  struct dbx_queue * queue = &ctx->queue[ req->route ][ req->priority ];
+
+  req->prev = NULL;
+  req->next = queue->head;
+
+  if (queue->head)
+    queue->head->prev = req;
+  else
+    queue->tail = req;
+
+  queue->head = req;
+  queue->count++;
+  req->queued = true;
+
+  if (dbx_request_is_exclusive(req))
+    ctx->exclusive++;
+
+  dbx_queue_expire_at(ctx, req);
 }
 
 /* -------------------------------------------------------------------------- */
 
 static void
-dbx_query_int64_to_chars( int64_t            value,
-                          char            ** p_chars,
-                          const char       * format )
+dbx_queue_unlink( dbx_context_t ctx, dbx_request_t req )
 {
-  if ( (*p_chars = malloc(21)) != NULL)
-    sprintf( *p_chars, format, value);
+  struct dbx_queue * queue = &ctx->queue[ req->route ][ req->priority ];
+
+  if (req->prev)
+    req->prev->next = req->next;
+  else
+    queue->head = req->next;
+
+  if (req->next)
+    req->next->prev = req->prev;
+  else
+    queue->tail = req->prev;
+
+  req->prev   = NULL;
+  req->next   = NULL;
+  req->queued = false;
+  queue->count--;
+
+  if (dbx_request_is_exclusive(req))
+    ctx->exclusive--;
 }
 
 /* -------------------------------------------------------------------------- */
 
-static PGconn *
-dbx_get_allocated_connection()
+/* take request of the next priority class, classes are served by smooth
+ * weighted round robin: every non-empty class earns its weight, the richest
+ * one is served and pays the sum of earned weights */
+static dbx_request_t
+dbx_queue_shift( dbx_context_t ctx, int route )
 {
-  int i=0;
+  struct dbx_queue * queue  = ctx->queue[route];
+  int              * credit = ctx->credit[route];
+  dbx_request_t      req;
+  int                i, total = 0,
+                     next = -1;
 
-  while (i<dbxConnSize)
+  for (i=0; i<DBX_PRIORITIES; i++)
   {
-    if ( dbxConnPool[i] )
-      return dbxConnPool[i];
-    i++;
+    if (!queue[i].head)
+      continue;
+
+    credit[i] += ctx->weight[i];
+    total     += ctx->weight[i];
+
+    if (next == -1 || credit[i] > credit[next])
+      next = i;
   }
 
-  return NULL;
+  if (next == -1)
+    return NULL;
+
+  credit[next] -= total;
+
+  req = queue[next].head;
+  dbx_queue_unlink(ctx, req);
+
+  return req;
 }
 
 /* -------------------------------------------------------------------------- */
 
-static cstuff_retcode_t
-dbx_query_args_to_list( va_list a_list, int p_count, struct dbx_param * p_list )
+/* put requests in flight of connection back to the queue heads */
+static void
+dbx_queue_release( dbx_context_t ctx, int conn_i )
 {
-  int      i, j;
-  char   * ch_ptr,
-         * value;
-  PGconn * conn = NULL;
+  dbx_conn_t    conn = &ctx->conn[ conn_i ];
+  dbx_request_t req, next, list = NULL;
 
-  long double f;
+  /* reverse, so unshifted requests keep their order */
+  for (req = conn->req; req; req = next)
+  {
+    next      = req->next;
+    req->conn = NULL;
+    req->next = list;
+    list      = req;
+  }
 
-  for (i=0; i<p_count; i++)
+  for (req = list; req; req = next)
   {
-    value          = NULL;
-    p_list[i].type = va_arg(a_list, int);
+    next = req->next;
 
-    switch( p_list[i].type )
-    {
-      case DBX_INT32:
-        dbx_query_int32_to_chars(va_arg(a_list,int32_t), &value, "%d");
-        break;
+    /* request cancelled by user is not retried */
+    if (req->cancel & DBX_CANCEL_USER)
+      dbx_request_free(req);
+    else
+      dbx_queue_unshift(ctx, req);
+  }
 
-      case DBX_UINT32:
-        dbx_query_int32_to_chars(va_arg(a_list,int32_t), &value, "%d");
-        break;
+  conn->req   = NULL;
+  conn->tail  = NULL;
+  conn->depth = 0;
+  conn->syncs = 0;
+}
 
-      case DBX_INT64:
-        dbx_query_int64_to_chars(va_arg(a_list,int64_t), &value, "%"PRId64);
-        break;
+/* -------------------------------------------------------------------------- */
 
-      case DBX_UINT64:
-        dbx_query_int64_to_chars(va_arg(a_list,int64_t), &value, "%"PRIu64);
-        break;
+/* cancel queued requests which missed their deadline */
+static void
+dbx_queue_expire( dbx_context_t ctx, uint64_t now )
+{
+  dbx_request_t req, next;
+  int           i, r;
 
-      case DBX_CONSTANT:
-        if ((ch_ptr = va_arg(a_list, char *)) != NULL)
-        {
-          if ( (value = malloc( strlen(ch_ptr)+2+1 )) != NULL)
-          {
-            sprintf(value, "'%s'", ch_ptr);
-          }
-        }
-        else
-          value = (char *) dbxNullStr;
+  if (now < ctx->expiry)
+    return;
 
-        break;
+  ctx->expiry = UINT64_MAX;
 
-      case DBX_STATEMENT:
-        ch_ptr = va_arg(a_list, char *);
-        value =  ch_ptr ? ch_ptr : (char*) dbxNullStr;
-        break;
+  for (r=0; r<DBX_ROUTES; r++)
+  for (i=0; i<DBX_PRIORITIES; i++)
+  {
+    for (req = ctx->queue[r][i].head; req; req = next)
+    {
+      next = req->next;
 
-      case DBX_TIMESTAMP:
-        value = str_from_timestamp(
-                  va_arg(a_list, time_t), "'%Y-%m-%d %H:%M:%S'", NULL
-                );
-        break;
+      if (!req->deadline)
+        continue;
 
-      case DBX_STRING:
-        if ((ch_ptr = va_arg(a_list, char *)) != NULL)
-        {
-          if (!conn)
-            conn = dbx_get_allocated_connection();
+      if (req->deadline > now)
+      {
+        dbx_queue_expire_at(ctx, req);
+        continue;
+      }
 
-          value = PQescapeLiteral(conn, ch_ptr, strlen(ch_ptr));
-        }
-        else
-          value = (char *) dbxNullStr;
+      dbx_queue_unlink(ctx, req);
+      dbx_stats_add( &ctx->stats.expired, 1 );
 
-        break;
+      if (req->on_error)
+        req->on_error(dbxExpiredStr, 0, req->u_data, req->sql);
 
-      case DBX_FLOAT:
-        f = va_arg(a_list, long double);
-        setlocale(LC_ALL, "C");
-        value=str_printf("%.8Lf", f);
-        setlocale(LC_ALL, "");
-        break;
+      dbx_request_free(req);
+    }
+  }
+}
 
-      case DBX_MD5_HASH:
-        if ((ch_ptr = va_arg(a_list, char *)) != NULL)
-        {
-          if ( (value = malloc( (32+2+1) * sizeof(char))) != NULL )
-          {
-            value[0] ='\'';
+/* -------------------------------------------------------------------------- */
 
-            for (j = 0; j < 16; j++)
-            {
-              sprintf(&value[1+j*2], "%02x", ch_ptr[j] & 0xFF);
-            }
+/* request flags allowed to be set via options */
+#define DBX_OPTIONS_FLAGS (DBX_FLAG_BINARY | DBX_FLAG_STREAM | \
+                           DBX_FLAG_READ_ONLY)
 
-            value[33]='\'';
-            value[34]=0;
-          }
-        }
-        else
-          value = (char *) dbxNullStr;
+static dbx_request_t
+dbx_request_new(const char * sql, const struct dbx_options * options,
+                                  dbx_on_result_t  on_result,
+                                  dbx_on_error_t   on_error,
+                                  void            *u_data,
+                                  int              flags )
+{
+  dbx_request_t r;
 
-        break;
+  if ( !(r = calloc(1, sizeof (struct dbx_request))) )
+    return NULL;
 
-      case DBX_BOOLEAN:
-        value = (char*) (va_arg(a_list, int) ? dbxTrueStr : dbxFalseStr);
-        break;
-    }
+  r->queued_at = dbx_time_now();
 
-    if ( value )
-    {
-      p_list[i].length = strlen( value );
-      p_list[i].value  = value;
-    }
-    else
-       return CSTUFF_MALLOC_ERROR;
+  if (options)
+  {
+    flags   |= options->flags & DBX_OPTIONS_FLAGS;
+    r->chunk = options->chunk_rows;
+
+    if (options->priority > 0 && options->priority < DBX_PRIORITIES)
+      r->priority = options->priority;
+
+    if (options->deadline > 0)
+      r->deadline = r->queued_at + (uint64_t) options->deadline * 1000;
+
+    if (options->timeout > 0)
+      r->timeout = (uint64_t) options->timeout * 1000;
 
+    if (options->cache_ttl > 0 && !(flags & (DBX_FLAG_COPY | DBX_FLAG_STREAM)))
+      r->ttl = (uint64_t) options->cache_ttl * 1000;
   }
 
-  return CSTUFF_SUCCESS;
+  while ( !(r->id = atomic_fetch_add(&dbxQueryId, 1) + 1) );
+  r->flags     = flags;
+  r->sql       = sql;
+  r->ptr       = ((flags & DBX_FLAG_FREE_SQL) ? (char*) sql : NULL);
+  r->u_data    = u_data;
+  r->on_result = on_result;
+  r->on_error  = on_error;
+  r->conn      = NULL;
+
+  return r;
 }
 
 /* -------------------------------------------------------------------------- */
 
-char *
-dbx_sql_format( const char      * sql_format,
-                int               p_count,
-                                  ... )
+/* result cache ------------------------------------------------------------- */
+
+/* cached results of query. While leader request is in flight, requests of the
+ * same query wait for it as waiters */
+struct dbx_cache_entry
 {
-  char * result;
-  va_list args;
+  char                   * key;
+  size_t                   key_len;
+  uint32_t                 hash;
+  size_t                   size;      /* memory used by entry and results */
+  uint64_t                 ttl;       /* usec */
+  uint64_t                 expires;   /* monotonic usec */
+  PGresult              ** results;
+  int                      n_results;
+  struct dbx_request     * leader;    /* request in flight or NULL */
+  struct dbx_request     * waiters;   /* requests waiting for results */
+  struct dbx_request     * last;      /* the last waiter */
+  struct dbx_cache_entry * chain;     /* next entry of hash table bucket */
+  struct dbx_cache_entry * prev;      /* LRU or in flight list links */
+  struct dbx_cache_entry * next;
+  dbx_context_t            ctx;
+};
 
-  va_start(args, p_count);
-  result = dbx_sql_vformat(sql_format, p_count, args);
-  va_end(args);
+typedef struct dbx_cache_entry * dbx_cache_entry_t;
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t
+dbx_cache_hash( const char * key, size_t key_len )
+{
+  uint32_t result = 2166136261u; /* FNV-1a */
+
+  while (key_len--)
+  {
+    result ^= (unsigned char) *(key++);
+    result *= 16777619u;
+  }
 
   return result;
 }
 
 /* -------------------------------------------------------------------------- */
 
-char *
-dbx_sql_vformat( const char      * sql_format,
-                 int               p_count,
-                 va_list           a_list )
+/* key is result format followed by SQL and marked parameters of prepared
+ * statement, each of them with terminating zero */
+static char *
+dbx_cache_key( dbx_request_t req, size_t * p_length )
 {
-  struct dbx_param  * p_list  = NULL;              /* parameters array */
-  char              * ptr     =(char*) sql_format, /* pointer iterator */
-                    * sql = NULL;                  /* result sql */
-  int                 i,                           /* index / iterator */
-                      l       = 0;                 /* length / index */
-
-  /* prepare list for params */
-  if ( !(p_list = calloc(p_count, sizeof(struct dbx_param))) )
-    goto finally;
-
-  /* preapare params */
-  if (dbx_query_args_to_list( a_list, p_count, p_list ) != CSTUFF_SUCCESS)
-    goto release;
+  size_t   length, l;
+  char   * key, * p;
+  int      i;
 
-  /* calculate final size */
-  while (*ptr)
-  {
-    if ( (*ptr == '$') && (i = strtol(ptr+1, NULL, 10)) > 0)
-      l += p_list[ i-1 ].length;
+  length = strlen(req->sql) + 2;
 
-    ptr++;
-  }
+  for (i=0; i<req->n_values; i++)
+    length += (req->values[i]) ? strlen(req->values[i]) + 2 : 1;
 
-  l += ((int) (ptr - sql_format)+1);
+  if ( !(key = malloc(length)) )
+    return NULL;
 
-  /* make sql string */
-  if ( !(sql = malloc( l*sizeof(char))) )
-    goto release;
+  p      = key;
+  *(p++) = (req->flags & DBX_FLAG_BINARY) ? 'b' : 't';
 
-  ptr = (char*) sql_format;
-  l   = 0;
+  l = strlen(req->sql) + 1;
+  memcpy(p, req->sql, l);
+  p += l;
 
-  while ( *ptr )
+  for (i=0; i<req->n_values; i++)
   {
-    if ( (*ptr == '$') && (i = strtol( ptr+1, &ptr, 10)) > 0 )
+    if (req->values[i])
     {
-      i--;
-      strncpy( &sql[l], p_list[i].value, p_list[ i ].length);
-      l += p_list[ i ].length;
-      continue; /* new value of ptr already set */
+      *(p++) = 'v';
+      l = strlen(req->values[i]) + 1;
+      memcpy(p, req->values[i], l);
+      p += l;
     }
-
-    sql[l++] = *(ptr++);
+    else
+      *(p++) = 'n';
   }
 
-  /* terminate string with null */
-  sql[l] = 0;
+  *p_length = length;
 
+  return key;
+}
 
-release:
-  for ( i=0; i<p_count; i++)
+/* -------------------------------------------------------------------------- */
+
+static dbx_cache_entry_t
+dbx_cache_find( struct dbx_cache * cache, const char * key,
+                                          size_t       key_len,
+                                          uint32_t     hash )
+{
+  dbx_cache_entry_t e;
+
+  if (!cache->table)
+    return NULL;
+
+  for (e = cache->table[ hash & (cache->table_size - 1) ]; e; e = e->chain)
   {
-    if ( ! p_list[i].value ) continue;
+    if (e->hash == hash && e->key_len == key_len && !memcmp(e->key, key,
+                                                                  key_len))
+      return e;
+  }
 
-    switch( p_list[i].type )
-    {
-      case DBX_STRING:
-        if ( p_list[i].value != dbxNullStr )
-          PQfreemem( (char *) p_list[i].value );
-        break;
+  return NULL;
+}
 
-      case DBX_BOOLEAN:
-      case DBX_STATEMENT:
-        break;
+/* -------------------------------------------------------------------------- */
 
-      case DBX_CONSTANT:
-      case DBX_MD5_HASH:
-        if ( p_list[i].value == dbxNullStr )
-          break;
+static cstuff_retcode_t
+dbx_cache_insert( struct dbx_cache * cache, dbx_cache_entry_t entry )
+{
+  dbx_cache_entry_t * table, e, next;
+  uint32_t            size, i;
 
-      default:
-        free( (char*) p_list[i].value );
+  /* keep load factor under 1 */
+  if (cache->count >= cache->table_size)
+  {
+    size = (cache->table_size) ? cache->table_size * 2 : 64;
+
+    if ( !(table = calloc(size, sizeof(dbx_cache_entry_t))) )
+      return CSTUFF_MALLOC_ERROR;
+
+    for (i=0; i<cache->table_size; i++)
+    {
+      for (e = cache->table[i]; e; e = next)
+      {
+        next     = e->chain;
+        e->chain = table[ e->hash & (size - 1) ];
+        table[ e->hash & (size - 1) ] = e;
+      }
     }
 
+    free(cache->table);
+    cache->table      = table;
+    cache->table_size = size;
   }
-  free(p_list);
 
-finally:
-  return sql;
+  i = entry->hash & (cache->table_size - 1);
+  entry->chain    = cache->table[i];
+  cache->table[i] = entry;
+  cache->count++;
 
+  return CSTUFF_SUCCESS;
 }
 
 /* -------------------------------------------------------------------------- */
+
+static void
+dbx_cache_remove( struct dbx_cache * cache, dbx_cache_entry_t entry )
+{
+  dbx_cache_entry_t * p_e = &cache->table[entry->hash & (cache->table_size-1)];
+
+  while (*p_e != entry)
+    p_e = &(*p_e)->chain;
+
+  *p_e = entry->chain;
+  cache->count--;
+}
+
 /* -------------------------------------------------------------------------- */
 
-uint64_t
-dbx_query_format( const char      * sql_format,
-                  dbx_on_result_t   on_result,
-                  dbx_on_error_t    on_error,
-                  void            * u_data,
-                  int               p_count,
-                                    ... )
+/* unlink entry from LRU list, or from list of entries in flight */
+static void
+dbx_cache_unlink( struct dbx_cache * cache, dbx_cache_entry_t entry )
 {
-  uint64_t   result;         /* result: 0 -fail */
-  char     * sql;            /* result sql */
-  va_list    args;
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else if (entry->leader)
+    cache->flight = entry->next;
+  else
+    cache->head = entry->next;
 
-  va_start(args, p_count);
-  sql = dbx_sql_vformat(sql_format, p_count, args);
-  va_end(args);
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else if (!entry->leader)
+    cache->tail = entry->prev;
 
-  if (sql)
-  {
-    result = dbx_queue_add(sql, on_result, on_error, u_data, 1);
-    if (!result)
-      free(sql);
-  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* make complete entry the most recently used one */
+static void
+dbx_cache_touch( struct dbx_cache * cache, dbx_cache_entry_t entry )
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+
+  if (cache->head)
+    cache->head->prev = entry;
   else
-    result = 0;
+    cache->tail = entry;
 
-  return result;
+  cache->head = entry;
 }
 
 /* -------------------------------------------------------------------------- */
 
-uint64_t
-dbx_query_const( const char      * sql,
-                 dbx_on_result_t   on_result,
-                 dbx_on_error_t    on_error,
-                 void            * u_data )
+static void
+dbx_cache_entry_free( dbx_cache_entry_t entry )
 {
-  uint64_t   result;         /* result: 0 -fail */
-  result = dbx_queue_add(sql, on_result, on_error, u_data, 0);
+  int i;
 
-  return result;
+  for (i=0; i<entry->n_results; i++)
+    PQclear(entry->results[i]);
+
+  free(entry->results);
+  free(entry->key);
+  free(entry);
 }
 
 /* -------------------------------------------------------------------------- */
 
-uint64_t
-dbx_query_transaction( const char      * sql,
-                       dbx_on_result_t   on_result,
-                       dbx_on_error_t    on_error,
-                       void            * u_data )
+/* drop the least recently used entries to fit into limit, entry is kept */
+static void
+dbx_cache_evict( struct dbx_cache * cache, dbx_cache_entry_t keep )
 {
-  uint64_t   result;         /* result: 0 -fail */
-  char     * t_sql;
+  dbx_cache_entry_t e;
 
-  if ( (t_sql = str_printf("BEGIN;\n%sCOMMIT;\n", sql)) != NULL )
+  while (cache->size > cache->limit && (e = cache->tail) && e != keep)
   {
-    result = dbx_queue_add(t_sql, on_result, on_error, u_data, 1);
-    if (!result)
-      free(t_sql);
+    dbx_cache_unlink(cache, e);
+    dbx_cache_remove(cache, e);
+    cache->size -= e->size;
+    dbx_cache_entry_free(e);
   }
-  else
-    result = 0;
-
-  return result;
 }
 
-
 /* -------------------------------------------------------------------------- */
 
-cstuff_retcode_t
-dbx_cancel( uint64_t id )
+/* pass cached results to request and free it */
+static void
+dbx_cache_deliver( dbx_cache_entry_t entry, dbx_request_t req )
 {
   int i;
-  dbx_request_t req;
-  for (i=0; i<dbxQueue->count; i++)
+
+  for (i=0; i<entry->n_results && req->on_result; i++)
   {
-    req = (dbx_request_t) list_index(dbxQueue, i);
-    if ( req->id == id)
-    {
-      if ( req->conn )
-      {
-        /* already pending */
-        req->on_result = NULL;
-        req->on_error  = NULL;
-      }
-      else
-      {
-        /* just in queue */
-        dbx_request_free( req );
-        list_remove_index( dbxQueue, i );
-      }
-      return CSTUFF_SUCCESS;
-    }
+    if ( !req->on_result(entry->results[i], i, req->u_data) )
+      break;
   }
 
-/* -------------------------------------------------------------------------- */
-  return CSTUFF_NOT_FOUND;
+  dbx_request_free(req);
 }
 
 /* -------------------------------------------------------------------------- */
 
-const char *
-dbx_get_error()
+/* error of leader request fails all waiters, entry is dropped and leader
+ * goes on without it */
+static void
+dbx_cache_on_error( const char * e_message,
+                    int          res_i,
+                    void       * u_data,
+                    const char * e_sql )
 {
-  return dbxErrorMessage;
+  dbx_cache_entry_t   entry = u_data;
+  struct dbx_cache  * cache = &entry->ctx->cache;
+  dbx_request_t       req, next;
+
+  dbx_cache_unlink(cache, entry);
+  dbx_cache_remove(cache, entry);
+
+  entry->leader->cache    = NULL;
+  entry->leader->on_error = NULL;
+  entry->leader->u_data   = NULL;
+
+  for (req = entry->waiters; req; req = next)
+  {
+    next = req->next;
+
+    if (req->on_error)
+      req->on_error(e_message, res_i, req->u_data, e_sql);
+
+    dbx_request_free(req);
+  }
+
+  dbx_cache_entry_free(entry);
 }
 
 /* -------------------------------------------------------------------------- */
 
-int
-dbx_ready_connections_count()
+/* keep result of leader request, false means it was not kept */
+static bool
+dbx_cache_store( dbx_cache_entry_t entry, PGresult * res, int res_i )
 {
-  uint64_t mask   = dbxConnMask;
-  int      result = 0;
+  PGresult ** results;
 
-  while (mask)
+  results = realloc(entry->results, (entry->n_results+1) * sizeof(PGresult *));
+
+  if (!results)
   {
-    if ( mask & 1 )
-      result++;
-    mask = mask >> 1;
+    dbx_cache_on_error(dbxNoMemoryStr, res_i, entry, entry->leader->sql);
+    return false;
   }
 
-  return result;
+  entry->results = results;
+  entry->results[ entry->n_results++ ] = res;
+  entry->size += PQresultMemorySize(res);
+
+  return true;
 }
 
 /* -------------------------------------------------------------------------- */
 
-int
-dbx_as_timestamp( PGresult * data, int row_num, int col_num, time_t * p_ts )
+/* leader request is complete: results are cached if they fit into limit and
+ * passed to waiters */
+static void
+dbx_cache_complete( dbx_cache_entry_t entry, uint64_t now )
 {
-  int result;
+  struct dbx_cache * cache = &entry->ctx->cache;
+  dbx_request_t      req, next;
+  bool               cached = (entry->size <= cache->limit);
 
-  if ( ! PQgetisnull(data, row_num, col_num))
+  dbx_cache_unlink(cache, entry);
+  entry->leader->cache = NULL;
+  entry->leader        = NULL;
+
+  if (cached)
   {
-    char * dt = dbx_as_string(data, row_num, col_num);
-    result = (dt) ? str_to_timestamp(dt, strlen(dt), p_ts, NULL) : -1;
+    entry->expires = now + entry->ttl;
+    cache->size   += entry->size;
+    dbx_cache_touch(cache, entry);
+    dbx_cache_evict(cache, entry);
   }
   else
-    result = 1;
+    dbx_cache_remove(cache, entry);
 
-  return result;
+  for (req = entry->waiters; req; req = next)
+  {
+    next = req->next;
+    dbx_cache_deliver(entry, req);
+  }
+
+  entry->waiters = NULL;
+  entry->last    = NULL;
+
+  if (!cached)
+    dbx_cache_entry_free(entry);
 }
 
+/* -------------------------------------------------------------------------- */
 
-int
-dbx_sleep(int usec)
+/* the first request of query becomes leader of new entry, its callbacks and
+ * identificator are passed to the first waiter */
+static dbx_cache_entry_t
+dbx_cache_entry_new( dbx_context_t   ctx,
+                     dbx_request_t   req,
+                     char          * key,
+                     size_t          key_len,
+                     uint32_t        hash )
 {
-  fd_set  fs;
+  dbx_cache_entry_t entry;
+  dbx_request_t     waiter;
+
+  if ( !(entry = calloc(1, sizeof(struct dbx_cache_entry))) )
+    return NULL;
+
+  if ( !(waiter = calloc(1, sizeof(struct dbx_request))) )
+    goto e_malloc;
+
+  entry->key     = key;
+  entry->key_len = key_len;
+  entry->hash    = hash;
+  entry->size    = sizeof(struct dbx_cache_entry) + key_len;
+  entry->ttl     = req->ttl;
+  entry->ctx     = ctx;
+
+  if (dbx_cache_insert(&ctx->cache, entry) != CSTUFF_SUCCESS)
+    goto e_malloc;
 
-  struct timeval tv;
+  /* waiter takes place of request in index */
+  dbx_index_unlink(req);
+  waiter->id        = req->id;
+  dbx_index_add(ctx, waiter);
+  waiter->sql       = req->sql;
+  waiter->u_data    = req->u_data;
+  waiter->on_result = req->on_result;
+  waiter->on_error  = req->on_error;
 
-  tv.tv_sec  = 0;
-  tv.tv_usec = usec;
+  while ( !(req->id = atomic_fetch_add(&dbxQueryId, 1) + 1) );
+  req->on_result = NULL;
+  req->on_error  = dbx_cache_on_error;
+  req->u_data    = entry;
+  req->cache     = entry;
 
+  entry->leader  = req;
+  entry->waiters = waiter;
+  entry->last    = waiter;
 
-  if (dbxConnPool)
+  entry->next = ctx->cache.flight;
+  if (entry->next)
+    entry->next->prev = entry;
+  ctx->cache.flight = entry;
+
+  return entry;
+
+e_malloc:
+  free(waiter);
+  free(entry);
+  return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* resolve requests waiting for cache lookup: cached results are passed at
+ * once, requests of query in flight wait for it, the others are queued */
+static void
+dbx_cache_lookup( dbx_context_t ctx, uint64_t now )
+{
+  struct dbx_cache  * cache = &ctx->cache;
+  dbx_cache_entry_t   e;
+  dbx_request_t       req, next;
+  char              * key;
+  size_t              key_len;
+  uint32_t            hash;
+
+  /* limit could be changed */
+  dbx_cache_evict(cache, NULL);
+
+  req = cache->lookup;
+  cache->lookup      = NULL;
+  cache->lookup_tail = NULL;
+
+  for (; req; req = next)
   {
-    FD_ZERO (&fs);
+    next = req->next;
 
-    int maxsd = 0;
+    /* cancelled while waiting for lookup */
+    if (req->cancel & DBX_CANCEL_USER)
+    {
+      dbx_request_free(req);
+      continue;
+    }
 
-    for (int i=0; i< dbxConnSize; i++)
+    if ( !cache->limit || !(key = dbx_cache_key(req, &key_len)) )
     {
-      int sd = PQsocket(dbxConnPool[i]);
-      FD_SET(sd, &fs);
-      if (sd > maxsd)
-        maxsd = sd;
+      dbx_queue_push(ctx, req);
+      continue;
     }
 
-    return select(maxsd+1, &fs, NULL, NULL, &tv);
+    hash = dbx_cache_hash(key, key_len);
+
+    if ( (e = dbx_cache_find(cache, key, key_len, hash)) != NULL )
+    {
+      if (e->leader)
+      {
+        free(key);
+        req->next = NULL;
+
+        if (e->last)
+          e->last->next = req;
+        else
+          e->waiters = req;
+
+        e->last = req;
+        dbx_stats_add( &ctx->stats.coalesced, 1 );
+        continue;
+      }
+
+      if (e->expires > now)
+      {
+        free(key);
+        dbx_cache_unlink(cache, e);
+        dbx_cache_touch(cache, e);
+        dbx_stats_add( &ctx->stats.cache_hits, 1 );
+        dbx_cache_deliver(e, req);
+        continue;
+      }
+
+      dbx_cache_unlink(cache, e);
+      dbx_cache_remove(cache, e);
+      cache->size -= e->size;
+      dbx_cache_entry_free(e);
+    }
+
+    if ( !dbx_cache_entry_new(ctx, req, key, key_len, hash) )
+      free(key);
+
+    dbx_queue_push(ctx, req);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_cache_free( dbx_context_t ctx )
+{
+  struct dbx_cache  * cache = &ctx->cache;
+  dbx_cache_entry_t   e;
+  dbx_request_t       req;
+
+  while ( (e = cache->flight) != NULL )
+  {
+    cache->flight    = e->next;
+    e->leader->cache = NULL;
+
+    while ( (req = e->waiters) != NULL )
+    {
+      e->waiters = req->next;
+      dbx_request_free(req);
+    }
+
+    dbx_cache_entry_free(e);
+  }
+
+  while ( (e = cache->head) != NULL )
+  {
+    cache->head = e->next;
+    dbx_cache_entry_free(e);
+  }
+
+  while ( (req = cache->lookup) != NULL )
+  {
+    cache->lookup = req->next;
+    dbx_request_free(req);
+  }
+
+  free(cache->table);
+  memset(cache, 0, sizeof(struct dbx_cache));
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* queue request, cacheable one goes through cache lookup by the next touch */
+static void
+dbx_queue_accept( dbx_context_t ctx, dbx_request_t req )
+{
+  dbx_index_add(ctx, req);
+
+  if ((req->flags & DBX_FLAG_READ_ONLY) && ctx->n_endpoints > 1)
+    req->route = DBX_ROUTE_REPLICA;
+
+  if (req->ttl && ctx->cache.limit)
+  {
+    req->next = NULL;
+
+    if (ctx->cache.lookup_tail)
+      ctx->cache.lookup_tail->next = req;
+    else
+      ctx->cache.lookup = req;
+
+    ctx->cache.lookup_tail = req;
+  }
+  else
+    dbx_queue_push(ctx, req);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* queue request of owner thread directly, requests of other threads are
+ * pushed to inbox and owner is woken up by eventfd */
+static uint64_t
+dbx_queue_submit( dbx_context_t ctx, dbx_request_t req )
+{
+  uint64_t   id = req->id;  /* request belongs to owner once pushed */
+  uint64_t   one = 1;
+
+  if ( pthread_equal(pthread_self(), ctx->owner) )
+  {
+    dbx_queue_accept(ctx, req);
+    return id;
+  }
+
+  req->next = atomic_load_explicit(&ctx->inbox, memory_order_relaxed);
+
+  while ( !atomic_compare_exchange_weak_explicit( &ctx->inbox,
+                                                  &req->next,
+                                                  req,
+                                                  memory_order_release,
+                                                  memory_order_relaxed ) );
+
+  /* only the first request of a batch has to wake owner up */
+  if (!req->next)
+    while (write(ctx->inbox_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+
+  return id;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* move requests submitted by other threads to the queue, in order they were
+ * submitted */
+static void
+dbx_queue_receive( dbx_context_t ctx )
+{
+  dbx_request_t req, next, list = NULL;
+  uint64_t      count;
+
+  /* reset event before taking requests, so no submission is missed */
+  while (read(ctx->inbox_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+
+  req = atomic_exchange_explicit(&ctx->inbox, NULL, memory_order_acquire);
+
+  /* inbox is LIFO */
+  for (; req; req = next)
+  {
+    next      = req->next;
+    req->next = list;
+    list      = req;
+  }
+
+  for (req = list; req; req = next)
+  {
+    next = req->next;
+    dbx_queue_accept(ctx, req);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t
+dbx_queue_add( dbx_context_t              ctx,
+               const char               * sql,
+               const struct dbx_options * options,
+               dbx_on_result_t            on_result,
+               dbx_on_error_t             on_error,
+               void                     * u_data,
+               int                        flags )
+{
+  dbx_request_t r;
+
+  r = dbx_request_new(sql, options, on_result, on_error, u_data, flags);
+  if (!r)
+    return 0;
+
+  return dbx_queue_submit(ctx, r);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_conn_free_stmts( dbx_conn_t conn )
+{
+  int i;
+
+  if (conn->stmts)
+  {
+    for (i=0; i<conn->n_stmts; i++)
+    {
+      if (conn->stmts[i].sql)
+        free(conn->stmts[i].sql);
+    }
+
+    free(conn->stmts);
+    conn->stmts   = NULL;
+    conn->n_stmts = 0;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* add database server with its own sub-pool of connection slots, slots are
+ * connected by the next touch */
+static cstuff_retcode_t
+dbx_endpoint_add( dbx_context_t   ctx,
+                  const char    * username,
+                  const char    * password,
+                  const char    * database,
+                  const char    * hostname,
+                  int             port,
+                  int             connections )
+{
+  struct dbx_endpoint * endpoints;
+  struct dbx_conn     * conn;
+  bitset_t              mask = NULL,
+                        busy = NULL;
+  char                * uri;
+  int                   i, size;
+
+  if (!port)
+    port = 5432;
+
+  if (connections < 1)
+    connections = 1;
+
+  if ( !(uri = str_printf(dbxUriFormat, username, password, hostname, port,
+                                                                  database)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  size = ctx->conn_size + connections;
+
+  endpoints = realloc( ctx->endpoints,
+                       (ctx->n_endpoints + 1) * sizeof(struct dbx_endpoint) );
+  if (!endpoints)
+    goto e_malloc;
+
+  ctx->endpoints = endpoints;
+
+  if ( !(conn = realloc(ctx->conn, size * sizeof(struct dbx_conn))) )
+    goto e_malloc;
+
+  ctx->conn = conn;
+
+  if ( !(mask = bitset_new(size)) || !(busy = bitset_new(size)) )
+    goto e_malloc;
+
+  /* new slots are not connected */
+  bitset_fill(busy, 1);
+
+  for (i=0; i<ctx->conn_size; i++)
+  {
+    if ( bitset_test(ctx->conn_mask, i) )
+      bitset_set(mask, i);
+
+    if ( !bitset_test(ctx->conn_busy, i) )
+      bitset_unset(busy, i);
+  }
+
+  memset(&conn[ctx->conn_size], 0, connections * sizeof(struct dbx_conn));
+
+  for (i=ctx->conn_size; i<size; i++)
+  {
+    conn[i].sd       = -1;
+    conn[i].endpoint = ctx->n_endpoints;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    conn[i].cancel_sd = -1;
+#endif
+  }
+
+  endpoints[ctx->n_endpoints].uri   = uri;
+  endpoints[ctx->n_endpoints].first = ctx->conn_size;
+  endpoints[ctx->n_endpoints].size  = connections;
+  ctx->n_endpoints++;
+
+  bitset_free(ctx->conn_mask);
+  bitset_free(ctx->conn_busy);
+  ctx->conn_mask  = mask;
+  ctx->conn_busy  = busy;
+  ctx->conn_size  = size;
+  ctx->conn_down += connections;
+  ctx->retry_at   = 0;
+
+  return CSTUFF_SUCCESS;
+
+e_malloc:
+  bitset_free(mask);
+  bitset_free(busy);
+  free(uri);
+  return CSTUFF_MALLOC_ERROR;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_listener_free( dbx_context_t ctx )
+{
+  struct dbx_listener * listener = &ctx->listener;
+  struct dbx_channel  * ch;
+
+  while ( (ch = listener->channels) != NULL )
+  {
+    listener->channels = ch->next;
+    free(ch->name);
+    free(ch);
+  }
+
+  if (listener->conn.pg)
+    PQfinish(listener->conn.pg);
+
+  listener->conn.pg = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+#ifndef LIBPQ_HAS_ASYNC_CANCEL
+
+/* cancel requests not sent yet are dropped, connections are closed anyway */
+static void
+dbx_canceller_free( dbx_context_t ctx )
+{
+  struct dbx_canceller  * canceller = &ctx->canceller;
+  struct dbx_cancel_job * job;
+
+  if (canceller->started)
+  {
+    pthread_mutex_lock(&canceller->lock);
+    canceller->stop = true;
+    pthread_cond_signal(&canceller->cond);
+    pthread_mutex_unlock(&canceller->lock);
+
+    pthread_join(canceller->thread, NULL);
+  }
+
+  while ( (job = canceller->head) != NULL )
+  {
+    canceller->head = job->next;
+    PQfreeCancel(job->cancel);
+    free(job);
+  }
+
+  pthread_cond_destroy(&canceller->cond);
+  pthread_mutex_destroy(&canceller->lock);
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_context_new( dbx_context_t * self,
+                 const char    * username,
+                 const char    * password,
+                 const char    * database,
+                 const char    * hostname,
+                 int             port,
+                 int             connections )
+{
+  dbx_context_t       ctx;
+  struct epoll_event  ev;
+  cstuff_retcode_t    result = CSTUFF_MALLOC_ERROR;
+
+  if ( !(ctx = calloc(1, sizeof(struct dbx_context))) )
+    return result;
+
+  ctx->epoll    = -1;
+  ctx->inbox_fd = -1;
+
+  ctx->listener.conn.sd = -1;
+  ctx->pipeline = 1;
+  ctx->owner    = pthread_self();
+  ctx->expiry   = UINT64_MAX;
+  ctx->drain    = -1;
+
+  ctx->conn_expiry = UINT64_MAX;
+
+#ifndef LIBPQ_HAS_ASYNC_CANCEL
+  pthread_mutex_init(&ctx->canceller.lock, NULL);
+  pthread_cond_init(&ctx->canceller.cond, NULL);
+#endif
+
+  ctx->retry_min = (uint64_t) DBX_RECONNECT_MIN * 1000;
+  ctx->retry_max = (uint64_t) DBX_RECONNECT_MAX * 1000;
+  ctx->seed      = (uint32_t) dbx_time_now() ^ (uint32_t) (uintptr_t) ctx;
+
+  ctx->weight[DBX_PRIORITY_HIGH]   = DBX_WEIGHT_HIGH;
+  ctx->weight[DBX_PRIORITY_NORMAL] = DBX_WEIGHT_NORMAL;
+  ctx->weight[DBX_PRIORITY_LOW]    = DBX_WEIGHT_LOW;
+  atomic_init(&ctx->inbox, NULL);
+
+  if (dbx_index_rehash(ctx) != CSTUFF_SUCCESS)
+    goto release;
+
+  /* primary endpoint */
+  if ( (result = dbx_endpoint_add( ctx, username, password, database,
+                                   hostname, port, connections ))
+                                                            != CSTUFF_SUCCESS )
+    goto release;
+
+  if ( (ctx->epoll = epoll_create1(EPOLL_CLOEXEC)) == -1 )
+    RAISE( CSTUFF_SYSCALL_ERROR, release );
+
+  if ( (ctx->inbox_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 )
+    RAISE( CSTUFF_SYSCALL_ERROR, release );
+
+  /* connections slots are indexed from 0, so inbox gets out of range index */
+  ev.events   = EPOLLIN;
+  ev.data.u64 = 0;
+  ev.data.u32 = DBX_INBOX_EVENT;
+
+  if (epoll_ctl(ctx->epoll, EPOLL_CTL_ADD, ctx->inbox_fd, &ev) == -1)
+    RAISE( CSTUFF_SYSCALL_ERROR, release );
+
+  if (!dbxThreadContext)
+    dbxThreadContext = ctx;
+
+  *self = ctx;
+
+  return CSTUFF_SUCCESS;
+
+release:
+  dbx_context_free(ctx);
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_free( dbx_context_t ctx )
+{
+  int           i;
+  dbx_request_t req;
+
+#ifndef LIBPQ_HAS_ASYNC_CANCEL
+  dbx_canceller_free(ctx);
+#endif
+
+  /* leaders are still valid */
+  dbx_cache_free(ctx);
+
+  dbx_listener_free(ctx);
+
+  for (i=0; i<ctx->n_endpoints; i++)
+    free(ctx->endpoints[i].uri);
+
+  free(ctx->endpoints);
+
+  if (ctx->conn)
+  {
+    for (i=0; i<ctx->conn_size; i++)
+    {
+      while ( (req = ctx->conn[i].req) != NULL )
+      {
+        ctx->conn[i].req = req->next;
+        dbx_request_free( req );
+      }
+
+      dbx_conn_free_stmts( &ctx->conn[i] );
+      free( ctx->conn[i].copy_data.data );
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+      if (ctx->conn[i].cancel)
+        PQcancelFinish( ctx->conn[i].cancel );
+#endif
+
+      if (ctx->conn[i].pg)
+        PQfinish( ctx->conn[i].pg );
+    }
+
+    free( ctx->conn );
+  }
+
+  bitset_free(ctx->conn_mask);
+  bitset_free(ctx->conn_busy);
+
+  if (ctx->inbox_fd != -1)
+  {
+    dbx_queue_receive(ctx);
+    close(ctx->inbox_fd);
+  }
+
+  for (i=0; i<DBX_ROUTES; i++)
+  {
+    while ( (req = dbx_queue_shift(ctx, i)) != NULL )
+      dbx_request_free( req );
+  }
+
+  if (ctx->epoll != -1)
+    close(ctx->epoll);
+
+  /* all requests are unlinked from index by now */
+  free(ctx->index);
+
+  if (dbxThreadContext == ctx)
+  {
+    dbxThreadContext = NULL;
+
+    free(dbxSqlBuffer.data);
+    memset(&dbxSqlBuffer, 0, sizeof(dbxSqlBuffer));
+  }
+
+  free(ctx);
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_init( const char * username,
+          const char * password,
+          const char * database,
+          const char * hostname,
+          int          port,
+          int          connections )
+{
+  return dbx_context_new( &dbxContext, username, password, database,
+                                       hostname, port, connections );
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_context_add_replica( dbx_context_t   ctx,
+                         const char    * username,
+                         const char    * password,
+                         const char    * database,
+                         const char    * hostname,
+                         int             port,
+                         int             connections )
+{
+  return dbx_endpoint_add( ctx, username, password, database,
+                                hostname, port, connections );
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_add_replica( const char * username,
+                 const char * password,
+                 const char * database,
+                 const char * hostname,
+                 int          port,
+                 int          connections )
+{
+  return dbx_endpoint_add( dbxContext, username, password, database,
+                                       hostname, port, connections );
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_release()
+{
+  if (dbxContext)
+  {
+    dbx_context_free(dbxContext);
+    dbxContext = NULL;
+  }
+
+  free(dbxSqlBuffer.data);
+  memset(&dbxSqlBuffer, 0, sizeof(dbxSqlBuffer));
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_set_error( dbx_context_t ctx, PGconn * pg )
+{
+  strncpy(ctx->error_buffer, PQerrorMessage(pg), sizeof(ctx->error_buffer)-1);
+  ctx->error = ctx->error_buffer;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* (re)register connection socket in epoll for given events, tag identifies
+ * connection in events */
+static cstuff_retcode_t
+dbx_conn_watch_ex( dbx_context_t ctx, dbx_conn_t conn, uint32_t tag,
+                                                       uint32_t events )
+{
+  int                 sd   = PQsocket(conn->pg),
+                      op   = EPOLL_CTL_MOD;
+  struct epoll_event  ev;
+
+  /* while connecting libpq could replace socket reusing the same number, so
+   * registration is being skipped only for established connections */
+  if ( sd == conn->sd && events == conn->events &&
+       PQstatus(conn->pg) == CONNECTION_OK )
+    return CSTUFF_SUCCESS;
+
+  if (sd != conn->sd)
+  {
+    if (conn->sd != -1)
+      epoll_ctl(ctx->epoll, EPOLL_CTL_DEL, conn->sd, NULL);
+
+    conn->sd     = -1;
+    conn->events = 0;
+
+    if (sd == -1)
+      return CSTUFF_EXTCALL_ERROR;
+
+    op = EPOLL_CTL_ADD;
+  }
+
+  ev.events   = events;
+  ev.data.u64 = 0;
+  ev.data.u32 = tag;
+
+  if (epoll_ctl(ctx->epoll, op, sd, &ev) == -1)
+  {
+    /* closed socket was silently removed from epoll */
+    if ( !(op == EPOLL_CTL_MOD && errno == ENOENT) )
+      return CSTUFF_SYSCALL_ERROR;
+
+    if (epoll_ctl(ctx->epoll, EPOLL_CTL_ADD, sd, &ev) == -1)
+      return CSTUFF_SYSCALL_ERROR;
+  }
+
+  conn->sd     = sd;
+  conn->events = events;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+dbx_conn_watch( dbx_context_t ctx, int conn_i, uint32_t events )
+{
+  return dbx_conn_watch_ex( ctx, &ctx->conn[ conn_i ], conn_i, events );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* delay of reconnect attempt: exponential backoff with random jitter, it is
+ * between half and full of min * 2^(failures-1) limited by max */
+static uint64_t
+dbx_conn_backoff( dbx_context_t ctx, int failures )
+{
+  uint64_t delay = ctx->retry_min;
+  uint32_t x     = ctx->seed;
+
+  while (--failures > 0 && delay < ctx->retry_max)
+    delay *= 2;
+
+  if (delay > ctx->retry_max)
+    delay = ctx->retry_max;
+
+  /* xorshift32 */
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ctx->seed = x;
+
+  return delay / 2 + x % (delay / 2 + 1);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* drop broken connection, its request goes back to queue */
+static void
+dbx_conn_reset( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t    conn = &ctx->conn[ conn_i ];
+  dbx_request_t req;
+
+  dbx_set_error( ctx, conn->pg );
+
+  /* lost connection is restored soon, failing server is given more time */
+  if (bitset_test(ctx->conn_mask, conn_i))
+    conn->failures = 0;
+
+  conn->failures++;
+  conn->retry_at = dbx_time_now() + dbx_conn_backoff( ctx, conn->failures );
+
+  if (conn->retry_at < ctx->retry_at)
+    ctx->retry_at = conn->retry_at;
+
+  bitset_unset(ctx->conn_mask, conn_i);
+  bitset_set(ctx->conn_busy, conn_i);
+
+  dbx_stats_add( &ctx->stats.reconnects, 1 );
+
+  /* COPY data could be streamed partially, so request is not retried. It is
+   * never pipelined, so it is the only one in flight. Cancel is sent only for
+   * the first request, which is not retried as well, but requests pipelined
+   * after it are released to the queue below */
+  if ( (req = conn->req) != NULL &&
+       ((req->flags & DBX_FLAG_COPY) || req->cancel) )
+  {
+    dbx_stats_add( &ctx->stats.errors, 1 );
+
+    if (req->on_error)
+    {
+      req->on_error( (req->cancel & DBX_CANCEL_TIMEOUT) ? dbxTimeoutStr
+                                                        : dbxCopyLostStr,
+                     conn->cell, req->u_data, req->sql );
+    }
+
+    if ( !(conn->req = req->next) )
+      conn->tail = NULL;
+
+    conn->depth--;
+    ctx->active--;
+    dbx_request_free(req);
+  }
+
+  conn->copy             = 0;
+  conn->copy_data.length = 0;
+
+  /* release requests */
+  ctx->active -= conn->depth;
+  dbx_queue_release( ctx, conn_i );
+
+  if (conn->sd != -1)
+  {
+    epoll_ctl(ctx->epoll, EPOLL_CTL_DEL, conn->sd, NULL);
+    conn->sd     = -1;
+    conn->events = 0;
+  }
+
+  dbx_conn_free_stmts( conn );
+
+  PQfinish(conn->pg);
+  conn->pg = NULL;
+
+  ctx->conn_down++;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+dbx_conn_start( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t conn = &ctx->conn[ conn_i ];
+
+  if ( !(conn->pg = PQconnectStart(ctx->endpoints[conn->endpoint].uri)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  ctx->conn_down--;
+
+  conn->cell = PGRES_POLLING_WRITING;
+
+  if ( PQstatus(conn->pg) == CONNECTION_BAD ||
+       dbx_conn_watch(ctx, conn_i, EPOLLOUT) != CSTUFF_SUCCESS )
+  {
+    dbx_conn_reset( ctx, conn_i );
+    return CSTUFF_EXTCALL_ERROR;
+  }
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* mark connection available if it could take one more request */
+static void
+dbx_conn_update( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t conn  = &ctx->conn[ conn_i ];
+  int        limit = (PQpipelineStatus(conn->pg) == PQ_PIPELINE_OFF) ? 1
+                                                                : ctx->pipeline;
+
+  if (conn->depth < limit && conn_i != ctx->drain)
+    bitset_unset(ctx->conn_busy, conn_i);
+  else
+    bitset_set(ctx->conn_busy, conn_i);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+dbx_conn_poll( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t       conn = &ctx->conn[ conn_i ];
+  cstuff_retcode_t result;
+
+  switch( (conn->cell = PQconnectPoll(conn->pg)) )
+  {
+    case PGRES_POLLING_READING:
+      result = dbx_conn_watch(ctx, conn_i, EPOLLIN);
+      break;
+
+    case PGRES_POLLING_WRITING:
+      result = dbx_conn_watch(ctx, conn_i, EPOLLOUT);
+      break;
+
+    case PGRES_POLLING_OK:
+      if ( PQsetnonblocking(conn->pg, 1) == -1 )
+      {
+        result = CSTUFF_EXTCALL_ERROR;
+        break;
+      }
+
+      conn->failures = 0;
+      bitset_set(ctx->conn_mask, conn_i);
+      dbx_conn_update( ctx, conn_i );
+      return dbx_conn_watch(ctx, conn_i, EPOLLIN);
+
+    case PGRES_POLLING_FAILED:
+      result = CSTUFF_EXTCALL_ERROR;
+      break;
+
+    default:
+      return CSTUFF_SUCCESS;
+  }
+
+  if (result != CSTUFF_SUCCESS)
+    dbx_conn_reset( ctx, conn_i );
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+dbx_conn_flush( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t conn = &ctx->conn[ conn_i ];
+
+  switch( PQflush(conn->pg) )
+  {
+    case 0:
+      /* COPY data producer is called when connection is writable */
+      return dbx_conn_watch( ctx, conn_i, (conn->copy & DBX_COPY_SENDING)
+                                          ? EPOLLIN | EPOLLOUT : EPOLLIN );
+
+    case 1:
+      return dbx_conn_watch(ctx, conn_i, EPOLLIN | EPOLLOUT);
+
+    default:
+      return CSTUFF_EXTCALL_ERROR;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* find prepared statement of request in connection cache or allocate it
+ * there, evicting the least recently used one. On eviction drop is filled
+ * with SQL to deallocate evicted statement */
+static cstuff_retcode_t
+dbx_conn_prepare( dbx_context_t   ctx,
+                  dbx_conn_t      conn,
+                  dbx_request_t   req,
+                  char          * drop )
+{
+  dbx_stmt_t stmt,
+             lru = NULL;
+  int        i;
+
+  if (!conn->stmts)
+  {
+    if ( !(conn->stmts = calloc(ctx->stmt_limit, sizeof(struct dbx_stmt))) )
+      return CSTUFF_MALLOC_ERROR;
+
+    conn->n_stmts = ctx->stmt_limit;
+  }
+
+  for (i=0; i<conn->n_stmts; i++)
+  {
+    stmt = &conn->stmts[i];
+
+    if (stmt->used && stmt->hash == req->hash && !strcmp(stmt->sql, req->sql))
+    {
+      stmt->used = ++ctx->stmt_stamp;
+      req->stmt  = stmt;
+      return CSTUFF_SUCCESS;
+    }
+
+    if (!lru || stmt->used < lru->used)
+      lru = stmt;
+  }
+
+  if (lru->used)
+  {
+    sprintf(drop, "DEALLOCATE %s", lru->name);
+    free(lru->sql);
+    req->stage |= DBX_STAGE_DEALLOCATE;
+  }
+
+  if ( !(lru->sql = str_copy(req->sql)) )
+  {
+    lru->used = 0;
+    return CSTUFF_MALLOC_ERROR;
+  }
+
+  lru->hash = req->hash;
+  lru->used = ++ctx->stmt_stamp;
+  sprintf(lru->name, "dbx_%"PRIu32, conn->seq++);
+
+  req->stmt   = lru;
+  req->stage |= DBX_STAGE_PREPARE;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* forget prepared statement which failed to be prepared */
+static void
+dbx_conn_unprepare( dbx_stmt_t stmt )
+{
+  if (stmt->used)
+  {
+    free(stmt->sql);
+    stmt->sql  = NULL;
+    stmt->used = 0;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* send commands of request: all of them in pipeline mode, otherwise the next
+ * one is sent when previous is complete */
+static int
+dbx_conn_send_stage( dbx_conn_t conn, dbx_request_t req, const char * drop )
+{
+  int stage, rc,
+      pipeline = (PQpipelineStatus(conn->pg) != PQ_PIPELINE_OFF),
+      format   = (req->flags & DBX_FLAG_BINARY) ? 1 : 0;
+
+  while ( (stage = req->stage & -req->stage) != 0 )
+  {
+    switch (stage)
+    {
+      case DBX_STAGE_DEALLOCATE:
+        rc = (pipeline) ? PQsendQueryParams(conn->pg, drop, 0, NULL, NULL,
+                                                            NULL, NULL, 0)
+                        : PQsendQuery(conn->pg, drop);
+        break;
+
+      case DBX_STAGE_PREPARE:
+        rc = PQsendPrepare(conn->pg, req->stmt->name, req->sql, req->n_values,
+                                                                NULL);
+        break;
+
+      case DBX_STAGE_ROLLBACK:
+        rc = PQsendQuery(conn->pg, dbxRollbackStr);
+        break;
+
+      default:
+        if (req->stmt)
+          rc = PQsendQueryPrepared( conn->pg, req->stmt->name, req->n_values,
+                                    (const char * const *) req->values,
+                                    NULL, NULL, format );
+        else if (pipeline || (req->flags & (DBX_FLAG_PREPARED|DBX_FLAG_BINARY)))
+          rc = PQsendQueryParams( conn->pg, req->sql, req->n_values, NULL,
+                                  (const char * const *) req->values,
+                                  NULL, NULL, format );
+        else
+          rc = PQsendQuery(conn->pg, req->sql);
+
+        /* mode could not be set only if query was not sent */
+        if (rc && (req->flags & DBX_FLAG_STREAM))
+        {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+          if (req->chunk > 1)
+            rc = PQsetChunkedRowsMode(conn->pg, req->chunk);
+          else
+#endif
+            rc = PQsetSingleRowMode(conn->pg);
+        }
+    }
+
+    if (!rc)
+      return 0;
+
+    req->stage ^= stage;
+    req->sent  |= stage;
+
+    if (!pipeline)
+      break;
+
+    /* preparation and execution share sync, so failed preparation aborts
+     * execution */
+    if (stage != DBX_STAGE_PREPARE)
+    {
+      if (!PQpipelineSync(conn->pg))
+        return 0;
+
+      conn->syncs++;
+    }
+  }
+
+  return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* send request via connection, output is being flushed by caller.
+ * CSTUFF_PENDING means request requires an idle connection */
+static cstuff_retcode_t
+dbx_conn_send( dbx_context_t ctx, int conn_i, dbx_request_t req )
+{
+  dbx_conn_t conn = &ctx->conn[ conn_i ];
+  int        pipeline, rc;
+  char       drop[ sizeof("DEALLOCATE ") + DBX_STMT_NAME_SIZE ];
+
+  pipeline = ( ctx->pipeline > 1 && !dbx_request_is_exclusive(req) );
+
+  if ( pipeline != (PQpipelineStatus(conn->pg) != PQ_PIPELINE_OFF) )
+  {
+    /* pipeline mode could be switched on idle connection only */
+    if (conn->depth || conn->syncs)
+    {
+      dbx_queue_unshift( ctx, req );
+      return CSTUFF_PENDING;
+    }
+
+    rc = (pipeline) ? PQenterPipelineMode(conn->pg)
+                    : PQexitPipelineMode(conn->pg);
+
+    if (!rc)
+    {
+      dbx_queue_unshift( ctx, req );
+      return CSTUFF_EXTCALL_ERROR;
+    }
+  }
+
+  req->stmt     = NULL;
+  req->sent     = 0;
+  req->stage    = DBX_STAGE_EXECUTE;
+  req->sent_at  = dbx_time_now();
+  req->first_at = 0;
+  req->expires  = (req->timeout) ? req->sent_at + req->timeout : 0;
+
+  if ( (req->flags & DBX_FLAG_PREPARED) && ctx->stmt_limit )
+  {
+    if ( (rc = dbx_conn_prepare(ctx, conn, req, drop)) != CSTUFF_SUCCESS )
+    {
+      dbx_queue_unshift( ctx, req );
+      return rc;
+    }
+  }
+
+  if ( !dbx_conn_send_stage(conn, req, drop) )
+  {
+    if (req->stage & DBX_STAGE_PREPARE)
+      dbx_conn_unprepare( req->stmt );
+
+    dbx_queue_unshift( ctx, req );
+    return CSTUFF_EXTCALL_ERROR;
+  }
+
+  /* set request handling */
+  req->conn = conn->pg;
+
+  if (conn->tail)
+    conn->tail->next = req;
+  else
+  {
+    conn->req  = req;
+    /* reset result counter */
+    conn->cell = 0;
+    dbx_conn_expire_at( ctx, req );
+  }
+
+  conn->tail = req;
+  conn->depth++;
+  ctx->active++;
+
+  dbx_hist_record( &ctx->stats.wait, req->sent_at - req->queued_at );
+
+  /* set connection busy if limit is reached */
+  dbx_conn_update( ctx, conn_i );
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* stream COPY FROM STDIN data of request in flight, producer is called
+ * while connection output is not congested. CSTUFF_SUCCESS_WITH_REMARK means
+ * COPY is over and results have to be read */
+static cstuff_retcode_t
+dbx_conn_copy_in( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t              conn = &ctx->conn[ conn_i ];
+  dbx_request_t           req  = conn->req;
+  struct dbx_sql_buffer * data = &conn->copy_data;
+  int                     i, rc;
+
+  for (i=0; ; i++)
+  {
+    if (data->length)
+    {
+      if ( (rc = PQputCopyData(conn->pg, data->data, data->length)) == 0 )
+        return dbx_conn_watch(ctx, conn_i, EPOLLIN | EPOLLOUT);
+
+      if (rc == -1)
+        goto e_copy;
+
+      data->length = 0;
+    }
+
+    if ( (rc = PQflush(conn->pg)) != 0 )
+    {
+      return (rc == 1) ? dbx_conn_watch(ctx, conn_i, EPOLLIN | EPOLLOUT)
+                       : CSTUFF_EXTCALL_ERROR;
+    }
+
+    if (conn->copy != DBX_COPY_IN)
+      break;
+
+    /* let other connections work, producer will be called on next event */
+    if (i == DBX_COPY_CHUNKS)
+      return dbx_conn_watch(ctx, conn_i, EPOLLIN | EPOLLOUT);
+
+    rc = (req->on_copy_in) ? req->on_copy_in(data, req->u_data)
+                           : CSTUFF_NULL_OBJECT;
+
+    if (rc == CSTUFF_SUCCESS)
+      conn->copy = DBX_COPY_END;
+    else if (rc != CSTUFF_PENDING)
+    {
+      conn->copy   = DBX_COPY_ABORT;
+      data->length = 0;
+    }
+  }
+
+  rc = PQputCopyEnd( conn->pg,
+                     (conn->copy == DBX_COPY_ABORT) ? dbxCopyAbortStr : NULL );
+
+  if (rc == 0)
+    return dbx_conn_watch(ctx, conn_i, EPOLLIN | EPOLLOUT);
+
+  if (rc == -1)
+    goto e_copy;
+
+  conn->copy = 0;
+
+  return CSTUFF_SUCCESS_WITH_REMARK;
+
+e_copy:
+  /* server could end COPY with error, it comes as result */
+  conn->copy   = 0;
+  data->length = 0;
+
+  return (PQstatus(conn->pg) == CONNECTION_OK) ? CSTUFF_SUCCESS_WITH_REMARK
+                                               : CSTUFF_EXTCALL_ERROR;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* pass received COPY TO STDOUT data of request in flight to consumer.
+ * CSTUFF_PENDING means more data is expected */
+static cstuff_retcode_t
+dbx_conn_copy_out( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t     conn = &ctx->conn[ conn_i ];
+  dbx_request_t  req  = conn->req;
+  char         * data;
+  int            rc;
+
+  while ( (rc = PQgetCopyData(conn->pg, &data, 1)) > 0 )
+  {
+    if (req->on_copy_out && !req->on_copy_out(data, rc, req->u_data))
+      req->on_copy_out = NULL;
+
+    PQfreemem(data);
+  }
+
+  if (rc == 0)
+    return CSTUFF_PENDING;
+
+  conn->copy = 0;
+
+  return (rc == -1) ? CSTUFF_SUCCESS : CSTUFF_EXTCALL_ERROR;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* results of all requests come in order they were sent, each command of
+ * request ends up with NULL result and in pipeline mode is followed by sync
+ * result */
+static cstuff_retcode_t
+dbx_conn_read( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t       conn = &ctx->conn[ conn_i ];
+  PGresult       * res;
+  dbx_request_t    req;
+  ExecStatusType   status;
+  cstuff_retcode_t rc;
+  uint64_t         now;
+  int              stage;
+
+  if ( !PQconsumeInput(conn->pg) )
+    return CSTUFF_EXTCALL_ERROR;
+
+  /* errors of COPY FROM STDIN are detected by sending data */
+  if (conn->copy & DBX_COPY_SENDING)
+    return CSTUFF_SUCCESS;
+
+  if ( conn->copy == DBX_COPY_OUT &&
+       (rc = dbx_conn_copy_out(ctx, conn_i)) != CSTUFF_SUCCESS )
+    return (rc == CSTUFF_PENDING) ? CSTUFF_SUCCESS : rc;
+
+  while ( (conn->req || conn->syncs) && !PQisBusy(conn->pg) )
+  {
+    req   = conn->req;
+    stage = (req) ? req->sent & -req->sent : 0;
+
+    if ( (res = PQgetResult(conn->pg)) == NULL )
+    {
+      if (!req)
+        break;
+
+      /* command is complete */
+      req->sent ^= stage;
+
+      /* simple query leaves failed transaction block open */
+      if ( stage == DBX_STAGE_EXECUTE && (req->flags & DBX_FLAG_TRANSACTION) &&
+           PQtransactionStatus(conn->pg) != PQTRANS_IDLE )
+        req->stage |= DBX_STAGE_ROLLBACK;
+
+      if (req->sent)
+        continue;
+
+      if (req->stage)
+      {
+        if ( !dbx_conn_send_stage(conn, req, NULL) )
+          return CSTUFF_EXTCALL_ERROR;
+        continue;
+      }
+
+      /* request is complete */
+      if ( !(conn->req = req->next) )
+        conn->tail = NULL;
+      else
+        dbx_conn_expire_at( ctx, conn->req );
+
+      now = dbx_time_now();
+      dbx_stats_add( &ctx->stats.queries, 1 );
+      dbx_hist_record( &ctx->stats.exec, now - req->sent_at );
+      dbx_hist_record( &ctx->stats.first,
+                       (req->first_at ? req->first_at : now) - req->sent_at );
+
+      if (req->cache)
+        dbx_cache_complete(req->cache, now);
+
+      conn->depth--;
+      conn->cell = 0;
+      ctx->active--;
+
+      dbx_request_free(req);
+      dbx_conn_update( ctx, conn_i );
+      continue;
+    }
+
+    status = PQresultStatus(res);
+
+    if (status == PGRES_PIPELINE_SYNC)
+    {
+      conn->syncs--;
+      PQclear(res);
+      continue;
+    }
+
+    if (stage != DBX_STAGE_EXECUTE)
+    {
+      /* results of deallocation are not interesting, failed preparation is
+       * reported as request error */
+      if ( stage == DBX_STAGE_PREPARE && status != PGRES_COMMAND_OK )
+      {
+        dbx_conn_unprepare( req->stmt );
+        dbx_stats_add( &ctx->stats.errors, 1 );
+
+        /* statement does not exist, so it is not executed. Rollback is
+         * scheduled by execution only, no transaction block is opened */
+        req->stage &= ~DBX_STAGE_EXECUTE;
+
+        if (req->on_error)
+        {
+          req->on_error( PQresultErrorMessage(res), conn->cell, req->u_data,
+                                                                req->sql );
+        }
+
+        req->on_result = NULL;
+        req->on_error  = NULL;
+      }
+
+      PQclear(res);
+      continue;
+    }
+
+    if (!req->first_at)
+      req->first_at = dbx_time_now();
+
+    switch (status)
+    {
+      case PGRES_COPY_IN:
+        PQclear(res);
+        conn->copy = DBX_COPY_IN;
+
+        rc = dbx_conn_copy_in(ctx, conn_i);
+
+        if (rc == CSTUFF_SUCCESS_WITH_REMARK)
+          continue;
+
+        return rc;
+
+      case PGRES_COPY_OUT:
+        PQclear(res);
+        conn->copy = DBX_COPY_OUT;
+
+        if ( (rc = dbx_conn_copy_out(ctx, conn_i)) == CSTUFF_SUCCESS )
+          continue;
+
+        return (rc == CSTUFF_PENDING) ? CSTUFF_SUCCESS : rc;
+
+      case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+      case PGRES_TUPLES_CHUNK:
+#endif
+        /* streamed rows share result index with final empty result */
+        if (req->on_result && !req->on_result(res, conn->cell, req->u_data))
+        {
+          req->on_result = NULL;
+          req->on_error  = NULL;
+        }
+        PQclear(res);
+        continue;
+
+      case PGRES_COMMAND_OK:
+      case PGRES_TUPLES_OK:
+        /* results of cache leader are kept by cache */
+        if (req->cache && dbx_cache_store(req->cache, res, conn->cell))
+          break;
+
+        if (req->on_result)
+        {
+          if (!(req->on_result(res, conn->cell, req->u_data)))
+          {
+            req->on_result = NULL;
+            req->on_error = NULL;
+          }
+        }
+        PQclear(res);
+        break;
+
+      default:
+        dbx_stats_add( &ctx->stats.errors, 1 );
+
+        if (req->on_error)
+        {
+          req->on_error(
+            (status == PGRES_PIPELINE_ABORTED) ? dbxAbortStr :
+            (req->cancel & DBX_CANCEL_TIMEOUT) ? dbxTimeoutStr
+                                               : PQresultErrorMessage(res),
+            conn->cell,
+            req->u_data,
+            req->sql
+          );
+        }
+
+        PQclear(res);
+    }
+    conn->cell++;
+  }
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+
+/* advance non-blocking cancel request of connection */
+static cstuff_retcode_t
+dbx_cancel_poll( dbx_context_t ctx, int conn_i, PostgresPollingStatusType st )
+{
+  dbx_conn_t         conn = &ctx->conn[ conn_i ];
+  struct epoll_event ev;
+  int                sd, op;
+
+  if (st == PGRES_POLLING_READING || st == PGRES_POLLING_WRITING)
+  {
+    ev.events   = (st == PGRES_POLLING_READING) ? EPOLLIN : EPOLLOUT;
+    ev.data.u64 = 0;
+    ev.data.u32 = (uint32_t) conn_i | DBX_CANCEL_EVENT;
+
+    if ( (sd = PQcancelSocket(conn->cancel)) != conn->cancel_sd )
+    {
+      if (conn->cancel_sd != -1)
+        epoll_ctl(ctx->epoll, EPOLL_CTL_DEL, conn->cancel_sd, NULL);
+      op = EPOLL_CTL_ADD;
+    }
+    else
+      op = EPOLL_CTL_MOD;
+
+    conn->cancel_sd = -1;
+
+    if (sd != -1 && epoll_ctl(ctx->epoll, op, sd, &ev) == 0)
+    {
+      conn->cancel_sd = sd;
+      return CSTUFF_SUCCESS;
+    }
+
+    st = PGRES_POLLING_FAILED;
+  }
+
+  /* cancel request is complete */
+  if (conn->cancel_sd != -1)
+  {
+    epoll_ctl(ctx->epoll, EPOLL_CTL_DEL, conn->cancel_sd, NULL);
+    conn->cancel_sd = -1;
+  }
+
+  PQcancelFinish(conn->cancel);
+  conn->cancel = NULL;
+
+  return (st == PGRES_POLLING_OK) ? CSTUFF_SUCCESS : CSTUFF_EXTCALL_ERROR;
+}
+
+#else
+
+/* worker sending blocking cancel requests, it owns cancel objects */
+static void *
+dbx_cancel_thread( void * data )
+{
+  struct dbx_canceller  * canceller = data;
+  struct dbx_cancel_job * job;
+  char                    e_buffer[256];
+
+  pthread_mutex_lock(&canceller->lock);
+
+  while (!canceller->stop)
+  {
+    if ( !(job = canceller->head) )
+    {
+      pthread_cond_wait(&canceller->cond, &canceller->lock);
+      continue;
+    }
+
+    if ( !(canceller->head = job->next) )
+      canceller->tail = NULL;
+
+    pthread_mutex_unlock(&canceller->lock);
+
+    PQcancel( job->cancel, e_buffer, sizeof(e_buffer) );
+    PQfreeCancel( job->cancel );
+    free(job);
+
+    pthread_mutex_lock(&canceller->lock);
+  }
+
+  pthread_mutex_unlock(&canceller->lock);
+
+  return NULL;
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+/* ask server to cancel query being executed on connection, the loop is not
+ * blocked: libpq with async cancel API is polled via epoll, otherwise cancel
+ * request is queued to worker thread of context. CSTUFF_PENDING means that
+ * previous cancel request of connection is still in progress */
+static cstuff_retcode_t
+dbx_conn_cancel( dbx_context_t ctx, int conn_i )
+{
+  dbx_conn_t conn = &ctx->conn[ conn_i ];
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  if (conn->cancel)
+    return CSTUFF_PENDING;
+
+  if ( !(conn->cancel = PQcancelCreate(conn->pg)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  if ( !PQcancelStart(conn->cancel) )
+    return dbx_cancel_poll( ctx, conn_i, PGRES_POLLING_FAILED );
+
+  return dbx_cancel_poll( ctx, conn_i, PGRES_POLLING_WRITING );
+#else
+  struct dbx_canceller  * canceller = &ctx->canceller;
+  struct dbx_cancel_job * job;
+  cstuff_retcode_t        result = CSTUFF_SUCCESS;
+
+  if ( !(job = malloc(sizeof(struct dbx_cancel_job))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  if ( !(job->cancel = PQgetCancel(conn->pg)) )
+  {
+    free(job);
+    return CSTUFF_EXTCALL_ERROR;
+  }
+
+  job->next = NULL;
+
+  pthread_mutex_lock(&canceller->lock);
+
+  /* worker is started by the first cancel */
+  if (!canceller->started)
+  {
+    if (pthread_create(&canceller->thread, NULL, dbx_cancel_thread, canceller))
+      result = CSTUFF_SYSCALL_ERROR;
+    else
+      canceller->started = true;
+  }
+
+  if (result == CSTUFF_SUCCESS)
+  {
+    if (canceller->tail)
+      canceller->tail->next = job;
+    else
+      canceller->head = job;
+
+    canceller->tail = job;
+    pthread_cond_signal(&canceller->cond);
+  }
+
+  pthread_mutex_unlock(&canceller->lock);
+
+  if (result != CSTUFF_SUCCESS)
+  {
+    PQfreeCancel(job->cancel);
+    free(job);
+  }
+
+  return result;
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* cancel queries which run out of time or were cancelled by user. Server
+ * gets DBX_CANCEL_GRACE to stop the query, then connection is dropped, so
+ * runaway query could not hold it forever. Requests of connection are in
+ * order, so only the first one could be executed by server */
+static void
+dbx_conn_expire( dbx_context_t ctx, uint64_t now )
+{
+  dbx_request_t req;
+  int           i;
+
+  /* no query in flight has a timer or was cancelled */
+  if (now < ctx->conn_expiry)
+    return;
+
+  ctx->conn_expiry = UINT64_MAX;
+
+  for (i=0; i<ctx->conn_size; i++)
+  {
+    if ( !(req = ctx->conn[i].req) )
+      continue;
+
+    if (req->cancel & DBX_CANCEL_SENT)
+    {
+      if (now >= req->expires)
+        dbx_conn_reset( ctx, i );
+      else
+        dbx_conn_expire_at( ctx, req );
+      continue;
+    }
+
+    if (req->expires && now >= req->expires && !req->cancel)
+    {
+      req->cancel |= DBX_CANCEL_TIMEOUT;
+      dbx_stats_add( &ctx->stats.timeouts, 1 );
+    }
+
+    /* failed cancel request is handled as not respected one */
+    if ( req->cancel && dbx_conn_cancel(ctx, i) != CSTUFF_PENDING )
+    {
+      req->cancel |= DBX_CANCEL_SENT;
+      req->expires = now + (uint64_t) DBX_CANCEL_GRACE * 1000;
+    }
+
+    dbx_conn_expire_at( ctx, req );
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+dbx_conn_handle( dbx_context_t ctx, int conn_i, uint32_t events )
+{
+  dbx_conn_t       conn = &ctx->conn[ conn_i ];
+  cstuff_retcode_t result = CSTUFF_SUCCESS;
+
+  if ( !conn->pg ) /* connection was dropped while handling other events */
+    return CSTUFF_SUCCESS;
+
+  if ( !bitset_test(ctx->conn_mask, conn_i) )
+    return dbx_conn_poll( ctx, conn_i );
+
+  if (conn->copy & DBX_COPY_SENDING)
+  {
+    /* COPY is over when producer and connection output are done */
+    if ( (events & EPOLLOUT) &&
+         (result = dbx_conn_copy_in(ctx, conn_i)) == CSTUFF_SUCCESS_WITH_REMARK)
+    {
+      events |= EPOLLIN;
+      result  = CSTUFF_SUCCESS;
+    }
+  }
+  else if (events & EPOLLOUT)
+    result = dbx_conn_flush( ctx, conn_i );
+
+  if (result == CSTUFF_SUCCESS && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+  {
+    /* next command of request could be sent while reading */
+    if ( (result = dbx_conn_read( ctx, conn_i )) == CSTUFF_SUCCESS )
+      result = dbx_conn_flush( ctx, conn_i );
+  }
+
+  if (result != CSTUFF_SUCCESS || PQstatus(conn->pg) == CONNECTION_BAD)
+  {
+    dbx_conn_reset( ctx, conn_i );
+    result = CSTUFF_EXTCALL_ERROR;
+  }
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_set_pipeline( dbx_context_t ctx, int depth )
+{
+  int i;
+
+  ctx->pipeline = (depth < 1) ? 1 : depth;
+
+  for (i=0; ctx->conn && i<ctx->conn_size; i++)
+  {
+    if ( bitset_test(ctx->conn_mask, i) )
+      dbx_conn_update( ctx, i );
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_set_pipeline( int depth )
+{
+  dbx_context_set_pipeline( dbxContext, depth );
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_set_prepared( dbx_context_t ctx, int cache_size )
+{
+  ctx->stmt_limit = (cache_size < 0) ? 0 : cache_size;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_set_prepared( int cache_size )
+{
+  dbx_context_set_prepared( dbxContext, cache_size );
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_set_cache( dbx_context_t ctx, size_t limit )
+{
+  /* entries above limit are evicted by the next touch */
+  ctx->cache.limit = limit;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_set_cache( size_t limit )
+{
+  dbx_context_set_cache( dbxContext, limit );
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_set_reconnect_delay( dbx_context_t ctx, int min, int max )
+{
+  if (min < 0)
+    min = 0;
+
+  ctx->retry_min = (uint64_t) min * 1000;
+  ctx->retry_max = (uint64_t) ((max < min) ? min : max) * 1000;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_set_reconnect_delay( int min, int max )
+{
+  dbx_context_set_reconnect_delay( dbxContext, min, max );
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_set_priority_weight( dbx_context_t  ctx,
+                                 dbx_priority_t priority,
+                                 int            weight )
+{
+  if (priority >= 0 && priority < DBX_PRIORITIES)
+    ctx->weight[priority] = (weight < 1) ? 1 : weight;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_set_priority_weight( dbx_priority_t priority, int weight )
+{
+  dbx_context_set_priority_weight( dbxContext, priority, weight );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ensure buffer has room for length more characters and terminating null */
+static int
+dbx_sql_buffer_reserve( struct dbx_sql_buffer * buffer, size_t length )
+{
+  char   * data;
+  size_t   size = (buffer->size) ? buffer->size : 256;
+
+  length += buffer->length + 1;
+
+  if (length <= buffer->size)
+    return 0;
+
+  while (size < length)
+    size *= 2;
+
+  if ( !(data = realloc(buffer->data, size)) )
+    return -1;
+
+  buffer->data = data;
+  buffer->size = size;
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* LISTEN connection ------------------------------------------------------- */
+
+static void
+dbx_listener_reset( dbx_context_t ctx )
+{
+  struct dbx_listener  * listener = &ctx->listener;
+  struct dbx_channel  ** p_ch, * ch;
+
+  if (listener->conn.pg)
+    dbx_set_error( ctx, listener->conn.pg );
+
+  if (listener->conn.sd != -1)
+  {
+    epoll_ctl(ctx->epoll, EPOLL_CTL_DEL, listener->conn.sd, NULL);
+    listener->conn.sd     = -1;
+    listener->conn.events = 0;
+  }
+
+  PQfinish(listener->conn.pg);
+  listener->conn.pg    = NULL;
+  listener->conn.depth = 0;
+
+  if (listener->ready)
+    listener->conn.failures = 0;
+
+  listener->conn.failures++;
+  listener->conn.retry_at = dbx_time_now() +
+                            dbx_conn_backoff(ctx, listener->conn.failures);
+  listener->ready = false;
+
+  /* new connection listens to nothing */
+  for (p_ch = &listener->channels; (ch = *p_ch) != NULL; )
+  {
+    if (ch->removed)
+    {
+      *p_ch = ch->next;
+      free(ch->name);
+      free(ch);
+      continue;
+    }
+
+    ch->subscribed = false;
+    p_ch = &ch->next;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_listener_start( dbx_context_t ctx )
+{
+  struct dbx_listener * listener = &ctx->listener;
+
+  if ( !(listener->conn.pg = PQconnectStart(ctx->endpoints[0].uri)) )
+    return;
+
+  if ( PQstatus(listener->conn.pg) == CONNECTION_BAD ||
+       dbx_conn_watch_ex(ctx, &listener->conn, DBX_LISTEN_EVENT, EPOLLOUT)
+                                                            != CSTUFF_SUCCESS )
+  {
+    dbx_listener_reset( ctx );
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* watch for output while it is not flushed */
+static cstuff_retcode_t
+dbx_listener_flush( dbx_context_t ctx )
+{
+  struct dbx_listener * listener = &ctx->listener;
+  int                   rc;
+
+  if ( (rc = PQflush(listener->conn.pg)) == -1 )
+    return CSTUFF_EXTCALL_ERROR;
+
+  return dbx_conn_watch_ex( ctx, &listener->conn, DBX_LISTEN_EVENT,
+                            (rc) ? EPOLLIN | EPOLLOUT : EPOLLIN );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* send LISTEN and UNLISTEN commands of changed channels as one query */
+static cstuff_retcode_t
+dbx_listener_sync( dbx_context_t ctx )
+{
+  struct dbx_listener   * listener = &ctx->listener;
+  struct dbx_channel   ** p_ch, * ch;
+  struct dbx_sql_buffer   sql = {NULL, 0, 0};
+  cstuff_retcode_t        result = CSTUFF_SUCCESS;
+  char                  * id;
+  size_t                  length;
+
+  /* previous commands are in progress */
+  if (!listener->ready || listener->conn.depth)
+    return CSTUFF_SUCCESS;
+
+  listener->dirty = false;
+
+  for (p_ch = &listener->channels; (ch = *p_ch) != NULL; )
+  {
+    if (ch->subscribed == !ch->removed)
+    {
+      p_ch = &ch->next;
+      continue;
+    }
+
+    id = PQescapeIdentifier(listener->conn.pg, ch->name, strlen(ch->name));
+
+    if (!id || dbx_sql_buffer_reserve(&sql, (length = strlen(id)) + 10) == -1)
+    {
+      PQfreemem(id);
+      RAISE( CSTUFF_MALLOC_ERROR, finally );
+    }
+
+    if (ch->removed)
+    {
+      memcpy(&sql.data[sql.length], "UN", 2);
+      sql.length += 2;
+    }
+
+    memcpy(&sql.data[sql.length], "LISTEN ", 7);
+    memcpy(&sql.data[sql.length + 7], id, length);
+    memcpy(&sql.data[sql.length + 7 + length], ";", 2);
+    sql.length += 8 + length;
+    PQfreemem(id);
+
+    if (ch->removed)
+    {
+      *p_ch = ch->next;
+      free(ch->name);
+      free(ch);
+      continue;
+    }
+
+    ch->subscribed = true;
+    p_ch = &ch->next;
+  }
+
+  if (sql.length)
+  {
+    if ( !PQsendQuery(listener->conn.pg, sql.data) )
+      RAISE( CSTUFF_EXTCALL_ERROR, finally );
+
+    listener->conn.depth = 1;
+    result = dbx_listener_flush(ctx);
+  }
+
+finally:
+  free(sql.data);
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* read command results and pass notifications to channels callbacks */
+static cstuff_retcode_t
+dbx_listener_read( dbx_context_t ctx )
+{
+  struct dbx_listener * listener = &ctx->listener;
+  struct dbx_channel  * ch;
+  PGnotify            * notify;
+  PGresult            * res;
+
+  if ( !PQconsumeInput(listener->conn.pg) )
+    return CSTUFF_EXTCALL_ERROR;
+
+  while (listener->conn.depth && !PQisBusy(listener->conn.pg))
+  {
+    if ( (res = PQgetResult(listener->conn.pg)) == NULL )
+    {
+      listener->conn.depth = 0;
+      break;
+    }
+
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+      dbx_set_error( ctx, listener->conn.pg );
+
+    PQclear(res);
+  }
+
+  while ( (notify = PQnotifies(listener->conn.pg)) != NULL )
+  {
+    for (ch = listener->channels; ch; ch = ch->next)
+    {
+      if (!ch->removed && !strcmp(ch->name, notify->relname))
+      {
+        ch->on_notify(notify->relname, notify->extra, notify->be_pid,
+                                                      ch->u_data);
+        break;
+      }
+    }
+
+    PQfreemem(notify);
+  }
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_listener_handle( dbx_context_t ctx, uint32_t events )
+{
+  struct dbx_listener * listener = &ctx->listener;
+  cstuff_retcode_t      result = CSTUFF_SUCCESS;
+
+  if (!listener->conn.pg)
+    return;
+
+  if (!listener->ready)
+  {
+    switch (PQconnectPoll(listener->conn.pg))
+    {
+      case PGRES_POLLING_READING:
+        result = dbx_conn_watch_ex(ctx, &listener->conn, DBX_LISTEN_EVENT,
+                                                         EPOLLIN);
+        break;
+
+      case PGRES_POLLING_WRITING:
+        result = dbx_conn_watch_ex(ctx, &listener->conn, DBX_LISTEN_EVENT,
+                                                         EPOLLOUT);
+        break;
+
+      case PGRES_POLLING_OK:
+        if ( PQsetnonblocking(listener->conn.pg, 1) == -1 )
+        {
+          result = CSTUFF_EXTCALL_ERROR;
+          break;
+        }
+
+        /* subscribe again */
+        listener->ready         = true;
+        listener->dirty         = true;
+        listener->conn.failures = 0;
+        result = dbx_conn_watch_ex(ctx, &listener->conn, DBX_LISTEN_EVENT,
+                                                         EPOLLIN);
+        break;
+
+      case PGRES_POLLING_FAILED:
+        result = CSTUFF_EXTCALL_ERROR;
+        break;
+
+      default:
+        break;
+    }
+  }
+  else
+  {
+    if (events & EPOLLOUT)
+      result = dbx_listener_flush(ctx);
+
+    if (result == CSTUFF_SUCCESS && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+      result = dbx_listener_read(ctx);
+  }
+
+  if (result != CSTUFF_SUCCESS || PQstatus(listener->conn.pg) == CONNECTION_BAD)
+    dbx_listener_reset( ctx );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* keep LISTEN connection while there are channels */
+static void
+dbx_listener_touch( dbx_context_t ctx )
+{
+  struct dbx_listener * listener = &ctx->listener;
+
+  if (!listener->channels)
+    return;
+
+  if (!listener->conn.pg)
+  {
+    if (dbx_time_now() >= listener->conn.retry_at)
+      dbx_listener_start( ctx );
+  }
+  else if ( listener->dirty && dbx_listener_sync(ctx) != CSTUFF_SUCCESS )
+    dbx_listener_reset( ctx );
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_context_listen( dbx_context_t     ctx,
+                    const char      * channel,
+                    dbx_on_notify_t   on_notify,
+                    void            * u_data )
+{
+  struct dbx_channel * ch;
+
+  for (ch = ctx->listener.channels; ch; ch = ch->next)
+  {
+    if ( !strcmp(ch->name, channel) )
+      break;
+  }
+
+  if (!ch)
+  {
+    if ( !(ch = calloc(1, sizeof(struct dbx_channel))) )
+      return CSTUFF_MALLOC_ERROR;
+
+    if ( !(ch->name = str_copy(channel)) )
+    {
+      free(ch);
+      return CSTUFF_MALLOC_ERROR;
+    }
+
+    ch->next               = ctx->listener.channels;
+    ctx->listener.channels = ch;
+  }
+
+  /* channel to be unsubscribed is still subscribed */
+  ch->removed   = false;
+  ch->on_notify = on_notify;
+  ch->u_data    = u_data;
+
+  ctx->listener.dirty = true;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_listen( const char * channel, dbx_on_notify_t on_notify, void * u_data )
+{
+  return dbx_context_listen( dbxContext, channel, on_notify, u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_context_unlisten( dbx_context_t ctx, const char * channel )
+{
+  struct dbx_channel ** p_ch, * ch;
+
+  for (p_ch = &ctx->listener.channels; (ch = *p_ch) != NULL; p_ch = &ch->next)
+  {
+    if ( ch->removed || strcmp(ch->name, channel) )
+      continue;
+
+    /* channel was not subscribed yet */
+    if (!ch->subscribed)
+    {
+      *p_ch = ch->next;
+      free(ch->name);
+      free(ch);
+    }
+    else
+    {
+      ch->removed = true;
+      ctx->listener.dirty = true;
+    }
+
+    return CSTUFF_SUCCESS;
+  }
+
+  return CSTUFF_NOT_FOUND;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_unlisten( const char * channel )
+{
+  return dbx_context_unlisten( dbxContext, channel );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* connection could take request, idle one has nothing in flight. Slot
+ * reserved for requests out of pipeline is busy for the others */
+static bool
+dbx_conn_is_free( dbx_context_t ctx, int conn_i, bool idle )
+{
+  if (!idle)
+    return !bitset_test(ctx->conn_busy, conn_i);
+
+  return ( bitset_test(ctx->conn_mask, conn_i) && !ctx->conn[conn_i].depth &&
+                                                  !ctx->conn[conn_i].syncs );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* free connection for requests of route. Read only requests go to replica
+ * with the least requests in flight, or to primary while no replica is
+ * ready, the others go to primary. Requests which could not be pipelined
+ * need idle connection. -1 if all of them are busy */
+static int
+dbx_route_find_conn( dbx_context_t ctx, int route, bool idle )
+{
+  struct dbx_endpoint * ep;
+  int                   e, i, conn_i, depth, ready = 0,
+                        result = -1, min_depth = 0;
+
+  if (route == DBX_ROUTE_REPLICA)
+  {
+    for (e=1; e<ctx->n_endpoints; e++)
+    {
+      ep     = &ctx->endpoints[e];
+      depth  = 0;
+      conn_i = -1;
+
+      for (i=ep->first; i<ep->first + ep->size; i++)
+      {
+        if ( !bitset_test(ctx->conn_mask, i) )
+          continue;
+
+        ready  = 1;
+        depth += ctx->conn[i].depth;
+
+        if (conn_i == -1 && dbx_conn_is_free(ctx, i, idle))
+          conn_i = i;
+      }
+
+      if (conn_i != -1 && (result == -1 || depth < min_depth))
+      {
+        result    = conn_i;
+        min_depth = depth;
+      }
+    }
+
+    if (ready)
+      return result;
+  }
+
+  /* the whole pool is primary one */
+  if (ctx->n_endpoints == 1 && !idle)
+    return bitset_find_first_free(ctx->conn_busy);
+
+  ep = &ctx->endpoints[0];
+
+  for (i=ep->first; i<ep->first + ep->size; i++)
+  {
+    if ( dbx_conn_is_free(ctx, i, idle) )
+      return i;
+  }
+
+  return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* reserve connection of route with the least requests in flight for request
+ * which needs idle one, it takes no other requests until it gets idle, so
+ * request out of pipeline is not starved by pipelined ones */
+static void
+dbx_route_drain( dbx_context_t ctx, int route )
+{
+  struct dbx_endpoint * ep;
+  int                   e, i,
+                        first = (route == DBX_ROUTE_REPLICA) ? 1 : 0,
+                        last = (first) ? ctx->n_endpoints : 1,
+                        result = -1;
+
+  for (;;)
+  {
+    for (e=first; e<last; e++)
+    {
+      ep = &ctx->endpoints[e];
+
+      for (i=ep->first; i<ep->first + ep->size; i++)
+      {
+        if ( bitset_test(ctx->conn_mask, i) &&
+             (result == -1 || ctx->conn[i].depth < ctx->conn[result].depth) )
+          result = i;
+      }
+    }
+
+    /* primary is used while no replica is ready */
+    if (result != -1 || !first)
+      break;
+
+    first = 0;
+    last  = 1;
+  }
+
+  if (result != -1)
+  {
+    ctx->drain = result;
+    bitset_set(ctx->conn_busy, result);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_context_touch( dbx_context_t ctx )
+{
+  struct epoll_event  events[ DBX_EPOLL_EVENTS ];
+  dbx_request_t       req, parked;
+  int                 i, n, r;
+  bool                idle;
+  uint64_t            now;
+  cstuff_retcode_t    rc,
+                      result = CSTUFF_SUCCESS;
+
+  /* assign connections to free slots which waited their backoff, requests
+   * are dispatched to ready connections only meanwhile */
+  if (ctx->conn_down && (now = dbx_time_now()) >= ctx->retry_at)
+  {
+    ctx->retry_at = UINT64_MAX;
+
+    for (i=0; i<ctx->conn_size; i++)
+    {
+      if (ctx->conn[i].pg)
+        continue;
+
+      if (ctx->conn[i].retry_at > now)
+      {
+        if (ctx->conn[i].retry_at < ctx->retry_at)
+          ctx->retry_at = ctx->conn[i].retry_at;
+      }
+      else if ( (rc = dbx_conn_start(ctx, i)) != CSTUFF_SUCCESS )
+        result = rc;
+    }
+  }
+
+  /* handle ready sockets only */
+  if ( (n = epoll_wait(ctx->epoll, events, DBX_EPOLL_EVENTS, 0)) == -1 )
+  {
+    if (errno != EINTR)
+      return CSTUFF_SYSCALL_ERROR;
+    n = 0;
+  }
+
+  for (i=0; i<n; i++)
+  {
+    if (events[i].data.u32 == DBX_INBOX_EVENT)
+      continue;
+
+    if (events[i].data.u32 == DBX_LISTEN_EVENT)
+    {
+      dbx_listener_handle( ctx, events[i].events );
+      continue;
+    }
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    if (events[i].data.u32 & DBX_CANCEL_EVENT)
+    {
+      dbx_conn_t conn = &ctx->conn[ events[i].data.u32 & ~DBX_CANCEL_EVENT ];
+
+      if (conn->cancel)
+      {
+        dbx_cancel_poll( ctx, conn - ctx->conn, PQcancelPoll(conn->cancel) );
+      }
+      continue;
+    }
+#endif
+
+    if ( (rc = dbx_conn_handle(ctx, events[i].data.u32, events[i].events))
+                                                             != CSTUFF_SUCCESS )
+      result = rc;
+  }
+
+  /* (re)connect and (re)subscribe LISTEN connection */
+  dbx_listener_touch( ctx );
+
+  /* take requests submitted by other threads */
+  if (atomic_load_explicit(&ctx->inbox, memory_order_relaxed))
+    dbx_queue_receive( ctx );
+
+  now = dbx_time_now();
+
+  /* serve cached results, evict entries exceeding changed limit */
+  if (ctx->cache.lookup || ctx->cache.size > ctx->cache.limit)
+    dbx_cache_lookup( ctx, now );
+
+  /* cancel requests which missed deadline before they are sent */
+  dbx_queue_expire( ctx, now );
+
+  /* cancel queries in flight which run out of time */
+  dbx_conn_expire( ctx, now );
+
+  /* dispatch queued requests to available connections, output of connection
+   * is flushed once all requests it could take were sent. Request which
+   * needs idle connection, while there is no one, is parked, so it does not
+   * stall requests queued after it */
+  for (r=0; r<DBX_ROUTES; r++)
+  {
+    parked = NULL;
+
+    for (i = -1; (req = dbx_queue_shift(ctx, r)) != NULL; i = n)
+    {
+      idle = (ctx->pipeline > 1 && dbx_request_is_exclusive(req));
+
+      if ( (n = dbx_route_find_conn(ctx, r, idle)) == -1 )
+      {
+        if (idle)
+        {
+          if (ctx->drain == -1)
+            dbx_route_drain( ctx, r );
+
+          req->next = parked;
+          parked    = req;
+          n         = i;
+          continue;
+        }
+
+        /* all connections of route are busy */
+        dbx_queue_unshift( ctx, req );
+        dbx_stats_add( &ctx->stats.saturations, 1 );
+        break;
+      }
+
+      if (n != i && i != -1)
+      {
+        if ( (rc = dbx_conn_flush(ctx, i)) != CSTUFF_SUCCESS )
+        {
+          dbx_conn_reset( ctx, i );
+          result = rc;
+        }
+      }
+
+      if (n == ctx->drain)
+        ctx->drain = -1;
+
+      rc = dbx_conn_send(ctx, n, req);
+
+      if (rc == CSTUFF_PENDING)
+      {
+        /* pipeline mode of connection could not be switched yet */
+        dbx_queue_unlink( ctx, req );
+        req->next = parked;
+        parked    = req;
+      }
+      else if (rc != CSTUFF_SUCCESS)
+      {
+        dbx_conn_reset( ctx, n );
+        result = rc;
+        n = -1;
+      }
+    }
+
+    /* parked requests go back to queue heads in their order */
+    for (; parked; parked = req)
+    {
+      req = parked->next;
+      dbx_queue_unshift( ctx, parked );
+    }
+
+    if (i != -1 && ctx->conn[i].pg &&
+                   (rc = dbx_conn_flush(ctx, i)) != CSTUFF_SUCCESS)
+    {
+      dbx_conn_reset( ctx, i );
+      result = rc;
+    }
+  }
+
+  /* requests reserved slot was waiting for were cancelled or expired */
+  if (ctx->drain != -1 && !ctx->exclusive)
+  {
+    i = ctx->drain;
+    ctx->drain = -1;
+
+    if ( bitset_test(ctx->conn_mask, i) )
+      dbx_conn_update( ctx, i );
+  }
+
+  for (n=0, i=0; i<DBX_PRIORITIES; i++)
+    n += ctx->queue[DBX_ROUTE_PRIMARY][i].count +
+         ctx->queue[DBX_ROUTE_REPLICA][i].count;
+
+  atomic_store_explicit(&ctx->stats.queued, n, memory_order_relaxed);
+  atomic_store_explicit(&ctx->stats.cache_size, ctx->cache.size,
+                        memory_order_relaxed);
+  atomic_store_explicit(&ctx->stats.active, ctx->active, memory_order_relaxed);
+
+  i = bitset_count(ctx->conn_mask);
+  atomic_store_explicit(&ctx->stats.connections, i, memory_order_relaxed);
+  atomic_store_explicit(&ctx->stats.connecting,
+                        ctx->conn_size - ctx->conn_down - i,
+                        memory_order_relaxed);
+  atomic_store_explicit(&ctx->stats.down, ctx->conn_down,
+                        memory_order_relaxed);
+
+  if (result == CSTUFF_SUCCESS && !ctx->active && !n && !ctx->cache.lookup)
+    result = CSTUFF_PENDING;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_touch()
+{
+  return dbx_context_touch( dbxContext );
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const char dbxDigits[] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829"
+  "30313233343536373839" "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879" "80818283848586878889"
+  "90919293949596979899";
+
+static const char dbxHexDigits[] = "0123456789abcdef";
+
+/* write decimal digits of value to chars without terminating null, chars
+ * must fit 20 characters. Returns number of characters written */
+static int
+dbx_uint_to_chars( uint64_t value, char * chars )
+{
+  uint64_t   v = value;
+  int        result = 1,
+             i;
+
+  while (v >= 10)
+  {
+    v /= 10;
+    result++;
+  }
+
+  i = result;
+
+  /* two digits per division */
+  while (value >= 100)
+  {
+    v = (value % 100) * 2;
+    value /= 100;
+    chars[--i] = dbxDigits[v + 1];
+    chars[--i] = dbxDigits[v];
+  }
+
+  if (value >= 10)
+  {
+    chars[--i] = dbxDigits[value * 2 + 1];
+    chars[--i] = dbxDigits[value * 2];
+  }
+  else
+    chars[--i] = '0' + value;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* same as dbx_uint_to_chars() but signed, chars must fit 21 characters */
+static int
+dbx_int_to_chars( int64_t value, char * chars )
+{
+  if (value < 0)
+  {
+    *chars = '-';
+    return dbx_uint_to_chars( 0 - (uint64_t) value, chars+1 ) + 1;
+  }
+
+  return dbx_uint_to_chars( (uint64_t) value, chars );
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* write 32 hex digits of 16 bytes md5 hash */
+static void
+dbx_md5_to_chars( const char * md5, char * chars )
+{
+  int i;
+
+  for (i = 0; i < 16; i++)
+  {
+    *(chars++) = dbxHexDigits[ (md5[i] >> 4) & 0x0F ];
+    *(chars++) = dbxHexDigits[ md5[i] & 0x0F ];
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static PGconn *
+dbx_get_allocated_connection( dbx_context_t ctx )
+{
+  int i=0;
+
+  while (ctx && i<ctx->conn_size)
+  {
+    if ( ctx->conn[i].pg )
+      return ctx->conn[i].pg;
+    i++;
+  }
+
+  return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* append parameter to sql buffer */
+static cstuff_retcode_t
+dbx_sql_buffer_append_param( struct dbx_sql_buffer * buffer,
+                             struct dbx_param      * param,
+                             PGconn               ** p_conn )
+{
+  char     * ptr;
+  size_t     l;
+  int        rc;
+  struct tm  tm;
+
+  /* the longest of fixed size values: quoted md5 hash or float */
+  if (dbx_sql_buffer_reserve(buffer, 64) == -1)
+    return CSTUFF_MALLOC_ERROR;
+
+  ptr = buffer->data + buffer->length;
+
+  switch (param->type)
+  {
+    case DBX_INT32:
+    case DBX_INT64:
+      l = dbx_int_to_chars(param->value.i, ptr);
+      break;
+
+    case DBX_UINT32:
+    case DBX_UINT64:
+      l = dbx_uint_to_chars(param->value.u, ptr);
+      break;
+
+    case DBX_TIMESTAMP:
+      l = strftime( ptr, 64, "'%Y-%m-%d %H:%M:%S'",
+                    gmtime_r(&param->value.ts, &tm) );
+      break;
+
+    case DBX_FLOAT:
+      if ( (l = snprintf(ptr, 64, "%.8Lf", param->value.f)) >= 64 )
+      {
+        if (dbx_sql_buffer_reserve(buffer, l) == -1)
+          return CSTUFF_MALLOC_ERROR;
+
+        ptr = buffer->data + buffer->length;
+        snprintf(ptr, l+1, "%.8Lf", param->value.f);
+      }
+      if ( (ptr = strchr(ptr, ',')) != NULL ) /* locale independent */
+        *ptr = '.';
+      break;
+
+    case DBX_BOOLEAN:
+      l = (param->value.i) ? sizeof(dbxTrueStr)-1 : sizeof(dbxFalseStr)-1;
+      memcpy(ptr, (param->value.i) ? dbxTrueStr : dbxFalseStr, l);
+      break;
+
+    default:
+      if (!param->value.str)
+      {
+        l = sizeof(dbxNullStr)-1;
+        memcpy(ptr, dbxNullStr, l);
+        break;
+      }
+
+      switch (param->type)
+      {
+        case DBX_MD5_HASH:
+          ptr[0] = '\'';
+          dbx_md5_to_chars(param->value.str, &ptr[1]);
+          ptr[33] = '\'';
+          l = 34;
+          break;
+
+        case DBX_STRING:
+          /* escape in place, worst case every character is doubled */
+          l = strlen(param->value.str);
+          if (dbx_sql_buffer_reserve(buffer, 2*l + 2) == -1)
+            return CSTUFF_MALLOC_ERROR;
+
+          ptr    = buffer->data + buffer->length;
+          ptr[0] = '\'';
+
+          if (!*p_conn)
+            *p_conn = dbx_get_allocated_connection(dbxThreadContext);
+
+          if (*p_conn)
+          {
+            l = PQescapeStringConn(*p_conn, &ptr[1], param->value.str, l, &rc);
+            if (rc)
+              return CSTUFF_EXTCALL_ERROR;
+          }
+          else
+            l = PQescapeString(&ptr[1], param->value.str, l);
+
+          ptr[++l] = '\'';
+          l++;
+          break;
+
+        default: /* DBX_CONSTANT, DBX_STATEMENT */
+          l = strlen(param->value.str);
+          if (dbx_sql_buffer_reserve(buffer, l + 2) == -1)
+            return CSTUFF_MALLOC_ERROR;
+
+          ptr = buffer->data + buffer->length;
+
+          if (param->type == DBX_CONSTANT)
+          {
+            *(ptr++) = '\'';
+            memcpy(ptr, param->value.str, l);
+            ptr[l] = '\'';
+            l += 2;
+          }
+          else
+            memcpy(ptr, param->value.str, l);
+      }
+  }
+
+  buffer->length += l;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_sql_vformat_to( struct dbx_sql_buffer * buffer,
+                    const char            * sql_format,
+                    int                     p_count,
+                    va_list                 a_list )
+{
+  cstuff_retcode_t    result = CSTUFF_SUCCESS;
+  struct dbx_param    p_stack[DBX_SQL_PARAMS_STACK],
+                    * p_list = p_stack;
+  const char        * ptr,
+                    * chunk;
+  PGconn            * conn = NULL;
+  size_t              length = buffer->length;
+  int                 i;
+
+  if (p_count > DBX_SQL_PARAMS_STACK)
+  {
+    if ( !(p_list = malloc(p_count * sizeof(struct dbx_param))) )
+      return CSTUFF_MALLOC_ERROR;
+  }
+
+  /* fetch params, values are needed in order of appearance in format */
+  for (i=0; i<p_count; i++)
+  {
+    switch ( (p_list[i].type = va_arg(a_list, int)) )
+    {
+      case DBX_INT32:
+        p_list[i].value.i = va_arg(a_list, int32_t);
+        break;
+
+      case DBX_UINT32:
+        p_list[i].value.u = va_arg(a_list, uint32_t);
+        break;
+
+      case DBX_INT64:
+        p_list[i].value.i = va_arg(a_list, int64_t);
+        break;
+
+      case DBX_UINT64:
+        p_list[i].value.u = va_arg(a_list, uint64_t);
+        break;
+
+      case DBX_FLOAT:
+        p_list[i].value.f = va_arg(a_list, long double);
+        break;
+
+      case DBX_TIMESTAMP:
+        p_list[i].value.ts = va_arg(a_list, time_t);
+        break;
+
+      case DBX_BOOLEAN:
+        p_list[i].value.i = va_arg(a_list, int);
+        break;
+
+      default:
+        p_list[i].value.str = va_arg(a_list, char *);
+    }
+  }
+
+  /* copy format chunks between $N placeholders, substituting params */
+  ptr = chunk = sql_format;
+
+  for (;;)
+  {
+    if (*ptr == '$' && ptr[1] >= '0' && ptr[1] <= '9')
+    {
+      if (ptr > chunk)
+      {
+        if (dbx_sql_buffer_reserve(buffer, ptr - chunk) == -1)
+          RAISE(CSTUFF_MALLOC_ERROR, finally);
+
+        memcpy(buffer->data + buffer->length, chunk, ptr - chunk);
+        buffer->length += ptr - chunk;
+      }
+
+      for (i=0, chunk=ptr++; *ptr >= '0' && *ptr <= '9'; ptr++)
+      {
+        if (i <= p_count)
+          i = i * 10 + (*ptr - '0');
+      }
+
+      if (i > p_count)
+        RAISE(CSTUFF_PARSE_ERROR, finally);
+
+      if (i > 0)
+      {
+        result = dbx_sql_buffer_append_param(buffer, &p_list[i-1], &conn);
+        if (result != CSTUFF_SUCCESS)
+          goto finally;
+
+        chunk = ptr;
+      }
+
+      continue;
+    }
+
+    if (!*ptr)
+      break;
+
+    ptr++;
+  }
+
+  if (dbx_sql_buffer_reserve(buffer, ptr - chunk) == -1)
+    RAISE(CSTUFF_MALLOC_ERROR, finally);
+
+  memcpy(buffer->data + buffer->length, chunk, ptr - chunk);
+  buffer->length += ptr - chunk;
+  buffer->data[buffer->length] = 0;
+
+finally:
+  if (p_list != p_stack)
+    free(p_list);
+
+  if (result != CSTUFF_SUCCESS)
+    buffer->length = length;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+char *
+dbx_sql_format( const char      * sql_format,
+                int               p_count,
+                                  ... )
+{
+  char * result;
+  va_list args;
+
+  va_start(args, p_count);
+  result = dbx_sql_vformat(sql_format, p_count, args);
+  va_end(args);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+char *
+dbx_sql_vformat( const char      * sql_format,
+                 int               p_count,
+                 va_list           a_list )
+{
+  char * sql = NULL;
+
+  dbxSqlBuffer.length = 0;
+
+  if (dbx_sql_vformat_to(&dbxSqlBuffer, sql_format, p_count, a_list)
+                                                         == CSTUFF_SUCCESS)
+  {
+    if ( (sql = malloc(dbxSqlBuffer.length + 1)) != NULL )
+      memcpy(sql, dbxSqlBuffer.data, dbxSqlBuffer.length + 1);
+  }
+
+  if (dbxSqlBuffer.size > DBX_SQL_BUFFER_KEEP)
+  {
+    free(dbxSqlBuffer.data);
+    memset(&dbxSqlBuffer, 0, sizeof(dbxSqlBuffer));
+  }
+
+  return sql;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t
+dbx_hash( const char * str )
+{
+  uint32_t result = 2166136261u; /* FNV-1a */
+
+  while (*str)
+  {
+    result ^= (unsigned char) *(str++);
+    result *= 16777619u;
+  }
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+dbx_block_append( char ** p_block, size_t * p_size, size_t * p_length,
+                  const char * data, size_t length )
+{
+  char   * block;
+  size_t   size = *p_size;
+
+  while (*p_length + length > size)
+    size *= 2;
+
+  if (size != *p_size)
+  {
+    if ( !(block = realloc(*p_block, size)) )
+      return -1;
+
+    *p_block = block;
+    *p_size  = size;
+  }
+
+  memcpy(*p_block + *p_length, data, length);
+  *p_length += length;
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* pack sql format and parameters of prepared statement into single memory
+ * block: array of values pointers followed by format and values strings.
+ * CSTUFF_PARSE_ERROR means parameters could not be sent out of line */
+static cstuff_retcode_t
+dbx_params_vpack( const char * sql_format,
+                  int          p_count,
+                  va_list      a_list,
+                  char      ** p_block )
+{
+  char        * block,
+                chars[64],
+              * ch_ptr;
+  char       ** values;
+  const char  * value;
+  size_t        size, length, l;
+  int           i;
+  time_t        ts;
+  struct tm     tm;
+
+  length = p_count * sizeof(char *);
+  size   = length + strlen(sql_format) + 1 + 64;
+
+  if ( !(block = malloc(size)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  if (dbx_block_append(&block, &size, &length, sql_format,
+                                               strlen(sql_format)+1) == -1)
+    goto e_malloc;
+
+  for (i=0; i<p_count; i++)
+  {
+    value = chars;
+    l     = 0;
+
+    switch( va_arg(a_list, int) )
+    {
+      case DBX_INT32:
+        l = dbx_int_to_chars(va_arg(a_list, int32_t), chars);
+        break;
+
+      case DBX_UINT32:
+        l = dbx_uint_to_chars(va_arg(a_list, uint32_t), chars);
+        break;
+
+      case DBX_INT64:
+        l = dbx_int_to_chars(va_arg(a_list, int64_t), chars);
+        break;
+
+      case DBX_UINT64:
+        l = dbx_uint_to_chars(va_arg(a_list, uint64_t), chars);
+        break;
+
+      case DBX_CONSTANT:
+      case DBX_STRING:
+        if ( (value = va_arg(a_list, char *)) != NULL )
+          l = strlen(value);
+        break;
+
+      case DBX_STATEMENT:
+        free(block);
+        return CSTUFF_PARSE_ERROR;
+
+      case DBX_TIMESTAMP:
+        ts = va_arg(a_list, time_t);
+        l  = strftime(chars, sizeof(chars), "%Y-%m-%d %H:%M:%S",
+                                            gmtime_r(&ts, &tm));
+        break;
+
+      case DBX_FLOAT:
+        l = snprintf( chars, sizeof(chars), "%.8Lf",
+                      va_arg(a_list, long double) );
+        if ( (ch_ptr = strchr(chars, ',')) != NULL ) /* locale independent */
+          *ch_ptr = '.';
+        break;
+
+      case DBX_MD5_HASH:
+        if ( (ch_ptr = va_arg(a_list, char *)) != NULL )
+        {
+          dbx_md5_to_chars(ch_ptr, chars);
+          l = 32;
+        }
+        else
+          value = NULL;
+        break;
+
+      case DBX_BOOLEAN:
+        value = (va_arg(a_list, int)) ? "t" : "f";
+        l     = 1;
+        break;
+    }
+
+    /* keep offset until block is not reallocated anymore */
+    ((char **) block)[i] = (value) ? (char *) (uintptr_t) length : NULL;
+
+    if (value && ( dbx_block_append(&block, &size, &length, value, l) == -1 ||
+                   dbx_block_append(&block, &size, &length, "", 1) == -1 ))
+      goto e_malloc;
+  }
+
+  values = (char **) block;
+
+  for (i=0; i<p_count; i++)
+  {
+    if (values[i])
+      values[i] = block + (uintptr_t) values[i];
+  }
+
+  *p_block = block;
+
+  return CSTUFF_SUCCESS;
+
+e_malloc:
+  free(block);
+  return CSTUFF_MALLOC_ERROR;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* add request of prepared statement, packed by dbx_params_vpack() */
+static uint64_t
+dbx_queue_add_prepared( dbx_context_t              ctx,
+                        char                     * block,
+                        int                        p_count,
+                        const struct dbx_options * options,
+                        dbx_on_result_t            on_result,
+                        dbx_on_error_t             on_error,
+                        void                     * u_data )
+{
+  dbx_request_t   req;
+
+  req = dbx_request_new( block + p_count * sizeof(char *),
+                         options,
+                         on_result,
+                         on_error,
+                         u_data,
+                         DBX_FLAG_PREPARED );
+  if (!req)
+  {
+    free(block);
+    return 0;
+  }
+
+  req->ptr      = block;
+  req->values   = (char **) block;
+  req->n_values = p_count;
+  req->hash     = dbx_hash(req->sql);
+
+  return dbx_queue_submit(ctx, req);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t
+dbx_query_vformat( dbx_context_t              ctx,
+                   const struct dbx_options * options,
+                   const char               * sql_format,
+                   dbx_on_result_t            on_result,
+                   dbx_on_error_t             on_error,
+                   void                     * u_data,
+                   int                        p_count,
+                   va_list                    a_list )
+{
+  uint64_t   result;         /* result: 0 -fail */
+  char     * sql;            /* result sql */
+  va_list    args;
+  int        rc;
+
+  if (ctx->stmt_limit)
+  {
+    va_copy(args, a_list);
+    rc = dbx_params_vpack(sql_format, p_count, args, &sql);
+    va_end(args);
+
+    if (rc == CSTUFF_SUCCESS)
+      return dbx_queue_add_prepared( ctx, sql, p_count, options, on_result,
+                                                          on_error, u_data );
+
+    /* DBX_STATEMENT parameters could be formatted inline only */
+    if (rc != CSTUFF_PARSE_ERROR)
+      return 0;
+  }
+
+  if ( (sql = dbx_sql_vformat(sql_format, p_count, a_list)) != NULL )
+  {
+    result = dbx_queue_add(ctx, sql, options, on_result, on_error, u_data,
+                           DBX_FLAG_FREE_SQL);
+    if (!result)
+      free(sql);
+  }
+  else
+    result = 0;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_query_format( dbx_context_t              ctx,
+                          const struct dbx_options * options,
+                          const char               * sql_format,
+                          dbx_on_result_t            on_result,
+                          dbx_on_error_t             on_error,
+                          void                     * u_data,
+                          int                        p_count,
+                                                     ... )
+{
+  uint64_t   result;         /* result: 0 -fail */
+  va_list    args;
+
+  va_start(args, p_count);
+  result = dbx_query_vformat( ctx, options, sql_format, on_result, on_error,
+                                                    u_data, p_count, args );
+  va_end(args);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_query_format( const char      * sql_format,
+                  dbx_on_result_t   on_result,
+                  dbx_on_error_t    on_error,
+                  void            * u_data,
+                  int               p_count,
+                                    ... )
+{
+  uint64_t   result;         /* result: 0 -fail */
+  va_list    args;
+
+  va_start(args, p_count);
+  result = dbx_query_vformat( dbxContext, NULL, sql_format, on_result,
+                                          on_error, u_data, p_count, args );
+  va_end(args);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_query_format_ex( const struct dbx_options * options,
+                     const char               * sql_format,
+                     dbx_on_result_t            on_result,
+                     dbx_on_error_t             on_error,
+                     void                     * u_data,
+                     int                        p_count,
+                                                ... )
+{
+  uint64_t   result;         /* result: 0 -fail */
+  va_list    args;
+
+  va_start(args, p_count);
+  result = dbx_query_vformat( dbxContext, options, sql_format, on_result,
+                                          on_error, u_data, p_count, args );
+  va_end(args);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_query_const( dbx_context_t              ctx,
+                         const struct dbx_options * options,
+                         const char               * sql,
+                         dbx_on_result_t            on_result,
+                         dbx_on_error_t             on_error,
+                         void                     * u_data )
+{
+  return dbx_queue_add(ctx, sql, options, on_result, on_error, u_data, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_query_const( const char      * sql,
+                 dbx_on_result_t   on_result,
+                 dbx_on_error_t    on_error,
+                 void            * u_data )
+{
+  return dbx_queue_add(dbxContext, sql, NULL, on_result, on_error, u_data, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_query_const_ex( const struct dbx_options * options,
+                    const char               * sql,
+                    dbx_on_result_t            on_result,
+                    dbx_on_error_t             on_error,
+                    void                     * u_data )
+{
+  return dbx_queue_add( dbxContext, sql, options, on_result, on_error,
+                                                             u_data, 0 );
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_query_transaction( dbx_context_t     ctx,
+                               const char      * sql,
+                               dbx_on_result_t   on_result,
+                               dbx_on_error_t    on_error,
+                               void            * u_data )
+{
+  uint64_t   result;         /* result: 0 -fail */
+  char     * t_sql;
+
+  if ( (t_sql = str_printf("BEGIN;\n%sCOMMIT;\n", sql)) != NULL )
+  {
+    result = dbx_queue_add(ctx, t_sql, NULL, on_result, on_error, u_data,
+                           DBX_FLAG_FREE_SQL | DBX_FLAG_TRANSACTION);
+    if (!result)
+      free(t_sql);
+  }
+  else
+    result = 0;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_query_transaction( const char      * sql,
+                       dbx_on_result_t   on_result,
+                       dbx_on_error_t    on_error,
+                       void            * u_data )
+{
+  return dbx_context_query_transaction( dbxContext, sql, on_result, on_error,
+                                                                   u_data );
+}
+
+/* batch ------------------------------------------------------------------- */
+
+/* statement callbacks of batch */
+struct dbx_batch_stmt
+{
+  dbx_on_result_t   on_result;
+  dbx_on_error_t    on_error;
+  void            * u_data;
+};
+
+/* batch builder, statements are separated by new lines */
+struct dbx_batch
+{
+  struct dbx_sql_buffer   sql;
+  struct dbx_batch_stmt * stmts;
+  int                     n_stmts;
+  int                     size;
+};
+
+/* submitted batch, single memory block with its SQL, freed with request */
+struct dbx_batch_job
+{
+  dbx_on_result_t         on_result;
+  dbx_on_error_t          on_error;
+  void                  * u_data;
+  int                     n_stmts;
+  struct dbx_batch_stmt   stmts[];
+};
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_batch_new( dbx_batch_t * self )
+{
+  if ( !(*self = calloc(1, sizeof(struct dbx_batch))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_batch_free( dbx_batch_t self )
+{
+  free(self->sql.data);
+  free(self->stmts);
+  free(self);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_batch_reset( dbx_batch_t self )
+{
+  self->sql.length = 0;
+  self->n_stmts    = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_batch_get_count( dbx_batch_t self )
+{
+  return self->n_stmts;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_batch_add( dbx_batch_t       self,
+               dbx_on_result_t   on_result,
+               dbx_on_error_t    on_error,
+               void            * u_data,
+               const char      * sql_format,
+               int               p_count,
+               ... )
+{
+  struct dbx_batch_stmt * stmts;
+  cstuff_retcode_t        result;
+  size_t                  length = self->sql.length;
+  va_list                 vl;
+
+  if (self->n_stmts == self->size)
+  {
+    stmts = realloc( self->stmts, (self->size ? self->size * 2 : 8) *
+                                  sizeof(struct dbx_batch_stmt) );
+    if (!stmts)
+      return CSTUFF_MALLOC_ERROR;
+
+    self->stmts = stmts;
+    self->size  = (self->size) ? self->size * 2 : 8;
+  }
+
+  va_start(vl, p_count);
+  result = dbx_sql_vformat_to(&self->sql, sql_format, p_count, vl);
+  va_end(vl);
+
+  if (result != CSTUFF_SUCCESS)
+    return result;
+
+  if (dbx_sql_buffer_reserve(&self->sql, 2) == -1)
+  {
+    self->sql.length = length;
+    return CSTUFF_MALLOC_ERROR;
+  }
+
+  memcpy(&self->sql.data[self->sql.length], ";\n", 3);
+  self->sql.length += 2;
+
+  self->stmts[ self->n_stmts ].on_result = on_result;
+  self->stmts[ self->n_stmts ].on_error  = on_error;
+  self->stmts[ self->n_stmts ].u_data    = u_data;
+  self->n_stmts++;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* results of statements follow result of BEGIN, result of COMMIT is the last
+ * one */
+static bool
+dbx_batch_on_result( PGresult * result, int res_i, void * u_data )
+{
+  struct dbx_batch_job  * job = u_data;
+  struct dbx_batch_stmt * stmt;
+
+  if (res_i > job->n_stmts)
+    return (job->on_result) ? job->on_result(result, job->n_stmts, job->u_data)
+                            : true;
+
+  if (res_i < 1)
+    return true;
+
+  stmt = &job->stmts[res_i - 1];
+
+  if (stmt->on_result && !stmt->on_result(result, 0, stmt->u_data))
+    stmt->on_result = NULL;
+
+  return true;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* error aborts the rest of batch, so it is reported to failed statement and
+ * to batch */
+static void
+dbx_batch_on_error( const char * e_message,
+                    int          res_i,
+                    void       * u_data,
+                    const char * e_sql )
+{
+  struct dbx_batch_job  * job = u_data;
+  struct dbx_batch_stmt * stmt;
+
+  if (res_i > 0 && res_i <= job->n_stmts)
+  {
+    stmt = &job->stmts[res_i - 1];
+
+    if (stmt->on_error)
+      stmt->on_error(e_message, 0, stmt->u_data, e_sql);
+  }
+
+  if (job->on_error)
+    job->on_error(e_message, res_i - 1, job->u_data, e_sql);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_batch_submit( dbx_context_t              ctx,
+                          dbx_batch_t                batch,
+                          const struct dbx_options * options,
+                          dbx_on_result_t            on_result,
+                          dbx_on_error_t             on_error,
+                          void                     * u_data )
+{
+  struct dbx_batch_job * job;
+  dbx_request_t          req;
+  size_t                 size;
+  char                 * sql;
+
+  if (!batch->n_stmts)
+    return 0;
+
+  size = sizeof(struct dbx_batch_job) +
+         batch->n_stmts * sizeof(struct dbx_batch_stmt);
+
+  job = malloc( size + sizeof(dbxBeginStr) + batch->sql.length +
+                                             sizeof(dbxCommitStr) );
+  if (!job)
+    return 0;
+
+  job->on_result = on_result;
+  job->on_error  = on_error;
+  job->u_data    = u_data;
+  job->n_stmts   = batch->n_stmts;
+  memcpy(job->stmts, batch->stmts, batch->n_stmts * sizeof(*batch->stmts));
+
+  /* BEGIN;\n statements COMMIT;\n */
+  sql = (char *) job + size;
+  memcpy(sql, dbxBeginStr, sizeof(dbxBeginStr) - 1);
+  memcpy(sql + sizeof(dbxBeginStr) - 1, batch->sql.data, batch->sql.length);
+  memcpy(sql + sizeof(dbxBeginStr) - 1 + batch->sql.length, dbxCommitStr,
+                                                      sizeof(dbxCommitStr));
+
+  req = dbx_request_new( sql, options, dbx_batch_on_result, dbx_batch_on_error,
+                         job, DBX_FLAG_TRANSACTION );
+  if (!req)
+  {
+    free(job);
+    return 0;
+  }
+
+  /* batch is sent as a single simple query and it is not cached */
+  req->ptr    = (char *) job;
+  req->flags &= ~(DBX_FLAG_BINARY | DBX_FLAG_STREAM);
+  req->ttl    = 0;
+
+  dbx_batch_reset(batch);
+
+  return dbx_queue_submit(ctx, req);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_batch_submit( dbx_batch_t                batch,
+                  const struct dbx_options * options,
+                  dbx_on_result_t            on_result,
+                  dbx_on_error_t             on_error,
+                  void                     * u_data )
+{
+  return dbx_context_batch_submit( dbxContext, batch, options, on_result,
+                                                     on_error, u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t
+dbx_queue_add_copy( dbx_context_t       ctx,
+                    const char        * sql,
+                    dbx_on_copy_in_t    on_copy_in,
+                    dbx_on_copy_out_t   on_copy_out,
+                    dbx_on_result_t     on_result,
+                    dbx_on_error_t      on_error,
+                    void              * u_data )
+{
+  dbx_request_t   req;
+  char          * c_sql;
+
+  if ( !(c_sql = str_copy(sql)) )
+    return 0;
+
+  req = dbx_request_new( c_sql, NULL, on_result, on_error, u_data,
+                                DBX_FLAG_FREE_SQL | DBX_FLAG_COPY );
+  if (!req)
+  {
+    free(c_sql);
+    return 0;
+  }
+
+  req->on_copy_in  = on_copy_in;
+  req->on_copy_out = on_copy_out;
+
+  return dbx_queue_submit(ctx, req);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_copy_in( dbx_context_t      ctx,
+                     const char       * sql,
+                     dbx_on_copy_in_t   on_data,
+                     dbx_on_result_t    on_result,
+                     dbx_on_error_t     on_error,
+                     void             * u_data )
+{
+  return dbx_queue_add_copy( ctx, sql, on_data, NULL, on_result, on_error,
+                                                               u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_copy_in( const char       * sql,
+             dbx_on_copy_in_t   on_data,
+             dbx_on_result_t    on_result,
+             dbx_on_error_t     on_error,
+             void             * u_data )
+{
+  return dbx_queue_add_copy( dbxContext, sql, on_data, NULL, on_result,
+                                                   on_error, u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_copy_out( dbx_context_t       ctx,
+                      const char        * sql,
+                      dbx_on_copy_out_t   on_data,
+                      dbx_on_result_t     on_result,
+                      dbx_on_error_t      on_error,
+                      void              * u_data )
+{
+  return dbx_queue_add_copy( ctx, sql, NULL, on_data, on_result, on_error,
+                                                               u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_copy_out( const char        * sql,
+              dbx_on_copy_out_t   on_data,
+              dbx_on_result_t     on_result,
+              dbx_on_error_t      on_error,
+              void              * u_data )
+{
+  return dbx_queue_add_copy( dbxContext, sql, NULL, on_data, on_result,
+                                                   on_error, u_data );
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_context_cancel( dbx_context_t ctx, uint64_t id )
+{
+  dbx_request_t req;
+
+  /* request could be still in inbox */
+  if ( !(req = dbx_index_find(ctx, id)) )
+  {
+    dbx_queue_receive( ctx );
+
+    if ( !(req = dbx_index_find(ctx, id)) )
+      return CSTUFF_NOT_FOUND;
+  }
+
+  if (req->queued)
+  {
+    /* just in queue */
+    dbx_queue_unlink( ctx, req );
+    dbx_request_free( req );
+    return CSTUFF_SUCCESS;
+  }
+
+  /* in flight query is cancelled by the next touch, COPY without data
+   * producer is aborted. Request waiting for cache is dropped when it is
+   * looked up or gets results */
+  req->cancel     |= DBX_CANCEL_USER;
+  req->on_result   = NULL;
+  req->on_error    = NULL;
+  req->on_copy_in  = NULL;
+  req->on_copy_out = NULL;
+
+  if (req->conn)
+    dbx_conn_expire_at( ctx, req );
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_cancel( uint64_t id )
+{
+  return dbx_context_cancel( dbxContext, id );
+}
+
+/* -------------------------------------------------------------------------- */
+
+const char *
+dbx_context_get_error( dbx_context_t ctx )
+{
+  return ctx->error;
+}
+
+/* -------------------------------------------------------------------------- */
+
+const char *
+dbx_get_error()
+{
+  return (dbxContext) ? dbxContext->error : NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_context_ready_connections_count( dbx_context_t ctx )
+{
+  return bitset_count(ctx->conn_mask);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_ready_connections_count()
+{
+  return (dbxContext) ? bitset_count(dbxContext->conn_mask) : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+dbx_hist_load( struct dbx_hist * hist, struct dbx_histogram * histogram )
+{
+  int i;
+
+  histogram->count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+  histogram->sum   = atomic_load_explicit(&hist->sum, memory_order_relaxed);
+  histogram->max   = atomic_load_explicit(&hist->max, memory_order_relaxed);
+
+  for (i=0; i<DBX_HISTOGRAM_BUCKETS; i++)
+  {
+    histogram->buckets[i] = atomic_load_explicit(&hist->buckets[i],
+                                                 memory_order_relaxed);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_get_metrics( dbx_context_t ctx, struct dbx_metrics * metrics )
+{
+  struct dbx_stats * stats = &ctx->stats;
+
+  /* values are loaded one by one, so snapshot is consistent per value */
+  metrics->queries     = atomic_load(&stats->queries);
+  metrics->errors      = atomic_load(&stats->errors);
+  metrics->expired     = atomic_load(&stats->expired);
+  metrics->timeouts    = atomic_load(&stats->timeouts);
+  metrics->reconnects  = atomic_load(&stats->reconnects);
+  metrics->saturations = atomic_load(&stats->saturations);
+  metrics->cache_hits  = atomic_load(&stats->cache_hits);
+  metrics->coalesced   = atomic_load(&stats->coalesced);
+  metrics->cache_size  = atomic_load(&stats->cache_size);
+  metrics->queued      = atomic_load(&stats->queued);
+  metrics->active      = atomic_load(&stats->active);
+  metrics->connections = atomic_load(&stats->connections);
+  metrics->connecting  = atomic_load(&stats->connecting);
+  metrics->down        = atomic_load(&stats->down);
+
+  dbx_hist_load( &stats->wait,  &metrics->wait );
+  dbx_hist_load( &stats->first, &metrics->first );
+  dbx_hist_load( &stats->exec,  &metrics->exec );
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_get_metrics( struct dbx_metrics * metrics )
+{
+  if (dbxContext)
+    dbx_context_get_metrics( dbxContext, metrics );
+  else
+    memset( metrics, 0, sizeof(struct dbx_metrics) );
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_histogram_percentile( const struct dbx_histogram * histogram,
+                          double                       percent )
+{
+  uint64_t count = 0, total = 0, high;
+  int      i, shift;
+
+  for (i=0; i<DBX_HISTOGRAM_BUCKETS; i++)
+    total += histogram->buckets[i];
+
+  if (!total)
+    return 0;
+
+  for (i=0; i<DBX_HISTOGRAM_BUCKETS; i++)
+  {
+    if ( (count += histogram->buckets[i]) >= total * percent / 100 )
+      break;
+  }
+
+  if (i >= DBX_HISTOGRAM_BUCKETS - 1)
+    return histogram->max;
+
+  /* the last value of bucket */
+  if ( i < (1 << DBX_HISTOGRAM_BITS) )
+    high = i;
+  else
+  {
+    shift = (i >> DBX_HISTOGRAM_BITS) - 1;
+    high  = ((uint64_t) ((i & ((1 << DBX_HISTOGRAM_BITS) - 1)) +
+                         (1 << DBX_HISTOGRAM_BITS) + 1) << shift) - 1;
+  }
+
+  return (high < histogram->max) ? high : histogram->max;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_as_timestamp( PGresult * data, int row_num, int col_num, time_t * p_ts )
+{
+  int result;
+
+  if ( ! PQgetisnull(data, row_num, col_num))
+  {
+    char * dt = dbx_as_string(data, row_num, col_num);
+    result = (dt) ? str_to_timestamp(dt, strlen(dt), p_ts, NULL) : -1;
+  }
+  else
+    result = 1;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* type OIDs from server's pg_type.h */
+#define DBX_OID_BOOL          16
+#define DBX_OID_INT8          20
+#define DBX_OID_INT2          21
+#define DBX_OID_INT4          23
+#define DBX_OID_OID           26
+#define DBX_OID_FLOAT4       700
+#define DBX_OID_FLOAT8       701
+#define DBX_OID_TIMESTAMP   1114
+#define DBX_OID_TIMESTAMPTZ 1184
+
+/* seconds between 1970-01-01 and PostgreSQL epoch 2000-01-01 */
+#define DBX_PG_EPOCH   946684800
+
+static uint64_t
+dbx_binary_uint( const char * data, int size )
+{
+  uint64_t result = 0;
+  int      i;
+
+  for (i=0; i<size; i++)
+    result = (result << 8) | (uint8_t) data[i];
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* returns binary value of column if it has expected size, NULL otherwise */
+static const char *
+dbx_binary_value( PGresult * data, int row_num, int col_num, int size )
+{
+  if ( PQfformat(data, col_num) != 1
+    || PQgetisnull(data, row_num, col_num)
+    || PQgetlength(data, row_num, col_num) != size )
+    return NULL;
+
+  return PQgetvalue(data, row_num, col_num);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int64_t
+dbx_binary_as_integer( PGresult * data, int row_num, int col_num )
+{
+  const char * value;
+  int          size;
+
+  if (PQfformat(data, col_num) != 1)
+    return dbx_as_integer(data, row_num, col_num);
+
+  switch (PQftype(data, col_num))
+  {
+    case DBX_OID_INT2: size = 2; break;
+    case DBX_OID_INT4:
+    case DBX_OID_OID:  size = 4; break;
+    case DBX_OID_INT8: size = 8; break;
+    default:
+      return 0;
+  }
+
+  if ( !(value = dbx_binary_value(data, row_num, col_num, size)) )
+    return 0;
+
+  switch (size)
+  {
+    case 2:
+      return (int16_t) dbx_binary_uint(value, 2);
+    case 4:
+      return (PQftype(data, col_num) == DBX_OID_OID)
+             ? (int64_t) dbx_binary_uint(value, 4)
+             : (int64_t) (int32_t) dbx_binary_uint(value, 4);
+    default:
+      return (int64_t) dbx_binary_uint(value, 8);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+bool
+dbx_binary_as_bool( PGresult * data, int row_num, int col_num )
+{
+  const char * value;
+
+  if (PQfformat(data, col_num) != 1)
+    return dbx_as_bool(data, row_num, col_num);
+
+  value = dbx_binary_value(data, row_num, col_num, 1);
+
+  return (value && value[0]) ? true : false;
+}
+
+/* -------------------------------------------------------------------------- */
+
+double
+dbx_binary_as_float( PGresult * data, int row_num, int col_num )
+{
+  const char * value;
+  union { uint64_t u; double d; } f8;
+  union { uint32_t u; float f; }  f4;
+
+  if (PQfformat(data, col_num) != 1)
+    return strtod(PQgetvalue(data, row_num, col_num), NULL);
+
+  switch (PQftype(data, col_num))
+  {
+    case DBX_OID_FLOAT4:
+      if ( !(value = dbx_binary_value(data, row_num, col_num, 4)) )
+        break;
+      f4.u = (uint32_t) dbx_binary_uint(value, 4);
+      return f4.f;
+
+    case DBX_OID_FLOAT8:
+      if ( !(value = dbx_binary_value(data, row_num, col_num, 8)) )
+        break;
+      f8.u = dbx_binary_uint(value, 8);
+      return f8.d;
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* decode binary timestamp value, returns -1 for infinite timestamp */
+static int
+dbx_binary_timestamp( const char * value, time_t * p_ts, int32_t * p_usec )
+{
+  int64_t usec;
+
+  /* microseconds since 2000-01-01 00:00:00 UTC, INT64_MIN and INT64_MAX
+   * stand for -infinity and infinity */
+  usec = (int64_t) dbx_binary_uint(value, 8);
+  if (usec == INT64_MIN || usec == INT64_MAX)
+    return -1;
+
+  /* floor division, so microseconds are never negative */
+  *p_ts = usec / 1000000;
+  usec  = usec % 1000000;
+  if (usec < 0)
+  {
+    usec += 1000000;
+    (*p_ts)--;
+  }
+  *p_ts += DBX_PG_EPOCH;
+
+  if (p_usec)
+    *p_usec = (int32_t) usec;
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_binary_as_timestamp( PGresult * data,
+                         int        row_num,
+                         int        col_num,
+                         time_t   * p_ts,
+                         int32_t  * p_usec )
+{
+  const char * value;
+  Oid          type;
+
+  if (PQgetisnull(data, row_num, col_num))
+    return 1;
+
+  if (PQfformat(data, col_num) != 1)
+  {
+    if (p_usec)
+      *p_usec = 0;
+    return dbx_as_timestamp(data, row_num, col_num, p_ts);
+  }
+
+  type = PQftype(data, col_num);
+
+  if (type != DBX_OID_TIMESTAMP && type != DBX_OID_TIMESTAMPTZ)
+    return -1;
+
+  if ( !(value = dbx_binary_value(data, row_num, col_num, 8)) )
+    return -1;
+
+  return dbx_binary_timestamp(value, p_ts, p_usec);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* row mapping -------------------------------------------------------------- */
+
+/* days since 1970-01-01 of proleptic Gregorian calendar date */
+static int64_t
+dbx_days_from_civil( int64_t year, int month, int day )
+{
+  int64_t era;
+  int     yoe, doy;
+
+  year -= (month <= 2);
+  era   = (year >= 0 ? year : year - 399) / 400;
+  yoe   = (int) (year - era * 400);
+  doy   = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+
+  return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* parse ISO timestamp "YYYY-MM-DD HH:MM:SS[.ffffff][+HH[:MM[:SS]]]" without
+ * touching process time zone, value without offset is treated as UTC */
+static int
+dbx_text_timestamp( const char * value, time_t * p_ts )
+{
+  char    * end;
+  long      f[6];
+  long      offset = 0, sign, part;
+  int       i;
+
+  for (i = 0; i < 6; i++)
+  {
+    f[i] = strtol(value, &end, 10);
+
+    if (end == value || (i < 5 && !*end))
+      return -1;
+
+    value = end + (i < 5);
+  }
+
+  /* fraction of second is dropped */
+  if (*value == '.')
+    while (*(++value) >= '0' && *value <= '9');
+
+  if (*value == '+' || *value == '-')
+  {
+    sign = (*value == '-') ? -1 : 1;
+
+    for (i = 0; i < 3 && *value && *value != ' '; i++)
+    {
+      part = strtol(value + 1, &end, 10);
+      if (end == value + 1)
+        return -1;
+
+      offset = offset * 60 + part;
+      value  = end;
+    }
+
+    while (i++ < 3)
+      offset *= 60;
+
+    offset *= sign;
   }
 
+  *p_ts = (time_t) (dbx_days_from_civil(f[0], f[1], f[2]) * 86400 +
+                    f[3] * 3600 + f[4] * 60 + f[5] - offset);
+
   return 0;
 }
+
+/* -------------------------------------------------------------------------- */
+
+/* column decoder of dbx_map_rows() */
+struct dbx_map_column
+{
+  int  col_num;
+  int  size;      /* size of binary value, 0 for text format */
+  bool is_signed;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* resolve column of field and check its binary type */
+static cstuff_retcode_t
+dbx_map_column_init( PGresult               * data,
+                     const struct dbx_field * field,
+                     struct dbx_map_column  * column )
+{
+  int size;
+
+  if ( (column->col_num = PQfnumber(data, field->column)) == -1 )
+    return CSTUFF_NOT_FOUND;
+
+  column->size      = 0;
+  column->is_signed = true;
+
+  if (PQfformat(data, column->col_num) != 1)
+    return CSTUFF_SUCCESS;
+
+  switch (PQftype(data, column->col_num))
+  {
+    case DBX_OID_INT2:        size = 2; break;
+    case DBX_OID_INT4:        size = 4; break;
+    case DBX_OID_OID:         size = 4; column->is_signed = false; break;
+    case DBX_OID_INT8:        size = 8; break;
+    case DBX_OID_BOOL:        size = 1; break;
+    case DBX_OID_FLOAT4:      size = 4; break;
+    case DBX_OID_FLOAT8:      size = 8; break;
+    case DBX_OID_TIMESTAMP:
+    case DBX_OID_TIMESTAMPTZ: size = 8; break;
+    default:                  size = 0; break;
+  }
+
+  switch (field->type)
+  {
+    case DBX_FIELD_STRING:
+    case DBX_FIELD_IS_NULL:
+      return CSTUFF_SUCCESS;
+
+    case DBX_FIELD_INT16:
+    case DBX_FIELD_INT32:
+    case DBX_FIELD_INT64:
+      switch (PQftype(data, column->col_num))
+      {
+        case DBX_OID_INT8:
+          if (field->type != DBX_FIELD_INT64)
+            return CSTUFF_PARSE_ERROR;
+          break;
+
+        case DBX_OID_INT4:
+        case DBX_OID_OID:
+          if (field->type == DBX_FIELD_INT16)
+            return CSTUFF_PARSE_ERROR;
+          break;
+
+        case DBX_OID_INT2:
+          break;
+
+        default:
+          return CSTUFF_PARSE_ERROR;
+      }
+      break;
+
+    case DBX_FIELD_BOOL:
+      if (PQftype(data, column->col_num) != DBX_OID_BOOL)
+        return CSTUFF_PARSE_ERROR;
+      break;
+
+    case DBX_FIELD_DOUBLE:
+      if (PQftype(data, column->col_num) != DBX_OID_FLOAT4 &&
+          PQftype(data, column->col_num) != DBX_OID_FLOAT8)
+        return CSTUFF_PARSE_ERROR;
+      break;
+
+    case DBX_FIELD_TIMESTAMP:
+      if (PQftype(data, column->col_num) != DBX_OID_TIMESTAMP &&
+          PQftype(data, column->col_num) != DBX_OID_TIMESTAMPTZ)
+        return CSTUFF_PARSE_ERROR;
+      break;
+  }
+
+  column->size = size;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* decode non NULL value of column into structure member */
+static cstuff_retcode_t
+dbx_map_value( const struct dbx_field      * field,
+               const struct dbx_map_column * column,
+               const char                  * value,
+               void                        * member )
+{
+  union { uint64_t u; double d; } f8;
+  union { uint32_t u; float f; }  f4;
+  char    * end;
+  int64_t   i64 = 0;
+  double    d;
+  time_t    ts;
+
+  switch (field->type)
+  {
+    case DBX_FIELD_STRING:
+      *(const char **) member = value;
+      return CSTUFF_SUCCESS;
+
+    case DBX_FIELD_IS_NULL:
+      *(bool *) member = false;
+      return CSTUFF_SUCCESS;
+
+    case DBX_FIELD_BOOL:
+      *(bool *) member = (column->size) ? value[0] != 0 : value[0] == 't';
+      return CSTUFF_SUCCESS;
+
+    case DBX_FIELD_DOUBLE:
+      if (column->size == 8)
+      {
+        f8.u = dbx_binary_uint(value, 8);
+        d    = f8.d;
+      }
+      else if (column->size == 4)
+      {
+        f4.u = (uint32_t) dbx_binary_uint(value, 4);
+        d    = f4.f;
+      }
+      else
+        d = strtod(value, NULL);
+
+      *(double *) member = d;
+      return CSTUFF_SUCCESS;
+
+    case DBX_FIELD_TIMESTAMP:
+      if ( ((column->size) ? dbx_binary_timestamp(value, &ts, NULL)
+                           : dbx_text_timestamp(value, &ts)) != 0 )
+        return CSTUFF_PARSE_ERROR;
+
+      *(time_t *) member = ts;
+      return CSTUFF_SUCCESS;
+
+    default:
+      break;
+  }
+
+  /* integers */
+  if (column->size)
+  {
+    i64 = (int64_t) dbx_binary_uint(value, column->size);
+
+    if (column->is_signed && column->size < 8)
+    {
+      i64 = (column->size == 2) ? (int64_t) (int16_t) i64
+                                : (int64_t) (int32_t) i64;
+    }
+  }
+  else
+  {
+    i64 = strtoll(value, &end, 10);
+
+    if (end == value)
+      return CSTUFF_PARSE_ERROR;
+  }
+
+  switch (field->type)
+  {
+    case DBX_FIELD_INT16: *(int16_t *) member = (int16_t) i64; break;
+    case DBX_FIELD_INT32: *(int32_t *) member = (int32_t) i64; break;
+    default:              *(int64_t *) member = i64;           break;
+  }
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_map_rows( PGresult                 * data,
+              const struct dbx_row_map * map,
+              void                    ** p_rows,
+              int                      * p_count )
+{
+  cstuff_retcode_t        result = CSTUFF_SUCCESS;
+  struct dbx_map_column * columns;
+  const struct dbx_field * field;
+  const char            * value;
+  char                  * rows = NULL, * row, * str;
+  size_t                  size;
+  int                     count = PQntuples(data),
+                          i, j, l;
+
+  *p_rows  = NULL;
+  *p_count = 0;
+
+  if (!count)
+    return CSTUFF_SUCCESS;
+
+  if ( !(columns = malloc(map->n_fields * sizeof(struct dbx_map_column))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  for (j = 0; j < map->n_fields; j++)
+  {
+    if ( (result = dbx_map_column_init(data, &map->fields[j], &columns[j]))
+                                                            != CSTUFF_SUCCESS )
+      goto finally;
+  }
+
+  /* strings are copied after rows, so array does not depend on result */
+  size = count * map->row_size;
+
+  for (j = 0; j < map->n_fields; j++)
+  {
+    if (map->fields[j].type != DBX_FIELD_STRING)
+      continue;
+
+    for (i = 0; i < count; i++)
+    {
+      if ( !PQgetisnull(data, i, columns[j].col_num) )
+        size += PQgetlength(data, i, columns[j].col_num) + 1;
+    }
+  }
+
+  if ( !(rows = malloc(size)) )
+    RAISE( CSTUFF_MALLOC_ERROR, finally );
+
+  memset(rows, 0, count * map->row_size);
+  str = rows + count * map->row_size;
+
+  for (i = 0, row = rows; i < count; i++, row += map->row_size)
+  {
+    for (j = 0; j < map->n_fields; j++)
+    {
+      field = &map->fields[j];
+
+      if (PQgetisnull(data, i, columns[j].col_num))
+      {
+        /* members are zeroed already */
+        if (field->type == DBX_FIELD_IS_NULL)
+          *(bool *) (row + field->offset) = true;
+        continue;
+      }
+
+      value = PQgetvalue(data, i, columns[j].col_num);
+
+      if ( columns[j].size &&
+           field->type != DBX_FIELD_STRING &&
+           field->type != DBX_FIELD_IS_NULL &&
+           PQgetlength(data, i, columns[j].col_num) != columns[j].size )
+      {
+        RAISE( CSTUFF_PARSE_ERROR, finally );
+      }
+
+      if (field->type == DBX_FIELD_STRING)
+      {
+        l = PQgetlength(data, i, columns[j].col_num);
+        memcpy(str, value, l);
+        str[l] = 0;
+        value  = str;
+        str   += l + 1;
+      }
+
+      if ( (result = dbx_map_value(field, &columns[j], value,
+                                   row + field->offset)) != CSTUFF_SUCCESS )
+        goto finally;
+    }
+  }
+
+  *p_rows  = rows;
+  *p_count = count;
+  rows     = NULL;
+
+finally:
+  free(rows);
+  free(columns);
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static cstuff_retcode_t
+dbx_binary_put_uint( struct dbx_sql_buffer * buffer, uint64_t value, int size )
+{
+  char * ptr;
+
+  if (dbx_sql_buffer_reserve(buffer, size) == -1)
+    return CSTUFF_MALLOC_ERROR;
+
+  ptr = buffer->data + buffer->length;
+  buffer->length += size;
+
+  while (size--)
+  {
+    ptr[size] = (char) (value & 0xFF);
+    value >>= 8;
+  }
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_header( struct dbx_sql_buffer * buffer )
+{
+  static const char signature[] = "PGCOPY\n\377\r\n";
+
+  if (dbx_sql_buffer_reserve(buffer, sizeof(signature)) == -1)
+    return CSTUFF_MALLOC_ERROR;
+
+  /* signature including its null byte */
+  memcpy(buffer->data + buffer->length, signature, sizeof(signature));
+  buffer->length += sizeof(signature);
+
+  /* flags and header extension length */
+  return dbx_binary_put_uint(buffer, 0, 8);
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_tuple( struct dbx_sql_buffer * buffer, int n_fields )
+{
+  return dbx_binary_put_uint(buffer, (uint16_t) n_fields, 2);
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_field( struct dbx_sql_buffer * buffer,
+                       const void            * data,
+                       int                     length )
+{
+  if (!data)
+    return dbx_binary_put_uint(buffer, (uint32_t) -1, 4);
+
+  if ( dbx_binary_put_uint(buffer, (uint32_t) length, 4) != CSTUFF_SUCCESS ||
+       dbx_sql_buffer_reserve(buffer, length) == -1 )
+    return CSTUFF_MALLOC_ERROR;
+
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_integer( struct dbx_sql_buffer * buffer,
+                         int64_t                 value,
+                         int                     size )
+{
+  if ( dbx_binary_put_uint(buffer, size, 4) != CSTUFF_SUCCESS )
+    return CSTUFF_MALLOC_ERROR;
+
+  return dbx_binary_put_uint(buffer, (uint64_t) value, size);
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_float( struct dbx_sql_buffer * buffer, double value )
+{
+  union { uint64_t u; double d; } f8;
+
+  f8.d = value;
+
+  if ( dbx_binary_put_uint(buffer, 8, 4) != CSTUFF_SUCCESS )
+    return CSTUFF_MALLOC_ERROR;
+
+  return dbx_binary_put_uint(buffer, f8.u, 8);
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_timestamp( struct dbx_sql_buffer * buffer,
+                           time_t                  ts,
+                           int32_t                 usec )
+{
+  int64_t value = ((int64_t) ts - DBX_PG_EPOCH) * 1000000 + usec;
+
+  if ( dbx_binary_put_uint(buffer, 8, 4) != CSTUFF_SUCCESS )
+    return CSTUFF_MALLOC_ERROR;
+
+  return dbx_binary_put_uint(buffer, (uint64_t) value, 8);
+}
+
+/* -------------------------------------------------------------------------- */
+
+cstuff_retcode_t
+dbx_copy_binary_trailer( struct dbx_sql_buffer * buffer )
+{
+  return dbx_binary_put_uint(buffer, 0xFFFF, 2);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_context_sleep( dbx_context_t ctx, int usec )
+{
+  struct epoll_event ev;
+
+  return epoll_wait(ctx->epoll, &ev, 1, (usec + 999) / 1000);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_sleep(int usec)
+{
+  return (dbxContext) ? dbx_context_sleep(dbxContext, usec) : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_context_get_fd( dbx_context_t ctx )
+{
+  return ctx->epoll;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+dbx_get_fd()
+{
+  return (dbxContext) ? dbxContext->epoll : -1;
+}
@@ -4,6 +4,7 @@
 #define _CSTUFF_DBX_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
@@ -35,14 +36,151 @@ typedef enum
 
 /* -------------------------------------------------------------------------- */
 
+/* priority classes of queued requests */
+typedef enum
+{
+  DBX_PRIORITY_NORMAL,
+  DBX_PRIORITY_HIGH,
+  DBX_PRIORITY_LOW,
+
+  DBX_PRIORITIES
+
+} dbx_priority_t;
+
+/* -------------------------------------------------------------------------- */
+
 #define DBX_FLAG_RECONNECT   (1<<0)
 
 #define DBX_FLAG_FREE_SQL    (1<<0)
 #define DBX_FLAG_TRANSACTION (1<<1)
+#define DBX_FLAG_PREPARED    (1<<2)
+#define DBX_FLAG_BINARY      (1<<3)
+#define DBX_FLAG_COPY        (1<<4)
+#define DBX_FLAG_STREAM      (1<<5)
+#define DBX_FLAG_READ_ONLY   (1<<6)
+
+/* -------------------------------------------------------------------------- */
+
+/* per query options of dbx_query_format_ex(), dbx_query_const_ex() and their
+ * context variants, NULL means defaults.
+ * flags:
+ *   DBX_FLAG_BINARY - request results in binary format. Query is sent using
+ *                     extended query protocol, so it must be a single SQL
+ *                     statement. Use dbx_binary_as_* accessors to decode
+ *                     values.
+ *   DBX_FLAG_STREAM - pass rows to on_result as they come instead of the
+ *                     whole result. on_result is called for every row (or
+ *                     every chunk_rows rows) and then once more with empty
+ *                     PGRES_TUPLES_OK result, all of them with the same
+ *                     result index. Query is never pipelined.
+ *   DBX_FLAG_READ_ONLY - query could be executed by replica, see
+ *                     dbx_add_replica().
+ * chunk_rows:
+ *   rows per streamed result if libpq supports chunked rows mode
+ *   (LIBPQ_HAS_CHUNK_MODE), otherwise every row comes separately.
+ * priority:
+ *   priority class of request, classes share connections by their weights.
+ * deadline:
+ *   milliseconds for request to wait in queue, 0 - no limit. If request is
+ *   not sent in time, it is dropped with on_error "query deadline expired".
+ * timeout:
+ *   milliseconds for request to complete since it was sent, 0 - no limit.
+ *   Query running out of time is cancelled by server and reported with
+ *   on_error "query timeout expired". If server does not stop it in
+ *   DBX_CANCEL_GRACE, connection is dropped.
+ * cache_ttl:
+ *   milliseconds to keep results in cache, 0 - not cached. Works when cache
+ *   is enabled by dbx_set_cache(), COPY and streamed queries are never
+ *   cached. Key is the final SQL text (or statement and parameters) and
+ *   result format. Cached results are shared between requests and must not
+ *   be modified. Identical queries in flight are executed once, the others
+ *   wait for the results, errors included.
+ * */
+struct dbx_options
+{
+  int            flags;
+  int            chunk_rows;
+  dbx_priority_t priority;
+  int            deadline;
+  int            timeout;
+  int            cache_ttl;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* growable buffer of dbx_sql_vformat_to(). Data must be NULL or allocated by
+ * malloc(), it is reallocated when needed and should be freed by owner
+ * */
+struct dbx_sql_buffer
+{
+  char   * data;
+  size_t   size;
+  size_t   length;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* latency histogram buckets: 8 sub-buckets per power of two microseconds,
+ * values above 2^38 usec (about 76 hours) go to the last bucket */
+#define DBX_HISTOGRAM_BITS    3
+#define DBX_HISTOGRAM_BUCKETS \
+        ((38 - DBX_HISTOGRAM_BITS + 1) << DBX_HISTOGRAM_BITS)
+
+struct dbx_histogram
+{
+  uint64_t count;
+  uint64_t sum;                             /* usec */
+  uint64_t max;                             /* usec */
+  uint64_t buckets[DBX_HISTOGRAM_BUCKETS];
+};
 
 /* -------------------------------------------------------------------------- */
 
-typedef bool /* true - free result, false - keep result */
+/* metrics snapshot, counters grow since context creation, gauges are taken
+ * at the last touch.
+ * wait:  time from query call to sending of request
+ * first: time from sending to the first result
+ * exec:  time from sending to completion
+ * */
+struct dbx_metrics
+{
+  uint64_t queries;      /* completed requests */
+  uint64_t errors;       /* errors reported to requests */
+  uint64_t expired;      /* requests dropped by deadline */
+  uint64_t timeouts;     /* queries cancelled by timeout */
+  uint64_t reconnects;   /* failed or lost connections */
+  uint64_t saturations;  /* touches leaving queued requests without
+                            connection */
+  uint64_t cache_hits;   /* requests served from cache */
+  uint64_t coalesced;    /* requests joined identical query in flight */
+  uint64_t cache_size;   /* memory used by cached results */
+  uint64_t queued;       /* requests waiting for connection */
+  uint64_t active;       /* requests in flight */
+  uint64_t connections;  /* ready connections */
+  uint64_t connecting;   /* connections being established */
+  uint64_t down;         /* slots waiting for reconnect */
+
+  struct dbx_histogram wait;
+  struct dbx_histogram first;
+  struct dbx_histogram exec;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* engine instance: connections pool, requests queue and event loop. Context
+ * is driven by thread that created it: it must call dbx_context_touch(),
+ * dbx_context_cancel() and setters, callbacks are called there as well.
+ * Queries could be added from any thread, they are passed to owner through
+ * lock-free submission queue. Functions without context argument work with
+ * the context of dbx_init().
+ * */
+typedef struct dbx_context * dbx_context_t;
+
+/* -------------------------------------------------------------------------- */
+
+/* result is freed by dbx once callback returns, false stops callbacks of the
+ * rest of request results */
+typedef bool
 (*dbx_on_result_t)( PGresult   * result,
                     int          res_i,
                     void       * u_data);
@@ -57,6 +195,36 @@ typedef void
 
 /* -------------------------------------------------------------------------- */
 
+/* NOTIFY receiver, payload is empty string if it was not given */
+typedef void
+(*dbx_on_notify_t)( const char * channel,
+                    const char * payload,
+                    int          pid,
+                    void       * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+/* COPY FROM STDIN data producer, called whenever connection could take more
+ * data. Appends next chunk of data to buffer and returns CSTUFF_PENDING if
+ * more data follows, CSTUFF_SUCCESS if data is complete, any other code
+ * aborts COPY
+ * */
+typedef cstuff_retcode_t
+(*dbx_on_copy_in_t)( struct dbx_sql_buffer * buffer,
+                     void                  * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+/* COPY TO STDOUT data consumer, called for every received row. Returns false
+ * to skip the rest of data
+ * */
+typedef bool
+(*dbx_on_copy_out_t)( const char * data,
+                      int          size,
+                      void       * u_data );
+
+/* -------------------------------------------------------------------------- */
+
 #define dbx_escape(x) PQescapeLiteral(dbxConn, x, strlen(x))
 
 #define dbx_free(x)   PQfreemem(x)
@@ -78,9 +246,123 @@ dbx_release();
 
 /* -------------------------------------------------------------------------- */
 
+/* create context owned by the calling thread, e.g. one per worker thread
+ * with its own shard of connections
+ * */
+cstuff_retcode_t
+dbx_context_new( dbx_context_t * self,
+                 const char    * username,
+                 const char    * password,
+                 const char    * database,
+                 const char    * hostname,
+                 int             port,
+                 int             connections );
+
+/* -------------------------------------------------------------------------- */
+
+/* add read replica with its own sub-pool of connections to the same event
+ * loop. Queries with DBX_FLAG_READ_ONLY go to the ready replica with the least
+ * requests in flight, or to primary if no replica is ready. Other queries
+ * always go to primary (server of dbx_init() or dbx_context_new()). Must not
+ * be called from callbacks.
+ * */
+cstuff_retcode_t
+dbx_add_replica( const char * username,
+                 const char * password,
+                 const char * database,
+                 const char * hostname,
+                 int          port,
+                 int          connections );
+
+cstuff_retcode_t
+dbx_context_add_replica( dbx_context_t   self,
+                         const char    * username,
+                         const char    * password,
+                         const char    * database,
+                         const char    * hostname,
+                         int             port,
+                         int             connections );
+
+/* -------------------------------------------------------------------------- */
+
+void
+dbx_context_free( dbx_context_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* keep up to depth queries in flight per connection using libpq pipeline
+ * mode, 1 (default) disables pipelining. Pipelined queries are sent using
+ * extended query protocol, so each of them must be a single SQL statement.
+ * Queries of dbx_query_transaction() are never pipelined: they wait for an
+ * idle connection.
+ * */
+void
+dbx_set_pipeline( int depth );
+
+void
+dbx_context_set_pipeline( dbx_context_t self, int depth );
+
+/* -------------------------------------------------------------------------- */
+
+/* enable prepared statements mode of dbx_query_format(): SQL format string
+ * becomes statement, prepared once per connection, and parameters are sent
+ * separately as text values, so DBX_STRING and DBX_CONSTANT are not quoted.
+ * Up to cache_size statements are kept per connection, the least recently
+ * used one is deallocated to prepare a new one. 0 (default) disables the
+ * mode. Queries with DBX_STATEMENT parameters are always formatted inline.
+ * */
+void
+dbx_set_prepared( int cache_size );
+
+void
+dbx_context_set_prepared( dbx_context_t self, int cache_size );
+
+/* -------------------------------------------------------------------------- */
+
+/* enable results cache of queries with cache_ttl option, limited by memory
+ * size in bytes. The least recently used results are evicted when limit is
+ * exceeded. 0 (default) disables cache.
+ * */
+void
+dbx_set_cache( size_t limit );
+
+void
+dbx_context_set_cache( dbx_context_t self, size_t limit );
+
+/* -------------------------------------------------------------------------- */
+
+/* set reconnect delay limits in milliseconds. Failed slot is reconnected
+ * after random delay between half and full of min * 2^(failures-1), but not
+ * longer than max. Defaults are DBX_RECONNECT_MIN and DBX_RECONNECT_MAX
+ * */
+void
+dbx_set_reconnect_delay( int min, int max );
+
+void
+dbx_context_set_reconnect_delay( dbx_context_t self, int min, int max );
+
+/* -------------------------------------------------------------------------- */
+
+/* set share of connections for priority class: when several classes wait,
+ * each gets requests dispatched in proportion of its weight. Defaults are
+ * 8 for high, 4 for normal and 1 for low priority
+ * */
+void
+dbx_set_priority_weight( dbx_priority_t priority, int weight );
+
+void
+dbx_context_set_priority_weight( dbx_context_t  self,
+                                 dbx_priority_t priority,
+                                 int            weight );
+
+/* -------------------------------------------------------------------------- */
+
 cstuff_retcode_t
 dbx_touch();
 
+cstuff_retcode_t
+dbx_context_touch( dbx_context_t self );
+
 /* -------------------------------------------------------------------------- */
 
 char *
@@ -91,6 +373,18 @@ dbx_sql_format(const char * sql_format, int count, ...);
 char *
 dbx_sql_vformat(const char * sql_format, int count, va_list args );
 
+/* -------------------------------------------------------------------------- */
+
+/* append formatted sql to buffer in a single pass, escaping strings in place.
+ * Buffer data is null terminated on success, length is restored on failure.
+ * Returns CSTUFF_PARSE_ERROR if format refers to missing parameter
+ * */
+cstuff_retcode_t
+dbx_sql_vformat_to( struct dbx_sql_buffer * buffer,
+                    const char            * sql_format,
+                    int                     count,
+                    va_list                 args );
+
 
 /* -------------------------------------------------------------------------- */
 
@@ -106,6 +400,34 @@ dbx_query_format( const char      * sql_format,
 
 /* -------------------------------------------------------------------------- */
 
+uint64_t
+dbx_query_format_ex( const struct dbx_options * options,
+                     const char               * sql_format,
+                     dbx_on_result_t            on_result,
+                     dbx_on_error_t             on_error,
+                     void                     * u_data,
+                     int                        p_count,
+                     /* dbx_param_t       param_type,
+                      * __TYPE__          param,  */
+                                                ... );
+
+/* -------------------------------------------------------------------------- */
+
+/* options are optional */
+uint64_t
+dbx_context_query_format( dbx_context_t              self,
+                          const struct dbx_options * options,
+                          const char               * sql_format,
+                          dbx_on_result_t            on_result,
+                          dbx_on_error_t             on_error,
+                          void                     * u_data,
+                          int                        p_count,
+                          /* dbx_param_t       param_type,
+                           * __TYPE__          param,  */
+                                                     ... );
+
+/* -------------------------------------------------------------------------- */
+
 uint64_t
 dbx_query_const( const char      * sql,
                  dbx_on_result_t   on_result,
@@ -114,6 +436,25 @@ dbx_query_const( const char      * sql,
 
 /* -------------------------------------------------------------------------- */
 
+uint64_t
+dbx_query_const_ex( const struct dbx_options * options,
+                    const char               * sql,
+                    dbx_on_result_t            on_result,
+                    dbx_on_error_t             on_error,
+                    void                     * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t
+dbx_context_query_const( dbx_context_t              self,
+                         const struct dbx_options * options,
+                         const char               * sql,
+                         dbx_on_result_t            on_result,
+                         dbx_on_error_t             on_error,
+                         void                     * u_data );
+
+/* -------------------------------------------------------------------------- */
+
 uint64_t
 dbx_query_transaction( const char      * sql,
                        dbx_on_result_t   on_result,
@@ -122,20 +463,213 @@ dbx_query_transaction( const char      * sql,
 
 /* -------------------------------------------------------------------------- */
 
+uint64_t
+dbx_context_query_transaction( dbx_context_t     self,
+                               const char      * sql,
+                               dbx_on_result_t   on_result,
+                               dbx_on_error_t    on_error,
+                               void            * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+/* batch of statements executed in a single transaction by one round trip.
+ * Statements are formatted as for dbx_query_format(), each one must be
+ * a single SQL statement with its own callbacks: on_result gets its result
+ * with index 0. Error of statement aborts the batch: it is reported to the
+ * statement and to batch on_error with statement index (-1 if batch was not
+ * executed, count of statements if COMMIT failed). Batch on_result gets
+ * COMMIT result with index of count of statements. Batch could be reused
+ * after submission, it is reset.
+ * */
+typedef struct dbx_batch * dbx_batch_t;
+
+cstuff_retcode_t
+dbx_batch_new( dbx_batch_t * self );
+
+void
+dbx_batch_free( dbx_batch_t self );
+
+void
+dbx_batch_reset( dbx_batch_t self );
+
+int
+dbx_batch_get_count( dbx_batch_t self );
+
+cstuff_retcode_t
+dbx_batch_add( dbx_batch_t       self,
+               dbx_on_result_t   on_result,
+               dbx_on_error_t    on_error,
+               void            * u_data,
+               const char      * sql_format,
+               int               p_count,
+               /* dbx_param_t       param_type,
+                * __TYPE__          param,  */
+                                  ... );
+
+/* options are optional, batch is never cached */
+uint64_t
+dbx_batch_submit( dbx_batch_t                self,
+                  const struct dbx_options * options,
+                  dbx_on_result_t            on_result,
+                  dbx_on_error_t             on_error,
+                  void                     * u_data );
+
+uint64_t
+dbx_context_batch_submit( dbx_context_t              self,
+                          dbx_batch_t                batch,
+                          const struct dbx_options * options,
+                          dbx_on_result_t            on_result,
+                          dbx_on_error_t             on_error,
+                          void                     * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+/* subscribe to NOTIFY messages of channel. Notifications are received on a
+ * dedicated connection to primary server, handled by the same event loop.
+ * It is established on first touch after subscription and channels are
+ * subscribed again after reconnect, notifications sent while connection was
+ * down are lost. Subscription to the same channel replaces its callback.
+ * Should be called from the thread owning the context
+ * */
+cstuff_retcode_t
+dbx_listen( const char * channel, dbx_on_notify_t on_notify, void * u_data );
 
+cstuff_retcode_t
+dbx_context_listen( dbx_context_t     self,
+                    const char      * channel,
+                    dbx_on_notify_t   on_notify,
+                    void            * u_data );
+
+/* returns CSTUFF_NOT_FOUND if channel was not subscribed */
+cstuff_retcode_t
+dbx_unlisten( const char * channel );
+
+cstuff_retcode_t
+dbx_context_unlisten( dbx_context_t self, const char * channel );
+
+/* -------------------------------------------------------------------------- */
+
+/* bulk load: sql is COPY ... FROM STDIN statement of text, csv or binary
+ * format, data is streamed from on_data callback, on_result gets command
+ * result when COPY is over. COPY is never pipelined and is not retried if
+ * connection is lost, on_error is called instead
+ * */
+uint64_t
+dbx_copy_in( const char       * sql,
+             dbx_on_copy_in_t   on_data,
+             dbx_on_result_t    on_result,
+             dbx_on_error_t     on_error,
+             void             * u_data );
+
+uint64_t
+dbx_context_copy_in( dbx_context_t      self,
+                     const char       * sql,
+                     dbx_on_copy_in_t   on_data,
+                     dbx_on_result_t    on_result,
+                     dbx_on_error_t     on_error,
+                     void             * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+/* bulk export: sql is COPY ... TO STDOUT statement, rows are passed to
+ * on_data callback as they come, in binary format the first row is preceded
+ * by header and the last one is followed by trailer
+ * */
+uint64_t
+dbx_copy_out( const char        * sql,
+              dbx_on_copy_out_t   on_data,
+              dbx_on_result_t     on_result,
+              dbx_on_error_t      on_error,
+              void              * u_data );
+
+uint64_t
+dbx_context_copy_out( dbx_context_t       self,
+                      const char        * sql,
+                      dbx_on_copy_out_t   on_data,
+                      dbx_on_result_t     on_result,
+                      dbx_on_error_t      on_error,
+                      void              * u_data );
+
+/* -------------------------------------------------------------------------- */
+
+/* binary COPY data writers: stream starts with header, every row is a tuple
+ * of fields count followed by fields, stream ends with trailer. Field data
+ * must be in network byte order, NULL data makes NULL field
+ * */
+cstuff_retcode_t
+dbx_copy_binary_header( struct dbx_sql_buffer * buffer );
+
+cstuff_retcode_t
+dbx_copy_binary_tuple( struct dbx_sql_buffer * buffer, int n_fields );
+
+cstuff_retcode_t
+dbx_copy_binary_field( struct dbx_sql_buffer * buffer,
+                       const void            * data,
+                       int                     length );
+
+/* int2, int4 or int8 field of size 2, 4 or 8 */
+cstuff_retcode_t
+dbx_copy_binary_integer( struct dbx_sql_buffer * buffer,
+                         int64_t                 value,
+                         int                     size );
+
+/* float8 field */
+cstuff_retcode_t
+dbx_copy_binary_float( struct dbx_sql_buffer * buffer, double value );
+
+/* timestamp or timestamptz field */
+cstuff_retcode_t
+dbx_copy_binary_timestamp( struct dbx_sql_buffer * buffer,
+                           time_t                  ts,
+                           int32_t                 usec );
+
+cstuff_retcode_t
+dbx_copy_binary_trailer( struct dbx_sql_buffer * buffer );
+
+/* -------------------------------------------------------------------------- */
+
+/* cancel request, its callbacks will not be called anymore. Queued request is
+ * just dropped, query in flight is cancelled by server without blocking, so
+ * its connection returns to the pool. Note that with pipelining the server
+ * could already execute the next query of connection when cancel arrives.
+ * */
 cstuff_retcode_t
 dbx_cancel(uint64_t id);
 
+cstuff_retcode_t
+dbx_context_cancel( dbx_context_t self, uint64_t id );
+
 /* -------------------------------------------------------------------------- */
 
 const char *
 dbx_get_error();
 
+const char *
+dbx_context_get_error( dbx_context_t self );
+
 /* -------------------------------------------------------------------------- */
 
 int
 dbx_ready_connections_count();
 
+int
+dbx_context_ready_connections_count( dbx_context_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* take metrics snapshot, safe to be called from any thread */
+void
+dbx_get_metrics( struct dbx_metrics * metrics );
+
+void
+dbx_context_get_metrics( dbx_context_t self, struct dbx_metrics * metrics );
+
+/* upper bound of value in usec below which given percent (0..100] of
+ * histogram values fall, 0 if histogram is empty */
+uint64_t
+dbx_histogram_percentile( const struct dbx_histogram * histogram,
+                          double                       percent );
+
 /* -------------------------------------------------------------------------- */
 
 #define dbx_as_string( pg_result, row_num, col_num ) \
@@ -165,9 +699,118 @@ dbx_as_timestamp( PGresult * result, int row_num, int col_num, time_t * p_ts );
 
 /* -------------------------------------------------------------------------- */
 
+/* binary format accessors decode values of DBX_FLAG_BINARY queries directly
+ * from network byte order. Columns received in text format are parsed from
+ * text, so accessors could be used with any result.
+ * */
+
+/* int2, int4, int8 and oid columns */
+int64_t
+dbx_binary_as_integer( PGresult * result, int row_num, int col_num );
+
+/* -------------------------------------------------------------------------- */
+
+/* bool column */
+bool
+dbx_binary_as_bool( PGresult * result, int row_num, int col_num );
+
+/* -------------------------------------------------------------------------- */
+
+/* float4 and float8 columns */
+double
+dbx_binary_as_float( PGresult * result, int row_num, int col_num );
+
+/* -------------------------------------------------------------------------- */
+
+/* timestamp and timestamptz columns (timestamp is treated as UTC), p_usec is
+ * optional. Returns 0 on success, 1 if value is NULL, -1 on parse error or
+ * infinite timestamp
+ * */
+int
+dbx_binary_as_timestamp( PGresult * result,
+                         int        row_num,
+                         int        col_num,
+                         time_t   * p_ts,
+                         int32_t  * p_usec );
+
+/* -------------------------------------------------------------------------- */
+
+/* row mapping: result rows are decoded into array of structures described by
+ * fields of dbx_row_map in a single pass. Columns are resolved and their
+ * decoders are chosen once per result, values of binary and text format are
+ * supported. Array is allocated by malloc() in a single block together with
+ * copies of string values, so it does not depend on result: it could be
+ * used after on_result returns and result is freed, and cached results
+ * shared by requests are not modified. Caller frees it by free().
+ * NULL values are decoded as NULL string, 0 or false, use DBX_FIELD_IS_NULL
+ * to tell them apart.
+ * */
+typedef enum
+{
+  DBX_FIELD_STRING,     /* const char *                              */
+  DBX_FIELD_INT16,      /* int16_t, int2 column                      */
+  DBX_FIELD_INT32,      /* int32_t, int2, int4 and oid columns       */
+  DBX_FIELD_INT64,      /* int64_t, any integer column               */
+  DBX_FIELD_BOOL,       /* bool                                      */
+  DBX_FIELD_DOUBLE,     /* double, float4 and float8 columns         */
+  DBX_FIELD_TIMESTAMP,  /* time_t, timestamp and timestamptz columns */
+  DBX_FIELD_IS_NULL     /* bool, true if column value is NULL        */
+
+} dbx_field_t;
+
+struct dbx_field
+{
+  const char  * column;     /* column name */
+  dbx_field_t   type;
+  size_t        offset;     /* offset of structure member */
+};
+
+#define DBX_FIELD( struct_type, member, column, type ) \
+        { column, type, offsetof(struct_type, member) }
+
+struct dbx_row_map
+{
+  const struct dbx_field * fields;
+  int                      n_fields;
+  size_t                   row_size;  /* sizeof structure */
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* decode all rows of result into array of map->row_size structures to be
+ * freed by caller, p_rows gets NULL if there are no rows. Returns
+ * CSTUFF_NOT_FOUND if column does not exist in result, CSTUFF_PARSE_ERROR
+ * if binary column type does not fit field type or its value is malformed
+ * */
+cstuff_retcode_t
+dbx_map_rows( PGresult                 * result,
+              const struct dbx_row_map * map,
+              void                    ** p_rows,
+              int                      * p_count );
+
+/* -------------------------------------------------------------------------- */
+
+/* wait up to usec microseconds for any connection socket to become ready
+ * */
 int
 dbx_sleep(int usec);
 
+int
+dbx_context_sleep( dbx_context_t self, int usec );
+
+/* -------------------------------------------------------------------------- */
+
+/* get epoll descriptor watching all connections sockets. It becomes readable
+ * when dbx has events to handle, so it could be nested into application's
+ * own event loop, calling dbx_touch() on readiness and after new queries
+ * were added.
+ * */
+int
+dbx_get_fd();
+
+int
+dbx_context_get_fd( dbx_context_t self );
+
 /* -------------------------------------------------------------------------- */
 
 #endif
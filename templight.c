@@ -23,20 +23,33 @@
  * -------------------------------------------------------------------------- */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "str-utils.h"
-#include "str-builder.h"
 #include "retcodes.h"
 
 #include "templight.h"
 
-#ifndef TEMPLIGHT_BUFFER_SIZE
-#define TEMPLIGHT_BUFFER_SIZE 256
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_FD
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#endif
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_REGISTRY
+#include <time.h>
+#include <pthread.h>
 #endif
 
 #define TEMPLIGHT_GREEDY      1
@@ -44,7 +57,7 @@
 
 typedef enum
 {
-  PLAIN_NODE = 1,    /* data is HTML (char *) */
+  PLAIN_NODE = 1,    /* data is HTML in mapped template file (char *) */
   BLOCK_NODE,        /* data is another template (templight_t *) */
   VAR_NODE,        /* data is data is a value of label (char *) */
   LINK_NODE          /* data is a constant C string (const char *) */
@@ -86,13 +99,13 @@ node_free(node_t self)
   {
     switch(self->type)
     {
+      case PLAIN_NODE:
       case LINK_NODE:
         break;
 
       case BLOCK_NODE:
         templight_free( (templight_t) self->data );
         break;
-      case PLAIN_NODE:
       case VAR_NODE:
         free(self->data);
         break;
@@ -156,6 +169,8 @@ struct templight
   list_t       pairs;
   int          c_length;  /* content length */
   int          flags;
+  void       * map;       /* template file, owned by root template only */
+  size_t       map_size;
 };
 
 
@@ -221,7 +236,7 @@ _append_pair(templight_t block, char * key, node_t node)
       return NULL;
     }
 
-    pair->key = key; /* key is already allocated by str-builder */
+    pair->key = key; /* key is already allocated by str_ncopy() in _parse */
   }
 
 
@@ -231,21 +246,13 @@ _append_pair(templight_t block, char * key, node_t node)
 /* -------------------------------------------------------------------------- */
 
 templight_t
-_new_block(char * block_name, int length, int flags)
+_new_block(const char * block_name, int length, int flags)
 {
   templight_t self;
-  char * p=&block_name[length-1];
+  char      * p;
 
-  while(p>block_name)
-  {
-    if (*p==' ')
-    {
-      p--;
-      length--;
-    }
-    else
-      break;
-  }
+  while (length > 1 && block_name[length-1] == ' ')
+    length--;
 
   if ( (p = str_ncopy(block_name, length)) == NULL)
   {
@@ -259,6 +266,8 @@ _new_block(char * block_name, int length, int flags)
     self->pairs    = NULL;
     self->c_length = 0;
     self->flags    = flags;
+    self->map      = NULL;
+    self->map_size = 0;
   }
   else
     free(p);
@@ -268,260 +277,126 @@ _new_block(char * block_name, int length, int flags)
 
 /* -------------------------------------------------------------------------- */
 
+/* parse mapped template, static text nodes point to the mapping */
 static int
-_parse(FILE * fd, list_t stack)
+_parse(const char * data, size_t size, list_t stack)
 {
-  /* const */
-  enum {
-    MACRO_SEEK,
-    MACRO_VAR,
-    MACRO_BEGIN,
-    MACRO_END
-  };
-
-  const char c_begin_open[]  = "{:begin ",
-             c_begin_close[] = "}",
-             c_var_open[]    = "{:var ",
-             c_var_close[]   = "}",
-             c_end[]         = "{:end}";
-
-  /* vars */
-
-  int     b_size = TEMPLIGHT_BUFFER_SIZE - 1,
-          d_len = 0,
-          l, i,
-          cursor,
-          mode = MACRO_SEEK,
-          result;
-
-  char  * buffer;
-
-  str_builder_t s_bldr;
-
-  templight_t    pr = (templight_t) list_index(stack, stack->count-1),
-                 bl;
-
-  pair_t    pair;
-  node_t    node;
-
-  /* allocate resources */
-
-  if ( !(buffer = malloc( TEMPLIGHT_BUFFER_SIZE )) )
-    RAISE( CSTUFF_MALLOC_ERROR, finally );
-
-  if ( !(s_bldr = str_builder_new( 0 )) )
-    RAISE( CSTUFF_MALLOC_ERROR, release_buffer );
+  const char   c_begin[] = "{:begin ",
+               c_var[]   = "{:var ",
+               c_end[]   = "{:end}";
+
+  const char * end = data + size,
+             * cursor = data,  /* beginning of static text */
+             * p = data,
+             * name,
+             * close;
+
+  char       * key;
+  size_t       l;
+  node_type_t  type;
+  node_t       node;
+  templight_t  pr = (templight_t) list_index(stack, stack->count-1),
+               bl = NULL;
+  int          result;
 
-  /* read to buffer */
-  while( (l = fread(&buffer[d_len], 1, b_size - d_len, fd)) > 0 )
+  while ( p < end && (p = memchr(p, '{', end - p)) )
   {
-    /* printf("%d = fread(&buffer[%d], 1, %d-%d-1, fd)\n", l, d_len, b_size, d_len); */
-    d_len+=l;
-
-    buffer[d_len] = 0;
+    l = end - p;
 
-    cursor = 0;
-
-    for (i=0; i<d_len; i++)
+    if (l < 2 || p[1] != ':')
     {
-      if (mode == MACRO_SEEK)
-      {
-        if (strncmp(&buffer[i], c_begin_open, sizeof(c_begin_open)-1 ) == 0)
-        {
-          mode = MACRO_BEGIN;
-          l = sizeof(c_begin_open)-1;
-        }
-        else if (strncmp(&buffer[i], c_var_open, sizeof(c_var_open)-1)==0)
-        {
-          mode = MACRO_VAR;
-          l = sizeof(c_var_open)-1;
-        }
-        else if (strncmp(&buffer[i], c_end, sizeof(c_end)-1 ) == 0)
-        {
-          if (stack->count == 1)
-          {
-            /* return _print_error("closing of non-opened block", line); */
-            return CSTUFF_PARSE_ERROR;
-          }
-
-          /* close current plain node */
-          if (str_builder_append_chars(s_bldr, &buffer[ cursor ], i-cursor)==-1)
-            goto e_malloc;
-
-
-          if ( !(_append_node(pr, PLAIN_NODE, s_bldr->c_str, s_bldr->length)) )
-            goto e_malloc;
-
-          memset( s_bldr, 0, sizeof( struct str_builder ) );
-
-          list_remove_index(stack, stack->count-1);
-          pr = list_index(stack, stack->count-1);
-
-          i += sizeof(c_end)-1;
-        }
-        else
-        {
-          l = d_len - i;
-          if (
-               (l < sizeof( c_var_open ) -1 ) ||
-               (l < sizeof( c_begin_open ) -1 ) ||
-               (l < sizeof( c_end ) -1 )
-             )
-          {
-            break;
-          }
-
-          continue;
-        }
-
-        if (mode != MACRO_SEEK)
-        {
-          /* close current plain node */
-          if (str_builder_append_chars(s_bldr, &buffer[ cursor ], i-cursor)==-1)
-            goto e_malloc;
-
-
-          if ( !(_append_node(pr, PLAIN_NODE, s_bldr->c_str, s_bldr->length)) )
-            goto e_malloc;
-
-          memset( s_bldr, 0, sizeof( struct str_builder ) );
-
-          i+=l; /* add length of macro */
-        }
-
-        /* move cursor */
-        cursor = i;
-      }
+      p++;
+      continue;
+    }
 
-      if ( mode == MACRO_BEGIN )
-      {
-        if (strncmp(&buffer[i], c_begin_close, sizeof(c_begin_close)-1)==0)
-        {
-          if (str_builder_append_chars(s_bldr, &buffer[ cursor ], i-cursor)==-1)
-            goto e_malloc;
+    if ( l >= sizeof(c_var)-1 && !memcmp(p, c_var, sizeof(c_var)-1) )
+    {
+      type = VAR_NODE;
+      name = p + sizeof(c_var)-1;
+    }
+    else if ( l >= sizeof(c_begin)-1 &&
+              !memcmp(p, c_begin, sizeof(c_begin)-1) )
+    {
+      type = BLOCK_NODE;
+      name = p + sizeof(c_begin)-1;
+    }
+    else if ( l >= sizeof(c_end)-1 && !memcmp(p, c_end, sizeof(c_end)-1) )
+    {
+      type = PLAIN_NODE;
+      name = NULL;
+    }
+    else
+    {
+      p++;
+      continue;
+    }
 
+    /* close static text */
+    if ( p > cursor && !_append_node(pr, PLAIN_NODE, (char *) cursor,
+                                                      p - cursor) )
+      RAISE( CSTUFF_MALLOC_ERROR, finally );
 
-          if ( !(bl = _new_block( s_bldr->c_str, s_bldr->length, pr->flags )) )
-            goto e_malloc;
+    if (!name)
+    {
+      /* closing of non-opened block */
+      if (stack->count == 1)
+        RAISE( CSTUFF_PARSE_ERROR, finally );
 
-          if ( !(node=_append_node( pr, BLOCK_NODE, (void *) bl, 0)) )
-          {
-            templight_free(bl);
-            goto e_malloc;
-          }
+      list_remove_index(stack, stack->count-1);
+      pr = list_index(stack, stack->count-1);
 
-          if ( !(pair=_append_pair( pr, s_bldr->c_str, node)) )
-            goto e_malloc;
+      cursor = p = p + sizeof(c_end)-1;
+      continue;
+    }
 
-          memset( s_bldr, 0, sizeof( struct str_builder ) );
+    if ( !(close = memchr(name, '}', end - name)) )
+      RAISE( CSTUFF_PARSE_ERROR, finally );
 
-          if ( list_append(stack, (void*) bl) == -1)
-            goto e_malloc;
+    if ( !(key = str_ncopy(name, close - name)) )
+      RAISE( CSTUFF_MALLOC_ERROR, finally );
 
-          pr = bl;
+    if (type == VAR_NODE)
+    {
+      if ( !(node = _append_node(pr, VAR_NODE, NULL, 0)) )
+        RAISE( CSTUFF_MALLOC_ERROR, release_key );
+    }
+    else
+    {
+      if ( !(bl = _new_block(name, close - name, pr->flags)) )
+        RAISE( CSTUFF_MALLOC_ERROR, release_key );
 
-          i += (sizeof(c_begin_close)-1);
-        }
-        else if ( d_len-i < sizeof(c_begin_close)-1 )
-        {
-          break;  /* load more chars */
-        }
-        else
-          continue;
-      }
-      else if ( mode == MACRO_VAR )
+      if ( !(node = _append_node(pr, BLOCK_NODE, (void *) bl, 0)) )
       {
-        if (strncmp(&buffer[i], c_var_close, sizeof(c_var_close)-1)==0)
-        {
-          if (str_builder_append_chars(s_bldr, &buffer[ cursor ], i-cursor)==-1)
-            goto e_malloc;
-
-          if ( !(node=_append_node(pr, VAR_NODE, NULL, 0)) )
-            goto e_malloc;
-
-          if ( !(_append_pair(pr, s_bldr->c_str, node)) )
-            goto e_malloc;
-
-          memset( s_bldr, 0, sizeof( struct str_builder ) );
-
-          i += (sizeof(c_var_close)-1);
-        }
-        else if ( d_len-i < sizeof(c_var_close)-1 )
-        {
-          break;  /* load more chars */
-        }
-        else
-          continue;
+        templight_free(bl);
+        RAISE( CSTUFF_MALLOC_ERROR, release_key );
       }
+    }
 
-      mode = MACRO_SEEK;
-      cursor = i;
-
-    } /* end for */
+    if ( !_append_pair(pr, key, node) )
+      RAISE( CSTUFF_MALLOC_ERROR, release_key );
 
-    if ( cursor < i )
+    if (type == BLOCK_NODE)
     {
-      if (str_builder_append_chars(s_bldr, &buffer[ cursor ], i-cursor)==-1)
-        goto e_malloc;
+      if ( list_append(stack, (void*) bl) == -1 )
+        RAISE( CSTUFF_MALLOC_ERROR, finally );
 
-      /* printf("PLAIN 2: %s\n", s_bldr->c_str);
-      if ( !(_append_node(pr, PLAIN_NODE, s_bldr->c_str, s_bldr->length)) )
-        goto e_malloc;
-
-      memset( s_bldr, 0, sizeof( struct str_builder ) );
-      */
-
-      cursor=i;
-    }
-
-    if ((d_len -= i) < 0 )
-    {
-      d_len = 0;
-    }
-    else if (d_len > 0)
-    {
-      mode = MACRO_SEEK;
-      memmove( buffer, &buffer[i], d_len );
-      continue;
+      pr = bl;
     }
 
-
-  } /* end while */
-
-  /* add last plain node */
-  if (d_len)
-  {
-     if (str_builder_append_chars(s_bldr, &buffer[ cursor ], d_len)==-1)
-        goto e_malloc;
-
-     if ( !(_append_node(pr, PLAIN_NODE, s_bldr->c_str, s_bldr->length)) )
-        goto e_malloc;
-
-     memset( s_bldr, 0, sizeof( struct str_builder ) );
-
-  }
-
-  /* check stack */
-  if (stack->count > 1)
-  {
-     /*fprintf(stderr, "[templight] block is not closed %s\n",
-     ((templight_t) list_index(stack, stack->count-1))->name); */
-     result = CSTUFF_PARSE_ERROR;
-     goto e_malloc;
+    cursor = p = close + 1;
   }
 
-  result = CSTUFF_SUCCESS;
-  goto release;
-
-  /* release resources  */
-e_malloc:
-  result = CSTUFF_MALLOC_ERROR;
+  /* add last static text */
+  if ( end > cursor && !_append_node(pr, PLAIN_NODE, (char *) cursor,
+                                                      end - cursor) )
+    RAISE( CSTUFF_MALLOC_ERROR, finally );
 
-release:
-  str_builder_free( s_bldr, 1 );
+  /* check stack */
+  result = (stack->count > 1) ? CSTUFF_PARSE_ERROR : CSTUFF_SUCCESS;
+  goto finally;
 
-release_buffer:
-  free(buffer);
+release_key:
+  free(key);
 
 finally:
   return result;
@@ -626,35 +501,54 @@ int
 templight_new(templight_t * self, const char * name, const char * root)
 {
   list_t        stack;
-  FILE         *fd;
+  struct stat   st;
+  void         *map = NULL;
   char         *fpath;                         /* file path */
-  int           result = CSTUFF_SUCCESS;
+  int           fd,
+                result = CSTUFF_SUCCESS;
 
   if ( !(fpath = str_printf("%s/%s.tpl.html", root, name)) )
     return CSTUFF_MALLOC_ERROR;
 
-  if ( !(fd = fopen(fpath, "r")) )
+  if ( (fd = open(fpath, O_RDONLY)) == -1 )
     RAISE(CSTUFF_SYSCALL_ERROR, release_fpath);
 
+  if ( fstat(fd, &st) == -1 )
+    RAISE(CSTUFF_SYSCALL_ERROR, release_file);
+
+  /* empty file could not be mapped */
+  if ( st.st_size &&
+       (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+                                                              == MAP_FAILED )
+  {
+    map = NULL;
+    RAISE(CSTUFF_SYSCALL_ERROR, release_file);
+  }
+
   if ( !(stack = list_new(4)) ) /* stack for block tree */
-    RAISE(CSTUFF_MALLOC_ERROR, release_file);
+    RAISE(CSTUFF_MALLOC_ERROR, release_map);
 
   /* init object */
   if ( !(*self = malloc(sizeof(struct templight))) )
     RAISE(CSTUFF_MALLOC_ERROR, release_stack);
 
-  if ( ! ((*self)->name = str_copy(name)) )
-    RAISE( CSTUFF_MALLOC_ERROR, except );
-
+  (*self)->name     = NULL;
   (*self)->nodes    = NULL;
   (*self)->pairs    = NULL;
   (*self)->c_length = 0;
   (*self)->flags    = TEMPLIGHT_GREEDY;
+  (*self)->map      = map;
+  (*self)->map_size = st.st_size;
+
+  map = NULL; /* owned by template now */
+
+  if ( ! ((*self)->name = str_copy(name)) )
+    RAISE( CSTUFF_MALLOC_ERROR, except );
 
   if (list_append(stack, *self) == -1)
     RAISE( CSTUFF_MALLOC_ERROR, except );
 
-  result = _parse( fd, stack );
+  result = _parse( (*self)->map, (*self)->map_size, stack );
 
   if (result == CSTUFF_SUCCESS)
     goto finally;
@@ -668,8 +562,12 @@ finally:
 release_stack:
   list_free(stack, NULL);
 
+release_map:
+  if (map)
+    munmap(map, st.st_size);
+
 release_file:
-  fclose(fd);
+  close(fd);
 
 release_fpath:
   free( fpath );
@@ -692,6 +590,9 @@ templight_free(templight_t self)
     if (self->nodes)
       list_free(self->nodes, (list_destructor_t) node_free);
 
+    if (self->map)
+      munmap(self->map, self->map_size);
+
     free(self);
   }
 }
@@ -1244,7 +1145,9 @@ templight_dump(templight_t self)
 
     printf("--------------------------------------------------------------------------------\n");
     printf("Node: %d\n", n->type);
-    printf("Size: %d\nLength: %lu\n", n->size, (n->data) ? strlen(n->data) : 0);
+    printf("Size: %d\nLength: %lu\n", n->size,
+           (unsigned long) ((n->type == VAR_NODE && n->data) ?
+                                    strlen(n->data) : (size_t) n->size));
 
     switch (n->type)
     {
@@ -1280,3 +1183,1429 @@ finally:
 }
 
 #endif
+
+/* -------------------------------------------------------------------------- */
+
+/* compiled templates ------------------------------------------------------- */
+
+#ifndef TEMPLIGHT_CHUNK_SIZE
+#define TEMPLIGHT_CHUNK_SIZE 4096
+#endif
+
+#define TEMPLIGHT_OP_TEXT     1
+#define TEMPLIGHT_OP_VAR      2
+#define TEMPLIGHT_OP_BLOCK    3
+#define TEMPLIGHT_OP_END      4
+
+/* -------------------------------------------------------------------------- */
+
+struct templight_op
+{
+  uint32_t code;
+  uint32_t arg;     /* TEXT: blob offset, VAR: slot, BLOCK: scope */
+  uint32_t size;    /* TEXT: length, BLOCK: index of op following its END */
+};
+
+/* root template or block definition */
+struct templight_scope
+{
+  uint32_t name;    /* blob offset of label */
+  int      parent;
+  int      index;   /* index among blocks of parent */
+  uint32_t first;   /* first op */
+  int      n_slots;
+  int      n_blocks;
+};
+
+/* variable of scope */
+struct templight_var
+{
+  uint32_t name;    /* blob offset */
+  int      scope;
+  int      slot;
+};
+
+/* immutable after compilation, so it could be shared by threads */
+struct templight_program
+{
+  _Atomic int              refs;
+  char                   * name;
+  char                   * blob;     /* static text and names */
+  size_t                   blob_size;
+  struct templight_op    * ops;
+  int                      n_ops;
+  struct templight_scope * scopes;
+  int                      n_scopes;
+  struct templight_var   * vars;
+  int                      n_vars;
+  int                    * var_index;    /* hash of vars, -1 is empty */
+  int                    * block_index;  /* hash of block scopes */
+  uint32_t                 index_mask;
+};
+
+/* -------------------------------------------------------------------------- */
+
+struct templight_value
+{
+  const char * data;
+  size_t       size;
+};
+
+struct templight_instances
+{
+  templight_render_t head;
+  templight_render_t tail;
+};
+
+struct templight_chunk
+{
+  struct templight_chunk * next;
+  size_t                   size;
+  size_t                   used;
+  char                     data[];
+};
+
+/* values of program scope, blocks are allocated in chunks of root render */
+struct templight_render
+{
+  templight_program_t          program;
+  int                          scope;
+  templight_render_t           root;
+  templight_render_t           next;    /* next instance of the same block */
+  struct templight_chunk     * chunks;
+  struct templight_value     * values;
+  struct templight_instances * blocks;
+};
+
+typedef int
+(*_render_write_t)(void * ctx, const char * data, size_t size);
+
+/* -------------------------------------------------------------------------- */
+
+/* capacities of program arrays being compiled */
+struct templight_compiler
+{
+  templight_program_t program;
+  size_t              blob_size;
+  int                 ops_size;
+  int                 scopes_size;
+  int                 vars_size;
+  int               * var_index;    /* hash of vars compiled so far */
+  uint32_t            var_mask;
+};
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_grow(void ** array, int * size, int count, size_t item_size)
+{
+  void * data;
+  int    s;
+
+  if (count < *size)
+    return 0;
+
+  s = (*size) ? *size * 2 : 16;
+
+  if ( !(data = realloc(*array, s * item_size)) )
+    return -1;
+
+  *array = data;
+  *size  = s;
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_compile_blob(struct templight_compiler * c, const char * data, size_t size,
+                                                                int terminate)
+{
+  templight_program_t p = c->program;
+  char              * blob;
+  size_t              s = (c->blob_size) ? c->blob_size : 1024;
+  int                 offset = p->blob_size;
+
+  while (s < p->blob_size + size + terminate)
+    s *= 2;
+
+  if (s != c->blob_size)
+  {
+    if ( !(blob = realloc(p->blob, s)) )
+      return -1;
+
+    p->blob      = blob;
+    c->blob_size = s;
+  }
+
+  if (size)
+    memcpy(&p->blob[offset], data, size);
+
+  p->blob_size += size;
+
+  if (terminate)
+    p->blob[p->blob_size++] = 0;
+
+  return offset;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_compile_op(struct templight_compiler * c, uint32_t code, uint32_t arg,
+                                                          uint32_t size)
+{
+  templight_program_t   p = c->program;
+  struct templight_op * op;
+
+  if (_grow((void **) &p->ops, &c->ops_size, p->n_ops, sizeof(*op)) == -1)
+    return -1;
+
+  op = &p->ops[p->n_ops];
+  op->code = code;
+  op->arg  = arg;
+  op->size = size;
+
+  return p->n_ops++;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_compile_text(struct templight_compiler * c, const char * data, size_t size)
+{
+  templight_program_t   p = c->program;
+  struct templight_op * op = (p->n_ops) ? &p->ops[p->n_ops-1] : NULL;
+  int                   offset;
+
+  if ( (offset = _compile_blob(c, data, size, 0)) == -1 )
+    return -1;
+
+  /* text follows previous one in blob */
+  if ( op && op->code == TEMPLIGHT_OP_TEXT &&
+       op->arg + op->size == (uint32_t) offset )
+  {
+    op->size += size;
+    return 0;
+  }
+
+  return (_compile_op(c, TEMPLIGHT_OP_TEXT, offset, size) == -1) ? -1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* hash of name in scope */
+static uint32_t
+_hash(int scope, const char * name)
+{
+  uint32_t result = 2166136261U ^ ((uint32_t) scope * 2654435761U);
+
+  while (*name)
+    result = (result ^ (uint8_t) *(name++)) * 16777619U;
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* rebuild hash of compiled vars, so it stays at most half full */
+static int
+_compile_rehash(struct templight_compiler * c)
+{
+  templight_program_t p = c->program;
+  uint32_t            size = 16, h;
+  int                 i;
+
+  while (size < 4 * (uint32_t) p->n_vars)
+    size *= 2;
+
+  free(c->var_index);
+
+  if ( !(c->var_index = malloc(size * sizeof(int))) )
+    return -1;
+
+  memset(c->var_index, 0xFF, size * sizeof(int));
+  c->var_mask = size - 1;
+
+  for (i = 0; i < p->n_vars; i++)
+  {
+    h = _hash(p->vars[i].scope, &p->blob[ p->vars[i].name ]);
+
+    while (c->var_index[ h & c->var_mask ] != -1)
+      h++;
+
+    c->var_index[ h & c->var_mask ] = i;
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* get slot of scope variable, adding it if needed */
+static int
+_compile_var(struct templight_compiler * c, int scope, const char * name)
+{
+  templight_program_t    p = c->program;
+  struct templight_var * var;
+  uint32_t               h;
+  int                    i, offset;
+
+  if ( 2 * (uint32_t) p->n_vars >= c->var_mask && _compile_rehash(c) == -1 )
+    return -1;
+
+  for (h = _hash(scope, name); (i = c->var_index[ h & c->var_mask ]) != -1; h++)
+  {
+    var = &p->vars[i];
+    if (var->scope == scope && !strcmp(&p->blob[var->name], name))
+      return var->slot;
+  }
+
+  if ( (offset = _compile_blob(c, name, strlen(name), 1)) == -1 )
+    return -1;
+
+  if (_grow((void **) &p->vars, &c->vars_size, p->n_vars, sizeof(*var)) == -1)
+    return -1;
+
+  c->var_index[ h & c->var_mask ] = p->n_vars;
+
+  var = &p->vars[p->n_vars++];
+  var->name  = offset;
+  var->scope = scope;
+  var->slot  = p->scopes[scope].n_slots++;
+
+  return var->slot;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* flatten parsed block into ops, returns its scope or -1 */
+static int
+_compile_scope(struct templight_compiler * c, templight_t block,
+                                             int         parent,
+                                             const char * label)
+{
+  templight_program_t      p = c->program;
+  struct templight_scope * scope;
+  node_t                   n;
+  pair_t                   pair;
+  int                      s, i, op, slot,
+                           i_pair = 0;
+
+  if (_grow((void **) &p->scopes, &c->scopes_size, p->n_scopes,
+                                                   sizeof(*scope)) == -1)
+    return -1;
+
+  s = p->n_scopes++;
+  scope = &p->scopes[s];
+  memset(scope, 0, sizeof(*scope));
+
+  scope->parent = parent;
+  scope->index  = (parent != -1) ? p->scopes[parent].n_blocks++ : 0;
+  scope->first  = p->n_ops;
+
+  if ( (i = _compile_blob(c, label, strlen(label), 1)) == -1 )
+    return -1;
+
+  p->scopes[s].name = i;
+
+  for (i = 0; block->nodes && i < block->nodes->count; i++)
+  {
+    n = list_index(block->nodes, i);
+
+    switch (n->type)
+    {
+      case PLAIN_NODE:
+      case LINK_NODE:
+        if (!n->data || !n->size)
+          break;
+
+        if (_compile_text(c, n->data, n->size) == -1)
+          return -1;
+        break;
+
+      case VAR_NODE:
+        pair = list_index(block->pairs, i_pair++);
+
+        if ( (slot = _compile_var(c, s, pair->key ? pair->key : "")) == -1 ||
+             _compile_op(c, TEMPLIGHT_OP_VAR, slot, 0) == -1 )
+          return -1;
+        break;
+
+      case BLOCK_NODE:
+        /* instances of tree blocks are not compiled */
+        if (n->size == -1)
+          break;
+
+        pair = list_index(block->pairs, i_pair++);
+
+        if ( (op = _compile_op(c, TEMPLIGHT_OP_BLOCK, 0, 0)) == -1 )
+          return -1;
+
+        if ( (slot = _compile_scope(c, (templight_t) n->data, s,
+                                    pair->key ? pair->key : "")) == -1 )
+          return -1;
+
+        p->ops[op].arg  = slot;
+        p->ops[op].size = p->n_ops;
+        break;
+    }
+  }
+
+  return (_compile_op(c, TEMPLIGHT_OP_END, 0, 0) == -1) ? -1 : s;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* build open addressing indexes of variables and blocks */
+static int
+_compile_index(templight_program_t p)
+{
+  struct templight_scope * scope;
+  uint32_t                 size = 16, h;
+  int                      i;
+
+  while (size < 2 * (uint32_t) p->n_vars || size < 2 * (uint32_t) p->n_scopes)
+    size *= 2;
+
+  if ( !(p->var_index = malloc(size * sizeof(int))) ||
+       !(p->block_index = malloc(size * sizeof(int))) )
+    return -1;
+
+  memset(p->var_index, 0xFF, size * sizeof(int));
+  memset(p->block_index, 0xFF, size * sizeof(int));
+  p->index_mask = size - 1;
+
+  for (i = 0; i < p->n_vars; i++)
+  {
+    h = _hash(p->vars[i].scope, &p->blob[ p->vars[i].name ]);
+
+    while (p->var_index[ h & p->index_mask ] != -1)
+      h++;
+
+    p->var_index[ h & p->index_mask ] = i;
+  }
+
+  /* the first definition of label in scope wins */
+  for (i = 1; i < p->n_scopes; i++)
+  {
+    scope = &p->scopes[i];
+
+    if (templight_program_find_block(p, scope->parent,
+                                     &p->blob[ scope->name ]) != -1)
+      continue;
+
+    h = _hash(scope->parent, &p->blob[ scope->name ]);
+
+    while (p->block_index[ h & p->index_mask ] != -1)
+      h++;
+
+    p->block_index[ h & p->index_mask ] = i;
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_compile( templight_program_t * self, const char * name,
+                                               const char * root )
+{
+  struct templight_compiler c;
+  templight_t               tree;
+  int                       result;
+
+  if ( (result = templight_new(&tree, name, root)) != CSTUFF_SUCCESS )
+    return result;
+
+  memset(&c, 0, sizeof(c));
+
+  if ( !(c.program = calloc(1, sizeof(struct templight_program))) )
+    RAISE( CSTUFF_MALLOC_ERROR, release );
+
+  atomic_init(&c.program->refs, 1);
+
+  if ( !(c.program->name = str_copy(name)) )
+    RAISE( CSTUFF_MALLOC_ERROR, except );
+
+  if (_compile_scope(&c, tree, -1, name) == -1 || _compile_index(c.program))
+    RAISE( CSTUFF_MALLOC_ERROR, except );
+
+  *self = c.program;
+  goto release;
+
+except:
+  templight_program_free(c.program);
+
+release:
+  free(c.var_index);
+  templight_free(tree);
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+templight_program_free( templight_program_t self )
+{
+  if (self && atomic_fetch_sub_explicit(&self->refs, 1,
+                                        memory_order_acq_rel) == 1)
+  {
+    free(self->name);
+    free(self->blob);
+    free(self->ops);
+    free(self->scopes);
+    free(self->vars);
+    free(self->var_index);
+    free(self->block_index);
+    free(self);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+templight_program_t
+templight_program_ref( templight_program_t self )
+{
+  atomic_fetch_add_explicit(&self->refs, 1, memory_order_relaxed);
+  return self;
+}
+
+/* -------------------------------------------------------------------------- */
+
+const char *
+templight_program_get_name( templight_program_t self )
+{
+  return self->name;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_program_find_block( templight_program_t   self,
+                              int                   block,
+                              const char          * label )
+{
+  uint32_t h = _hash(block, label);
+  int      i;
+
+  while ( (i = self->block_index[ h & self->index_mask ]) != -1 )
+  {
+    if ( self->scopes[i].parent == block &&
+         !strcmp(&self->blob[ self->scopes[i].name ], label) )
+      return i;
+    h++;
+  }
+
+  return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_program_find_var( templight_program_t   self,
+                            int                   block,
+                            const char          * var_name )
+{
+  uint32_t h = _hash(block, var_name);
+  int      i;
+
+  while ( (i = self->var_index[ h & self->index_mask ]) != -1 )
+  {
+    if ( self->vars[i].scope == block &&
+         !strcmp(&self->blob[ self->vars[i].name ], var_name) )
+      return i;
+    h++;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "templight !- variable %s not defined\n", var_name);
+#endif
+
+  return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* allocate memory that lives until root render is freed */
+static void *
+_render_alloc( templight_render_t self, size_t size, size_t align )
+{
+  templight_render_t       root = self->root;
+  struct templight_chunk * chunk = root->chunks;
+  size_t                   used;
+
+  if (chunk)
+  {
+    used = (chunk->used + align - 1) & ~(align - 1);
+
+    if (used + size <= chunk->size)
+    {
+      chunk->used = used + size;
+      return &chunk->data[used];
+    }
+  }
+
+  used = (size > TEMPLIGHT_CHUNK_SIZE) ? size : TEMPLIGHT_CHUNK_SIZE;
+
+  if ( !(chunk = malloc(sizeof(struct templight_chunk) + used)) )
+    return NULL;
+
+  chunk->size  = used;
+  chunk->used  = size;
+  chunk->next  = root->chunks;
+  root->chunks = chunk;
+
+  return chunk->data;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* size of render with its values and blocks lists */
+static size_t
+_render_size( templight_program_t program, int scope )
+{
+  return sizeof(struct templight_render) +
+         program->scopes[scope].n_slots * sizeof(struct templight_value) +
+         program->scopes[scope].n_blocks * sizeof(struct templight_instances);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+_render_init( templight_render_t self, templight_program_t program,
+                                       int                 scope,
+                                       templight_render_t  root )
+{
+  memset(self, 0, _render_size(program, scope));
+
+  self->program = program;
+  self->scope   = scope;
+  self->root    = (root) ? root : self;
+  self->values  = (struct templight_value *) &self[1];
+  self->blocks  = (struct templight_instances *)
+                  &self->values[ program->scopes[scope].n_slots ];
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_new( templight_render_t * self, templight_program_t program )
+{
+  if ( !(*self = malloc(_render_size(program, 0))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  _render_init(*self, templight_program_ref(program), 0, NULL);
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+templight_render_free( templight_render_t self )
+{
+  struct templight_chunk * chunk;
+
+  if (self && self->root == self)
+  {
+    while ( (chunk = self->chunks) != NULL )
+    {
+      self->chunks = chunk->next;
+      free(chunk);
+    }
+
+    templight_program_free(self->program);
+    free(self);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_new_block( templight_render_t   self,
+                            templight_render_t * block,
+                            const char         * label )
+{
+  return templight_render_new_block_id(self, block,
+           templight_program_find_block(self->program, self->scope, label));
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_new_block_id( templight_render_t   self,
+                               templight_render_t * block,
+                               int                  block_id )
+{
+  templight_program_t          p = self->program;
+  struct templight_instances * instances;
+  int                          i = block_id;
+
+  if (i < 1 || i >= p->n_scopes || p->scopes[i].parent != self->scope)
+    return CSTUFF_NOT_FOUND;
+
+  if ( !(*block = _render_alloc(self, _render_size(p, i),
+                                      sizeof(void *))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  _render_init(*block, p, i, self->root);
+
+  instances = &self->blocks[ p->scopes[i].index ];
+
+  if (instances->tail)
+    instances->tail->next = *block;
+  else
+    instances->head = *block;
+
+  instances->tail = *block;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static struct templight_value *
+_render_get_value( templight_render_t self, int var_id )
+{
+  templight_program_t p = self->program;
+
+  if (var_id < 0 || var_id >= p->n_vars || p->vars[var_id].scope != self->scope)
+    return NULL;
+
+  return &self->values[ p->vars[var_id].slot ];
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_string( templight_render_t   self,
+                             const char         * var_name,
+                             const char         * value )
+{
+  return templight_render_set_string_id(self,
+           templight_program_find_var(self->program, self->scope, var_name),
+           value);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_string_id( templight_render_t   self,
+                                int                  var_id,
+                                const char         * value )
+{
+  struct templight_value * v;
+  char                   * data;
+  size_t                   size = (value) ? strlen(value) : 0;
+
+  if ( !(v = _render_get_value(self, var_id)) )
+    return CSTUFF_NOT_FOUND;
+
+  if ( !(data = _render_alloc(self, size, 1)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  if (size)
+    memcpy(data, value, size);
+
+  v->data = data;
+  v->size = size;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_integer( templight_render_t   self,
+                              const char         * var_name,
+                              int                  value )
+{
+  return templight_render_set_integer_id(self,
+           templight_program_find_var(self->program, self->scope, var_name),
+           value);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_integer_id( templight_render_t   self,
+                                 int                  var_id,
+                                 int                  value )
+{
+  struct templight_value * v;
+  char                   * data, buffer[12];
+  unsigned int             u = (value < 0) ? -(unsigned int) value
+                                              : (unsigned int) value;
+  int                      i = sizeof(buffer);
+
+  if ( !(v = _render_get_value(self, var_id)) )
+    return CSTUFF_NOT_FOUND;
+
+  do
+  {
+    buffer[--i] = '0' + u % 10;
+    u /= 10;
+  }
+  while (u);
+
+  if (value < 0)
+    buffer[--i] = '-';
+
+  if ( !(data = _render_alloc(self, sizeof(buffer) - i, 1)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  memcpy(data, &buffer[i], sizeof(buffer) - i);
+
+  v->data = data;
+  v->size = sizeof(buffer) - i;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_printf( templight_render_t   self,
+                             const char         * var_name,
+                             const char         * format, ... )
+{
+  va_list list;
+  int     result;
+
+  va_start(list, format);
+  result = templight_render_set_vprintf(self, var_name, format, list);
+  va_end(list);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_vprintf( templight_render_t   self,
+                              const char         * var_name,
+                              const char         * format,
+                              va_list              list )
+{
+  return templight_render_set_vprintf_id(self,
+           templight_program_find_var(self->program, self->scope, var_name),
+           format, list);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_printf_id( templight_render_t   self,
+                                int                  var_id,
+                                const char         * format, ... )
+{
+  va_list list;
+  int     result;
+
+  va_start(list, format);
+  result = templight_render_set_vprintf_id(self, var_id, format, list);
+  va_end(list);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_set_vprintf_id( templight_render_t   self,
+                                 int                  var_id,
+                                 const char         * format,
+                                 va_list              list )
+{
+  struct templight_value * v;
+  char                   * data;
+  va_list                  copy;
+  int                      size;
+
+  if ( !(v = _render_get_value(self, var_id)) )
+    return CSTUFF_NOT_FOUND;
+
+  va_copy(copy, list);
+  size = vsnprintf(NULL, 0, format, copy);
+  va_end(copy);
+
+  if (size < 0)
+    return CSTUFF_PARSE_ERROR;
+
+  if ( !(data = _render_alloc(self, size + 1, 1)) )
+    return CSTUFF_MALLOC_ERROR;
+
+  vsnprintf(data, size + 1, format, list);
+
+  v->data = data;
+  v->size = size;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* pass output of render to writer in order */
+static int
+_render_walk( templight_render_t self, _render_write_t write, void * ctx )
+{
+  templight_program_t   p = self->program;
+  struct templight_op * op = &p->ops[ p->scopes[self->scope].first ];
+  templight_render_t    block;
+  int                   result;
+
+  for (;;)
+  {
+    switch (op->code)
+    {
+      case TEMPLIGHT_OP_TEXT:
+        if (write(ctx, &p->blob[op->arg], op->size) == -1)
+          return CSTUFF_EXTCALL_ERROR;
+        op++;
+        break;
+
+      case TEMPLIGHT_OP_VAR:
+        if ( self->values[op->arg].size &&
+             write(ctx, self->values[op->arg].data,
+                        self->values[op->arg].size) == -1 )
+          return CSTUFF_EXTCALL_ERROR;
+        op++;
+        break;
+
+      case TEMPLIGHT_OP_BLOCK:
+        block = self->blocks[ p->scopes[op->arg].index ].head;
+
+        for (; block; block = block->next)
+        {
+          if ( (result = _render_walk(block, write, ctx)) != CSTUFF_SUCCESS )
+            return result;
+        }
+
+        op = &p->ops[ op->size ];
+        break;
+
+      default:
+        return CSTUFF_SUCCESS;
+    }
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_write_length( void * ctx, const char * data, size_t size )
+{
+  (void) data;
+  *((size_t *) ctx) += size;
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t
+templight_render_get_content_length( templight_render_t self )
+{
+  size_t result = 0;
+
+  _render_walk(self, _write_length, &result);
+
+  return result;
+}
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_AISL_STREAM
+
+static int
+_write_aisl_stream( void * ctx, const char * data, size_t size )
+{
+  return (aisl_write((aisl_stream_t) ctx, data, size) == -1) ? -1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_to_aisl_stream( templight_render_t self, aisl_stream_t s )
+{
+  return _render_walk(self, _write_aisl_stream, s);
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_FSTREAM
+
+static int
+_write_fstream( void * ctx, const char * data, size_t size )
+{
+  return (fwrite(data, 1, size, (FILE *) ctx) == size) ? 0 : -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_to_fstream( templight_render_t self, FILE * fstream )
+{
+  return _render_walk(self, _write_fstream, fstream);
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_FD
+
+#ifndef TEMPLIGHT_IOV_SIZE
+#ifdef IOV_MAX
+#define TEMPLIGHT_IOV_SIZE IOV_MAX
+#else
+#define TEMPLIGHT_IOV_SIZE 1024
+#endif
+#endif
+
+/* msec to wait for non-blocking descriptor to become writable, -1 is forever */
+#ifndef TEMPLIGHT_POLL_TIMEOUT
+#define TEMPLIGHT_POLL_TIMEOUT -1
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define TEMPLIGHT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define TEMPLIGHT_SEND_FLAGS 0
+#endif
+
+/* batch of output fragments, pointing to program blob and render values */
+struct templight_iov
+{
+  int          fd;
+  int          count;
+  bool         socket;   /* sendmsg() does not raise SIGPIPE */
+  struct iovec iov[ TEMPLIGHT_IOV_SIZE ];
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* write fragments by sendmsg() to socket, by writev() to other descriptors */
+static ssize_t
+_iov_write( struct templight_iov * batch, struct iovec * iov, int count )
+{
+  struct msghdr msg;
+  ssize_t       rc;
+
+  if (batch->socket)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = count;
+
+    rc = sendmsg(batch->fd, &msg, TEMPLIGHT_SEND_FLAGS);
+
+    if (rc != -1 || errno != ENOTSOCK)
+      return rc;
+
+    batch->socket = false;
+  }
+
+  return writev(batch->fd, iov, count);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_iov_flush( struct templight_iov * batch )
+{
+  struct iovec * iov = batch->iov;
+  int            count = batch->count;
+  ssize_t        rc;
+  struct pollfd  pfd;
+
+  while (count)
+  {
+    if ( (rc = _iov_write(batch, iov, count)) == -1 )
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+
+      /* page is written completely, so full socket buffer is waited for */
+      pfd.fd     = batch->fd;
+      pfd.events = POLLOUT;
+
+      if ( (rc = poll(&pfd, 1, TEMPLIGHT_POLL_TIMEOUT)) == 1 ||
+           (rc == -1 && errno == EINTR) )
+        continue;
+
+      if (!rc)
+        errno = ETIMEDOUT;
+
+      return -1;
+    }
+
+    if (!rc)
+      return -1;
+
+    /* skip written fragments and continue after partial write */
+    while (count && (size_t) rc >= iov->iov_len)
+    {
+      rc -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count)
+    {
+      iov->iov_base = (char *) iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+
+  batch->count = 0;
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+_write_iov( void * ctx, const char * data, size_t size )
+{
+  struct templight_iov * batch = ctx;
+
+  if (batch->count == TEMPLIGHT_IOV_SIZE && _iov_flush(batch) == -1)
+    return -1;
+
+  batch->iov[ batch->count ].iov_base = (void *) data;
+  batch->iov[ batch->count ].iov_len  = size;
+  batch->count++;
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_render_to_fd( templight_render_t self, int fd )
+{
+  struct templight_iov batch;
+  int                  result;
+
+  batch.fd     = fd;
+  batch.count  = 0;
+  batch.socket = true;
+
+  if ( (result = _render_walk(self, _write_iov, &batch)) != CSTUFF_SUCCESS )
+    return result;
+
+  return (_iov_flush(&batch) == -1) ? CSTUFF_SYSCALL_ERROR : CSTUFF_SUCCESS;
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_REGISTRY
+
+/* registry ----------------------------------------------------------------- */
+
+struct templight_entry
+{
+  struct templight_entry * next;
+  uint32_t                 hash;
+  char                   * name;
+  char                   * path;
+  templight_program_t      program;
+  struct timespec          mtime;
+  off_t                    size;
+  ino_t                    ino;
+  uint64_t                 checked_at;  /* msec */
+  bool                     loading;     /* compilation is in progress */
+};
+
+struct templight_registry
+{
+  char                    * root;
+  int                       interval;   /* msec between file checks */
+  struct templight_entry ** entries;    /* hash of compiled templates */
+  uint32_t                  mask;
+  uint32_t                  count;
+  pthread_mutex_t           lock;
+  pthread_cond_t            loaded;
+};
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t
+_time_msec()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+_entry_free( struct templight_entry * self )
+{
+  templight_program_free(self->program);
+  free(self->name);
+  free(self->path);
+  free(self);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static struct templight_entry *
+_registry_find( templight_registry_t self, const char * name, uint32_t hash )
+{
+  struct templight_entry * entry;
+
+  for (entry = self->entries[ hash & self->mask ]; entry; entry = entry->next)
+  {
+    if ( entry->hash == hash && !strcmp(entry->name, name) )
+      return entry;
+  }
+
+  return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* add entry of existing template file, path is freed on failure */
+static struct templight_entry *
+_registry_add( templight_registry_t   self,
+               const char           * name,
+               uint32_t               hash,
+               char                 * path )
+{
+  struct templight_entry ** entries,
+                          * entry,
+                          * next;
+  uint32_t                  i, size = self->mask + 1;
+
+  /* keep chains short, doubled table is rebuilt from old chains */
+  if (self->count >= size)
+  {
+    if ( !(entries = calloc(2 * size, sizeof(*entries))) )
+      goto except;
+
+    for (i = 0; i < size; i++)
+    {
+      for (entry = self->entries[i]; entry; entry = next)
+      {
+        next = entry->next;
+        entry->next = entries[ entry->hash & (2 * size - 1) ];
+        entries[ entry->hash & (2 * size - 1) ] = entry;
+      }
+    }
+
+    free(self->entries);
+    self->entries = entries;
+    self->mask    = 2 * size - 1;
+  }
+
+  if ( !(entry = calloc(1, sizeof(struct templight_entry))) )
+    goto except;
+
+  if ( !(entry->name = str_copy(name)) )
+  {
+    free(entry);
+    goto except;
+  }
+
+  entry->path = path;
+  entry->hash = hash;
+  entry->next = self->entries[ hash & self->mask ];
+  self->entries[ hash & self->mask ] = entry;
+  self->count++;
+
+  return entry;
+
+except:
+  free(path);
+  return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+_registry_remove( templight_registry_t self, struct templight_entry * entry )
+{
+  struct templight_entry ** p_entry;
+
+  p_entry = &self->entries[ entry->hash & self->mask ];
+
+  while (*p_entry != entry)
+    p_entry = &(*p_entry)->next;
+
+  *p_entry = entry->next;
+  self->count--;
+
+  _entry_free(entry);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_registry_new( templight_registry_t * self, const char * root,
+                                                     int          interval )
+{
+  templight_registry_t registry;
+
+  if ( !(registry = calloc(1, sizeof(struct templight_registry))) )
+    return CSTUFF_MALLOC_ERROR;
+
+  if ( !(registry->root = str_copy(root)) ||
+       !(registry->entries = calloc(16, sizeof(*registry->entries))) )
+  {
+    free(registry->root);
+    free(registry);
+    return CSTUFF_MALLOC_ERROR;
+  }
+
+  registry->mask     = 15;
+  registry->interval = (interval > 0) ? interval : 0;
+
+  pthread_mutex_init(&registry->lock, NULL);
+  pthread_cond_init(&registry->loaded, NULL);
+
+  *self = registry;
+
+  return CSTUFF_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void
+templight_registry_free( templight_registry_t self )
+{
+  struct templight_entry * entry;
+  uint32_t                 i;
+
+  if (self)
+  {
+    for (i = 0; i <= self->mask; i++)
+    {
+      while ( (entry = self->entries[i]) != NULL )
+      {
+        self->entries[i] = entry->next;
+        _entry_free(entry);
+      }
+    }
+
+    free(self->entries);
+    pthread_cond_destroy(&self->loaded);
+    pthread_mutex_destroy(&self->lock);
+    free(self->root);
+    free(self);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+templight_registry_get( templight_registry_t   self,
+                        const char           * name,
+                        templight_program_t  * program )
+{
+  struct templight_entry * entry;
+  templight_program_t      fresh = NULL,
+                           old = NULL;
+  struct stat              st;
+  char                   * path;
+  uint32_t                 hash = _hash(0, name);
+  uint64_t                 now = _time_msec();
+  int                      result = CSTUFF_SUCCESS;
+
+  pthread_mutex_lock(&self->lock);
+
+  /* the first compilation is awaited, reload is not. Entry without program
+   * is being compiled, it is removed if compilation fails */
+  while ( (entry = _registry_find(self, name, hash)) && !entry->program )
+    pthread_cond_wait(&self->loaded, &self->lock);
+
+  if (entry)
+  {
+    if ( entry->loading ||
+         now - entry->checked_at < (uint64_t) self->interval )
+      goto finally;
+
+    entry->checked_at = now;
+
+    /* removed file does not break working site */
+    if ( stat(entry->path, &st) == -1 ||
+         (st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+          st.st_mtim.tv_nsec == entry->mtime.tv_nsec &&
+          st.st_size == entry->size &&
+          st.st_ino == entry->ino) )
+      goto finally;
+  }
+  else
+  {
+    /* names of missing templates are not kept */
+    if ( !(path = str_printf("%s/%s.tpl.html", self->root, name)) )
+      RAISE( CSTUFF_MALLOC_ERROR, finally );
+
+    if (stat(path, &st) == -1)
+    {
+      free(path);
+      RAISE( CSTUFF_SYSCALL_ERROR, finally );
+    }
+
+    if ( !(entry = _registry_add(self, name, hash, path)) )
+      RAISE( CSTUFF_MALLOC_ERROR, finally );
+
+    entry->checked_at = now;
+  }
+
+  /* compile without lock, other threads keep getting the old version */
+  entry->loading = true;
+  pthread_mutex_unlock(&self->lock);
+
+  result = templight_compile(&fresh, name, self->root);
+
+  pthread_mutex_lock(&self->lock);
+  entry->loading = false;
+
+  /* broken change is not compiled again until the file is changed again */
+  entry->mtime = st.st_mtim;
+  entry->size  = st.st_size;
+  entry->ino   = st.st_ino;
+
+  if (result == CSTUFF_SUCCESS)
+  {
+    old            = entry->program;
+    entry->program = fresh;
+  }
+  else if (entry->program)
+    result = CSTUFF_SUCCESS_WITH_REMARK;
+  else
+  {
+    _registry_remove(self, entry);
+    entry = NULL;
+  }
+
+  pthread_cond_broadcast(&self->loaded);
+
+finally:
+  *program = (entry && entry->program) ? templight_program_ref(entry->program)
+                                       : NULL;
+  pthread_mutex_unlock(&self->lock);
+
+  /* renders of old version hold their own references */
+  templight_program_free(old);
+
+  return result;
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
@@ -26,6 +26,7 @@
 #define _CSTUFF_TEMPLIGHT_H_
 
 #include <stdarg.h>
+#include <stddef.h>
 
 #include "retcodes.h"
 
@@ -33,8 +34,27 @@
 
 typedef struct templight * templight_t;
 
+/* compiled template: flat immutable program of instructions with static text
+ * in a single blob. It is never modified after compilation, so threads could
+ * share it and render it at the same time
+ * */
+typedef struct templight_program * templight_program_t;
+
+/* values of compiled template for a single render: variables values and
+ * instances of blocks, program is not copied
+ * */
+typedef struct templight_render * templight_render_t;
+
+/* compiled templates of a directory, shared by threads and reloaded on change
+ * */
+typedef struct templight_registry * templight_registry_t;
+
 /* functions ---------------------------------------------------------------- */
 
+/* parse template file root/name.tpl.html. File stays mapped until template is
+ * freed and its static text is not copied, so update templates by rename()
+ * instead of rewriting them in place
+ * */
 int
 templight_new(templight_t * self, const char * name, const char * root);
 
@@ -139,5 +159,209 @@ templight_dump(templight_t self);
 
 #endif
 
+/* compiled templates ------------------------------------------------------- */
+
+/* compile template file root/name.tpl.html
+ * */
+int
+templight_compile( templight_program_t * self, const char * name,
+                                               const char * root );
+
+/* -------------------------------------------------------------------------- */
+
+/* release reference to program, program is freed with the last one
+ * */
+void
+templight_program_free( templight_program_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* get new reference to program, safe to be called from any thread
+ * */
+templight_program_t
+templight_program_ref( templight_program_t self );
+
+/* -------------------------------------------------------------------------- */
+
+const char *
+templight_program_get_name( templight_program_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* names of blocks and variables are resolved to ids at compilation, ids could
+ * be cached by caller to skip lookup with *_id functions. Root template is
+ * block TEMPLIGHT_ROOT
+ * */
+#define TEMPLIGHT_ROOT 0
+
+/* get id of block defined in given block, -1 if label is not defined
+ * */
+int
+templight_program_find_block( templight_program_t   self,
+                              int                   block,
+                              const char          * label );
+
+/* get id of variable of given block, -1 if it is not defined
+ * */
+int
+templight_program_find_var( templight_program_t   self,
+                            int                   block,
+                            const char          * var_name );
+
+/* -------------------------------------------------------------------------- */
+
+/* start render of program, render holds reference to program until it is
+ * freed
+ * */
+int
+templight_render_new( templight_render_t * self, templight_program_t program );
+
+/* -------------------------------------------------------------------------- */
+
+/* free render with all its blocks and values
+ * */
+void
+templight_render_free( templight_render_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* append instance of block defined in scope of render, instances are output
+ * in order of creation. Block is owned by root render and freed with it.
+ * Returns CSTUFF_NOT_FOUND if label is not defined
+ * */
+int
+templight_render_new_block( templight_render_t   self,
+                            templight_render_t * block,
+                            const char         * label );
+
+int
+templight_render_new_block_id( templight_render_t   self,
+                               templight_render_t * block,
+                               int                  block_id );
+
+/* -------------------------------------------------------------------------- */
+
+/* value setters copy value to memory of root render and set all variables of
+ * the name in render scope. Return CSTUFF_NOT_FOUND if variable is not
+ * defined in block of render
+ * */
+int
+templight_render_set_string( templight_render_t   self,
+                             const char         * var_name,
+                             const char         * value );
+
+int
+templight_render_set_integer( templight_render_t   self,
+                              const char         * var_name,
+                              int                  value );
+
+int
+templight_render_set_printf( templight_render_t   self,
+                             const char         * var_name,
+                             const char         * format, ... );
+
+int
+templight_render_set_vprintf( templight_render_t   self,
+                              const char         * var_name,
+                              const char         * format,
+                              va_list              list );
+
+int
+templight_render_set_string_id( templight_render_t   self,
+                                int                  var_id,
+                                const char         * value );
+
+int
+templight_render_set_integer_id( templight_render_t   self,
+                                 int                  var_id,
+                                 int                  value );
+
+int
+templight_render_set_printf_id( templight_render_t   self,
+                                int                  var_id,
+                                const char         * format, ... );
+
+int
+templight_render_set_vprintf_id( templight_render_t   self,
+                                 int                  var_id,
+                                 const char         * format,
+                                 va_list              list );
+
+/* -------------------------------------------------------------------------- */
+
+size_t
+templight_render_get_content_length( templight_render_t self );
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_AISL_STREAM
+
+int
+templight_render_to_aisl_stream( templight_render_t self, aisl_stream_t s );
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_FSTREAM
+
+int
+templight_render_to_fstream( templight_render_t self, FILE * fstream );
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_TO_FD
+
+/* write render to file or socket descriptor in batches of TEMPLIGHT_IOV_SIZE
+ * fragments, pointing directly to static text and values. Sockets are written
+ * by sendmsg() with MSG_NOSIGNAL, so closed peer is reported as EPIPE instead
+ * of SIGPIPE. Call returns when the whole page is written: partial writes are
+ * continued and non-blocking descriptor is waited for by poll() up to
+ * TEMPLIGHT_POLL_TIMEOUT msec (forever by default, ETIMEDOUT on expiration).
+ * CSTUFF_SYSCALL_ERROR means output is incomplete and connection should be
+ * closed, errno is kept. Event loop should not call it with descriptors of
+ * slow clients, as it stalls the loop
+ * */
+int
+templight_render_to_fd( templight_render_t self, int fd );
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef CSTUFF_TEMPLIGHT_WITH_REGISTRY
+
+/* registry of compiled templates of root directory, shared by threads.
+ * Template is compiled on first request and file modification is checked
+ * by stat() not often than every interval milliseconds (0 - on every get).
+ * Changed template is compiled by the thread which noticed it, meanwhile
+ * other threads get the previous version. Renders hold references to their
+ * programs, so they are not affected by reload. Only successfully compiled
+ * templates are kept, so unknown names do not grow the registry.
+ * */
+int
+templight_registry_new( templight_registry_t * self, const char * root,
+                                                     int          interval );
+
+/* -------------------------------------------------------------------------- */
+
+void
+templight_registry_free( templight_registry_t self );
+
+/* -------------------------------------------------------------------------- */
+
+/* get reference to compiled template, it must be released by
+ * templight_program_free(). Returns CSTUFF_SUCCESS_WITH_REMARK if changed
+ * template could not be compiled and the previous version is returned
+ * */
+int
+templight_registry_get( templight_registry_t   self,
+                        const char           * name,
+                        templight_program_t  * program );
+
+#endif
+
 /* -------------------------------------------------------------------------- */
 #endif